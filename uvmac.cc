@@ -1,24 +1,98 @@
 /*  This program computes an authenticaion tag for a file
 
-    usage: uvmac hashKeyFile padKeyFile inputFile messageNumber
+    usage: uvmac [options] hashKeyFile padKeyFile inputFile [inputFile...] messageNumber
+           uvmac tune [--dir D] [--size N] [profileFile]
+           uvmac serve [--port P] [--max-bytes N] hashKeyFile padKeyFile messageNumber
+           uvmac verify [options] hashKeyFile padKeyFile indexFile inputFile [inputFile...]
+           uvmac seal [--chunk N] hashKeyFile padKeyFile messageNumber input output
+           uvmac unseal hashKeyFile padKeyFile messageNumber input output
+
+    options:
+
+      --stats: print the number of bytes processed, the time spent loading
+        the hash key, looking up the pad, setting up the input buffer,
+        reading the input, hashing it and writing the tag, and the overall
+        throughput
+
+      --buffer-size N: size in bytes of the buffer the input is read into,
+        at least UVMAC_NHBYTES (default 3 MB). The input is read in parts of
+        N rounded down to a multiple of UVMAC_NHBYTES, and the buffer holds
+        16 more bytes for the zero padding of the last part. Small buffers
+        suit hosts running many streams; see README.md for the memory used
+        and the throughput by buffer size
+
+      --threads N: number of threads hashing each buffer (default 1)
+
+      --numa: with several threads, spread them over the NUMA nodes, each
+        part of the input buffer being in the memory of the node whose
+        threads hash it (see uvmacparallel.h); --stats then also prints the
+        bytes and throughput of each node
+
+      --huge-pages none|transparent|explicit: backing of the input buffer
+        (default transparent), see uvmacbuffer.h. The buffer is no larger
+        than the input file and is reused from one input file to the next.
+
+      --byte-order little|big: read the input as little-endian (x86) or
+        big-endian 64-bit words; the tags differ, so the verifier must use
+        the same order (default little, big when built with
+        UVMAC_PREFER_BIG_ENDIAN)
+
+      --no-cache: for inputs that will not be read again, keep them out of
+        the caches so that other programs keep theirs: the input is read
+        with non-temporal prefetches (the "streaming" kernel, whatever the
+        profile says) and each buffer read is dropped from the page cache
+        (posix_fadvise POSIX_FADV_DONTNEED; pages not yet written back
+        stay). Hashing is slower.
+
+      --decompress: tag the content of the inputs that are gzip files (when
+        built with zlib, UVMAC_ZLIB) or zstd files (when built with
+        UVMAC_ZSTD) rather than their compressed bytes, other inputs being
+        read as they are. The tag of file.gz is then that of the file it
+        decompresses to. Decompression runs on its own thread, into buffers
+        of the buffer size, while the hashing threads hash the previous one;
+        nothing is written to disk (see uvmacdecompress.h)
+
+      --no-profile: ignore the host profile. Otherwise the buffer size and
+        the number of threads not given on the command line, and the
+        hashing kernel, come from the profile written by "uvmac tune"
+        ($UVMAC_PROFILE, or else $HOME/.uvmac_profile), if any.
+
+      --trace FILE: save the read, hash, pad-bind and write spans in FILE as
+        a Chrome trace (see uvmactrace.h)
+
+      --checkpoint N: while hashing each input, also tag its first N, 2N,
+        3N... bytes (N rounded down to a multiple of UVMAC_NHBYTES), for
+        periodic tags of a long recording. Each checkpoint costs a few
+        multiplications, not a rehash of the prefix, and takes the next
+        part of padKeyFile after those of the inputs (from messageNumber +
+        the number of inputs on, across inputs). The lines
+        "offset messageNumber tag" go to inputFile.checkpoints; the tag of
+        offset bytes is the one uvmac writes for a file of offset + 1 bytes,
+        which leaves the last byte out.
+
+      --index FILE: also record the message number and tag of each input
+        in the tag index FILE, created if needed, under the absolute path of
+        the input; an input already in the index gets its new entry (see
+        uvmacindex.h)
 
     parameters:
 
       hashKeyFile: File containing the secret key to be used to choose the hash
         function within a universal family. This file is read in binary. It
-        should contain 160 (208) bytes for a tag length of 64 (128) bits (as set
-        by UVMAC_TAG_LEN). The 2 (4) last 64-bit values should be strictly
+        should contain 160 (208, 304) bytes for a tag length of 64 (128, 256)
+        bits (as set by UVMAC_TAG_LEN). The 2 (4, 8) last 64-bit values should be strictly
         smaller than 2^64 - 257 (0xfffffffffffffeff). The same hashKeyFile can
         be used to tag many different messages.
 
       padKeyFile: File containing the key to be used to encrypt the tag with
         one-time-pad. Each part of this key (as specified by messageNumber
         should be used for ONLY ONE tag. The length of this file should be at
-        least the length of the tag (8 (16) bytes for a tag of length 64 (128)
-        bits) times messageNumber+1.
+        least the length of the tag (8 (16, 32) bytes for a tag of length 64
+        (128, 256) bits) times messageNumber+1.
         
       inputFile: File containing the message to be authenticated. The file is
-        read in binary.
+        read in binary. With several input files, the i-th one (from 0) is
+        tagged with message number messageNumber+i.
 
       messageNumber: Number of the message, an integer >= 0. This is needed to
         select the relevant part of the one time pad key. Never use two times
@@ -26,7 +100,42 @@
 
     output format:
 
-      The tag is writen into a file in hexadecimal
+      The tag is writen into a file in hexadecimal, inputFile.tag for each
+      input file. Tags of 128 and 256 bits are written as one number, the
+      words after the first one with their leading zeros
+
+    tuning:
+
+      "uvmac tune" measures the hashing kernels and the number of threads
+      on N bytes in memory (default 256 MB), then the buffer sizes on a
+      file of N bytes in the directory D (default: the current one), and
+      writes the fastest settings to profileFile (default: the profile
+      path above). Settings that change the tags (UVMAC_TAG_LEN and
+      UVMAC_NHBYTES) are fixed at compile time and are not tuned.
+
+    service:
+
+      "uvmac serve" tags the messages sent to 127.0.0.1:P (default 7070)
+      with consecutive parts of padKeyFile, from messageNumber on, until
+      stopped; messages are at most N bytes long (default 64 MB). See
+      uvmacserve.h for the protocol and uvmacload.cc for a load generator.
+
+    verification:
+
+      "uvmac verify" looks each input up in the tag index indexFile written
+      with --index, hashes it with the part of padKeyFile of the message
+      number found there and prints "OK" or "FAILED" (or "not in the index")
+      after its name. It takes the options of tagging but --index, and exits
+      with 1 if any input fails.
+
+    sealed containers:
+
+      "uvmac seal" copies input to output ("-" for the standard streams) as
+      a tagged header and chunks of N bytes (default 1 MB, at most 64 MB)
+      each followed by its tag, then a tag of the whole data, using parts
+      of padKeyFile from messageNumber on. "uvmac unseal" checks such a container chunk by
+      chunk and writes out the data of each chunk only once it is checked.
+      See uvmacseal.h for the format.
 
     Written on 11 July 2020 by Jean-Daniel Bancal
     Last modified 02 Feb 2021
@@ -34,65 +143,639 @@
 
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 #include <string>
 #include <algorithm>
 #include <cstring>
+#include <cstdlib>
 #include <cassert>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
 #include "uvmaclib.h"
+#include "uvmaclib_internal.h"
+#include "uvmacbuffer.h"
+#include "uvmacparallel.h"
+#include "uvmactrace.h"
+#include "uvmacserve.h"
+#include "uvmactune.h"
+#include "uvmacindex.h"
+#include "uvmacseal.h"
+#include "uvmacdecompress.h"
 
 using namespace std;
 
+// Time spent in each step of the program, in seconds
+struct Stats
+{
+    double key = 0, pad = 0, buffer = 0, read = 0, hash = 0, output = 0;
+    uint64_t bytes = 0;
+};
+
+static double seconds_since(chrono::steady_clock::time_point t0)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+static void print_stats(const Stats &stats, double total, const ParallelHasher *hasher)
+{
+    cout << "bytes: " << stats.bytes << endl;
+    cout << "key: " << stats.key << " s" << endl;
+    cout << "pad: " << stats.pad << " s" << endl;
+    cout << "buffer: " << stats.buffer << " s" << endl;
+    cout << "read: " << stats.read << " s" << endl;
+    cout << "hash: " << stats.hash << " s" << endl;
+    cout << "output: " << stats.output << " s" << endl;
+    cout << "total: " << total << " s" << endl;
+    cout << "throughput: " << (total > 0 ? stats.bytes / total / 1e9 : 0) << " GB/s" << endl;
+
+    // Share of each node in the hashing, over the time spent hashing on
+    // all threads; remote bytes were in the memory of another node
+    if (hasher && hasher->numa_aware())
+        for (unsigned int d = 0; d < hasher->nodes(); ++d) {
+            ParallelHasher::NodeStats node = hasher->node_stats(d);
+            string name = "node" + to_string(node.id);
+            cout << name << "_threads: " << node.threads << endl;
+            cout << name << "_bytes: " << node.bytes << endl;
+            cout << name << "_remote_bytes: " << node.remote_bytes << endl;
+            cout << name << "_throughput: " << (hasher->run_seconds() > 0 ?
+                node.bytes / hasher->run_seconds() / 1e9 : 0) << " GB/s" << endl;
+        }
+
+    // Counters of the library itself, when built with UVMAC_STATS
+    uvmac_stats_t lib;
+    if (!uvmac_stats_snapshot(&lib))
+        return;
+    cout << "hashed_bytes: " << lib.bytes << endl;
+    cout << "blocks: " << lib.blocks << endl;
+    cout << "hashes: " << lib.hashes << endl;
+    cout << "tags: " << lib.tags << endl;
+    cout << "pad_slices: " << lib.pad_slices << endl;
+    cout << "threads: " << lib.threads << endl;
+    // Bucket b counts the messages of 2^(b-1) to 2^b - 1 bytes
+    for (int b = 0; b < UVMAC_STATS_BUCKETS; ++b)
+        if (lib.size_histogram[b])
+            cout << "messages_below_2^" << b << ": " << lib.size_histogram[b] << endl;
+}
+
+// Tags of the prefixes of the inputs, see --checkpoint
+struct Checkpoints
+{
+    uint64_t every = 0;     // bytes between checkpoints, a multiple of UVMAC_NHBYTES
+    ifstream pad;           // pad key file, one part read per checkpoint
+    uint64_t message = 0;   // message number of the next checkpoint
+};
+
+/* Writes a tag as in the .tag files: the words after the first one with
+   all their digits */
+static void write_tag(ostream &out, const uint64_t tag[])
+{
+    out << hex << tag[0] << setfill('0');
+    for (unsigned int lane = 1; lane < UVMAC_TAG_LEN/64; ++lane)
+        out << setw(16) << tag[lane];
+    out << dec << setfill(' ');
+}
+
+/* Tags the prefix of a file hashed so far, in seg with a hasher and in ctx
+   otherwise, with the next message number of checkpoints and writes
+   "offset messageNumber tag" to out */
+static bool write_checkpoint(ostream &out, uint64_t offset, const uvmax_ctx_t *ctx,
+                             const uvmac_segment_t &seg, bool segments,
+                             Checkpoints &checkpoints, Stats &stats)
+{
+    const unsigned int lanes = UVMAC_TAG_LEN/64;
+    uint64_t running_key[lanes], position = 0, tag[lanes];
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    {
+        TraceSpan span(TRACE_PAD, sizeof(running_key));
+        checkpoints.pad.seekg(checkpoints.message * lanes * 8, ios::beg);
+        checkpoints.pad.read((char*) running_key, sizeof(running_key));
+        if (!checkpoints.pad) {
+            cerr << "Error while reading from the pad key file for checkpoint "
+                 << checkpoints.message << endl;
+            return false;
+        }
+        if (segments)
+            tag[0] = uvmac_segment_tag(&seg, tag + 1, ctx, running_key, lanes, &position);
+        else
+            tag[0] = uvmac_checkpoint(ctx, tag + 1, running_key, lanes, &position);
+    }
+    stats.pad += seconds_since(t0);
+    out << offset << " " << checkpoints.message++ << " ";
+    write_tag(out, tag);
+    out << endl;
+    return (bool)out;
+}
+
+/* Hashes the file name into buffers of at most buf_len bytes from pool and
+   tags it with the next part of the pad: tag receives the value returned by
+   uvmac then the other lanes. With drop_cache, the pages of each part
+   hashed are dropped from the page cache. With decompress, a gzip or zstd
+   file is decompressed on another thread and its content hashed (see
+   uvmacdecompress.h). With checkpoints, the prefixes of every
+   checkpoints->every bytes are tagged too, in name.checkpoints */
+static bool hash_file(const string &name, uvmax_ctx_t *ctx, ParallelHasher *hasher,
+                      BufferPool &pool, unsigned int buf_len, bool drop_cache,
+                      bool decompress, uint64_t *running_key, uint64_t running_key_length,
+                      uint64_t *running_key_position, Stats &stats, uint64_t tag[],
+                      Checkpoints *checkpoints)
+{
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    ifstream file3;
+    streampos fileSize = 0;
+    if (!decompress) {
+        file3.open(name, ios::in | ios::binary | ios::ate);
+        if (!file3)
+        {
+            cerr << "Opening input file " << name << " failed" << endl;
+            return false;
+        }
+        fileSize = file3.tellg(); // get the file size
+        file3.seekg (0, ios::beg); // Go back at the beginning of the file
+    }
+    int fd = drop_cache ? open(name.c_str(), O_RDONLY) : -1;
+    stats.read += seconds_since(t0);
+    ofstream checkpoint_file;
+    if (checkpoints && checkpoints->every) {
+        checkpoint_file.open(name + ".checkpoints", ios::out);
+        if (!checkpoint_file) {
+            cerr << "Opening output file " << name << ".checkpoints failed" << endl;
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+    }
+    uint64_t res = 0, tagl[UVMAC_TAG_LEN/64] = {0};
+    uvmac_segment_t seg;
+    uvmac_segment_init(&seg);
+
+    // Appends whole blocks to the message
+    auto update = [&](unsigned char *p, unsigned int bytes) {
+        if (!bytes)
+            return;
+        if (hasher)
+            hasher->update(seg, p, bytes);
+        else
+            vhash_update(p, bytes, ctx);
+    };
+
+    /* Hashes the part m[0..n) at offset pos of the input, the last one when
+       last, cut at the checkpoints it holds (whole blocks into the input) */
+    auto hash_part = [&](unsigned char *m, unsigned int n, uint64_t pos, bool last) {
+        TraceSpan span(TRACE_HASH, n);
+        unsigned int done = 0;
+        if (checkpoint_file.is_open())
+            for (uint64_t at = (pos / checkpoints->every + 1) * checkpoints->every;
+                 at < pos + n + (last ? 0 : 1); at += checkpoints->every) {
+                update(m + done, (unsigned int)(at - pos) - done);
+                done = (unsigned int)(at - pos);
+                if (!write_checkpoint(checkpoint_file, at, ctx, seg, hasher != NULL,
+                                      *checkpoints, stats))
+                    return false;
+            }
+        if (!last)
+        {
+            assert((n % UVMAC_NHBYTES) == 0);
+            update(m + done, n - done);
+        }
+        else
+        {
+            // We need to complete the message with zeros up to the next 16
+            // bytes. An empty input is tagged as an empty message, so that
+            // every input takes one part of the pad
+            unsigned int end = n ? n-1 : 0;
+            for (unsigned int j(end); j < n+16; ++j)
+                m[j] = 0;
+            if (hasher) {
+                hasher->update(seg, m + done, end-done);
+                res = uvmac_segment_tag(&seg, tagl, ctx, running_key, running_key_length, running_key_position);
+            }
+            else
+                res = uvmac(m + done, end-done, tagl, ctx, running_key, running_key_length, running_key_position);
+        }
+        return true;
+    };
+
+    if (decompress) {
+        /* Parts of buf_len bytes, decompressed on another thread while the
+           previous one is hashed */
+        t0 = chrono::steady_clock::now();
+        Decompressor input(name, pool, buf_len);
+        stats.buffer += seconds_since(t0);
+        t0 = chrono::steady_clock::now();
+        unsigned char *m;
+        unsigned int n;
+        bool last, ok = true;
+        for (uint64_t pos = 0; ok && (m = input.next(n, last)); pos += n) {
+            stats.read += seconds_since(t0);
+            t0 = chrono::steady_clock::now();
+            ok = hash_part(m, n, pos, last);
+            input.release(m);
+            stats.hash += seconds_since(t0);
+            t0 = chrono::steady_clock::now();
+            stats.bytes += n;
+        }
+        stats.read += seconds_since(t0);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        if (!input.error().empty()) {
+            cerr << input.error() << endl;
+            return false;
+        }
+        if (!ok)
+            return false;
+    } else {
+        /* A buffer no longer than the file, taken from the pool. Only the
+           bytes after the last part read need to be zero */
+        t0 = chrono::steady_clock::now();
+        uint64_t rounded = ((uint64_t)fileSize + UVMAC_NHBYTES - 1) / UVMAC_NHBYTES * UVMAC_NHBYTES;
+        unsigned int len = (unsigned int)min((uint64_t)buf_len, rounded);
+        unsigned char *m = pool.acquire(len);
+        if (!m) {
+            cerr << "Could not allocate a buffer of " << len << " bytes" << endl;
+            return false;
+        }
+        if (hasher && hasher->numa_aware())
+            hasher->first_touch(m, len + 16);
+        stats.buffer += seconds_since(t0);
+        t0 = chrono::steady_clock::now();
+
+        /* Load data from file */
+        for (long int pos(0); pos < fileSize; )
+        {
+            unsigned int lengthToRead;
+            if ((fileSize - pos) < len)
+                lengthToRead = fileSize - pos;
+            else
+                lengthToRead = len;
+
+            {
+                TraceSpan span(TRACE_READ, lengthToRead);
+                file3.read((char*) m, lengthToRead);
+            }
+            bool ok = (file3.gcount() == lengthToRead) && file3;
+            if (!ok)
+                cerr << "File reading error. Read " << file3.gcount() << " bytes instead of " << lengthToRead << endl;
+            stats.read += seconds_since(t0);
+            t0 = chrono::steady_clock::now();
+            ok = ok && hash_part(m, lengthToRead, pos, pos + lengthToRead >= fileSize);
+            if (!ok)
+            {
+                pool.release(m);
+                if (fd >= 0)
+                    close(fd);
+                return false;
+            }
+            stats.hash += seconds_since(t0);
+            t0 = chrono::steady_clock::now();
+            if (fd >= 0)
+                posix_fadvise(fd, pos, lengthToRead, POSIX_FADV_DONTNEED);
+            pos += lengthToRead;
+            stats.bytes += lengthToRead;
+        }
+        if (fileSize == 0)
+            hash_part(m, 0, 0, true);
+        file3.close();
+        if (fd >= 0)
+            close(fd);
+        pool.release(m);
+        stats.read += seconds_since(t0);
+    }
+    tag[0] = res;
+    for (unsigned int lane = 1; lane < UVMAC_TAG_LEN/64; ++lane)
+        tag[lane] = tagl[lane-1];
+    return true;
+}
+
+/* Tags the file name as hash_file does and writes the tag to name.tag */
+static bool tag_file(const string &name, uvmax_ctx_t *ctx, ParallelHasher *hasher,
+                     BufferPool &pool, unsigned int buf_len, bool drop_cache,
+                     bool decompress, uint64_t *running_key, uint64_t running_key_length,
+                     uint64_t *running_key_position, Stats &stats, uint64_t tag[],
+                     Checkpoints *checkpoints)
+{
+    if (!hash_file(name, ctx, hasher, pool, buf_len, drop_cache, decompress, running_key,
+                   running_key_length, running_key_position, stats, tag, checkpoints))
+        return false;
+
+    // If all is good we save the result in the output file
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    {
+        TraceSpan span(TRACE_WRITE, UVMAC_TAG_LEN/8);
+        ofstream file4;
+        file4.open(name + ".tag", ios::out);
+        if (!file4)
+        {
+            cerr << "Opening output file " << name << ".tag failed" << endl;
+            return false;
+        }
+        write_tag(file4, tag);
+        file4.close();
+    }
+    stats.output += seconds_since(t0);
+    return true;
+}
+
+/* The key of a file in a tag index: its absolute path, without symbolic
+   links, so that it does not depend on the directory uvmac is run from */
+static string index_key(const string &name)
+{
+    char *path = realpath(name.c_str(), NULL);
+    if (!path)
+        return name;
+    string key(path);
+    free(path);
+    return key;
+}
+
+/* Checks each input against the message number and tag recorded for it in
+   index, hashing it with the pad words of that message number read from
+   pad_file; prints one line per input and returns the number of inputs that
+   are missing from the index or whose tag differs */
+static int verify_files(const TagIndex &index, const string &pad_file, const vector<string> &inputs,
+                        uvmax_ctx_t *ctx, ParallelHasher *hasher, BufferPool &pool,
+                        unsigned int buf_len, bool drop_cache, bool decompress, Stats &stats)
+{
+    const unsigned int lanes = UVMAC_TAG_LEN/64;
+    ifstream pad;
+    pad.open(pad_file, ios::in | ios::binary);
+    if (!pad) {
+        cerr << "Opening pad key file " << pad_file << " failed" << endl;
+        return (int)inputs.size();
+    }
+    int failures = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        uint64_t message, expected[lanes], tag[lanes], running_key[lanes], position = 0;
+        if (!index.find(index_key(inputs[i]), message, expected)) {
+            cout << inputs[i] << ": not in the index" << endl;
+            ++failures;
+            continue;
+        }
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        {
+            TraceSpan span(TRACE_PAD, sizeof(running_key));
+            pad.seekg(message * lanes * 8, ios::beg);
+            pad.read((char*) running_key, sizeof(running_key));
+        }
+        stats.pad += seconds_since(t0);
+        if (!pad) {
+            cerr << "Error while reading from the pad key file " << pad_file << endl;
+            pad.clear();
+            ++failures;
+            continue;
+        }
+        if (!hash_file(inputs[i], ctx, hasher, pool, buf_len, drop_cache, decompress,
+                       running_key, lanes, &position, stats, tag, NULL)) {
+            ++failures;
+            continue;
+        }
+        bool ok = memcmp(tag, expected, sizeof(tag)) == 0;
+        cout << inputs[i] << ": " << (ok ? "OK" : "FAILED") << endl;
+        if (!ok)
+            ++failures;
+    }
+    return failures;
+}
+
 int main(int argc, char* argv[])
 {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now(), t0;
+    Stats stats;
+
+    // Host tuning
+    if (argc > 1 && strcmp(argv[1], "tune") == 0) {
+        const char *dir = ".", *profile_file = 0;
+        uint64_t size = UINT64_C(256) << 20;
+        for (int i = 2; i < argc; ++i) {
+            if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+                dir = argv[++i];
+            else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+                size = strtoull(argv[++i], NULL, 0);
+            else if (argv[i][0] != '-' && !profile_file)
+                profile_file = argv[i];
+            else {
+                cerr << "Usage: " << argv[0] << " tune [--dir D] [--size N] [profileFile]" << endl;
+                return 1;
+            }
+        }
+        return uvmac_tune(profile_file, dir, size);
+    }
+
+    // Tagging service
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        int port = 7070, i = 2;
+        uint64_t max_bytes = UINT64_C(64) << 20;
+        for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0; i += 2) {
+            if (strcmp(argv[i], "--port") == 0)
+                port = atoi(argv[i+1]);
+            else if (strcmp(argv[i], "--max-bytes") == 0)
+                max_bytes = strtoull(argv[i+1], NULL, 0);
+            else
+                break;
+        }
+        if (argc - i != 3) {
+            cerr << "Usage: " << argv[0] << " serve [--port P] [--max-bytes N] "
+                 << "hashKeyFile padKeyFile messageNumber" << endl;
+            return 1;
+        }
+        return uvmac_serve(argv[i], argv[i+1], strtoull(argv[i+2], NULL, 0), port, max_bytes);
+    }
+
+    // Sealed containers
+    if (argc > 1 && (strcmp(argv[1], "seal") == 0 || strcmp(argv[1], "unseal") == 0)) {
+        bool seal = strcmp(argv[1], "seal") == 0;
+        uint64_t chunk_bytes = UINT64_C(1) << 20;
+        int i = 2;
+        if (seal && i + 1 < argc && strcmp(argv[i], "--chunk") == 0) {
+            chunk_bytes = strtoull(argv[i+1], NULL, 0);
+            i += 2;
+        }
+        if (argc - i != 5 || chunk_bytes < UVMAC_NHBYTES || chunk_bytes > UVMAC_SEAL_MAX_CHUNK) {
+            cerr << "Usage: " << argv[0] << " seal [--chunk N] hashKeyFile padKeyFile messageNumber input output" << endl;
+            cerr << "       " << argv[0] << " unseal hashKeyFile padKeyFile messageNumber input output" << endl;
+            cerr << "  N is from " << UVMAC_NHBYTES << " bytes to " << (UVMAC_SEAL_MAX_CHUNK >> 20)
+                 << " MB (default 1 MB), '-' reads or writes the standard streams" << endl;
+            return 1;
+        }
+        if (seal)
+            return uvmac_seal(argv[i], argv[i+1], strtoull(argv[i+2], NULL, 0), argv[i+3], argv[i+4],
+                              (unsigned int)(chunk_bytes - chunk_bytes % UVMAC_NHBYTES));
+        return uvmac_unseal(argv[i], argv[i+1], strtoull(argv[i+2], NULL, 0), argv[i+3], argv[i+4]);
+    }
+
+    // Verification takes the same options as tagging
+    bool verify = argc > 1 && strcmp(argv[1], "verify") == 0;
+
+    // Options come before the parameters
+    bool show_stats = false, use_profile = true, buf_len_set = false, drop_cache = false;
+    bool decompress = false;
+    const char *trace_file = 0, *index_file = 0;
+    unsigned int buf_len = 3 * (1 << 20);
+    unsigned int threads = 0;
+    Checkpoints checkpoints;
+    BufferPool::HugePages huge_pages = BufferPool::HUGE_TRANSPARENT;
+    bool numa = false;
+    int big_endian = UVMAC_PREFER_BIG_ENDIAN;
+    int arg = verify ? 2 : 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg++];
+        if (option == "--stats")
+            show_stats = true;
+        else if (option == "--buffer-size" && arg < argc) {
+            long long value = atoll(argv[arg++]);
+            if (value < UVMAC_NHBYTES || value > (1LL << 31)) {
+                cerr << "The buffer size must be at least " << UVMAC_NHBYTES << " bytes" << endl;
+                return 1;
+            }
+            buf_len = (unsigned int)value;
+            buf_len_set = true;
+        } else if (option == "--threads" && arg < argc) {
+            int value = atoi(argv[arg++]);
+            if (value <= 0) {
+                cerr << "The number of threads must be positive" << endl;
+                return 1;
+            }
+            threads = value;
+        } else if (option == "--huge-pages" && arg < argc) {
+            string value = argv[arg++];
+            if (value == "none")
+                huge_pages = BufferPool::HUGE_NONE;
+            else if (value == "transparent")
+                huge_pages = BufferPool::HUGE_TRANSPARENT;
+            else if (value == "explicit")
+                huge_pages = BufferPool::HUGE_EXPLICIT;
+            else {
+                cerr << "Huge pages must be none, transparent or explicit" << endl;
+                return 1;
+            }
+        } else if (option == "--numa")
+            numa = true;
+        else if (option == "--byte-order" && arg < argc) {
+            string value = argv[arg++];
+            if (value != "little" && value != "big") {
+                cerr << "The byte order must be little or big" << endl;
+                return 1;
+            }
+            big_endian = (value == "big");
+        }
+        else if (option == "--no-cache")
+            drop_cache = true;
+        else if (option == "--decompress")
+            decompress = true;
+        else if (option == "--no-profile")
+            use_profile = false;
+        else if (option == "--trace" && arg < argc) {
+            trace_file = argv[arg++];
+            Trace::instance().start();
+        } else if (option == "--index" && arg < argc && !verify)
+            index_file = argv[arg++];
+        else if (option == "--checkpoint" && arg < argc && !verify) {
+            long long value = atoll(argv[arg++]);
+            if (value < UVMAC_NHBYTES) {
+                cerr << "The checkpoint interval must be at least " << UVMAC_NHBYTES << " bytes" << endl;
+                return 1;
+            }
+            checkpoints.every = value - value % UVMAC_NHBYTES;
+        }
+        else {
+            cerr << "Unknown option " << option << endl;
+            return 1;
+        }
+    }
+
     // Check the number of parameters
-    if (argc != 5) {
+    if (argc - arg < 4) {
         // Tell the user how to run the program
-#if (UVMAC_TAG_LEN == 64)
-        cout << "This program creates a 64-bit authentication tag for a file" << endl;
-#else
-        cout << "This program creates a 128-bit authentication tag for a file" << endl;
-#endif
+        cout << "This program creates a " << UVMAC_TAG_LEN << "-bit authentication tag for a file" << endl;
         cout << endl;
         cout << "Usage: " << endl;
-        cout << "    " << argv[0] << " hashKeyFile padKeyFile inputFile messageNumber" << endl;
+        cout << "    " << argv[0] << " [options] hashKeyFile padKeyFile inputFile [inputFile...] messageNumber" << endl;
+        cout << endl;
+        cout << "  Options:" << endl;
+        cout << "    --stats: print the time spent in each step and the throughput" << endl;
+        cout << "    --buffer-size N: size of the input buffer in bytes, at least " << UVMAC_NHBYTES << " (default 3 MB)" << endl;
+        cout << "    --trace FILE: save the time spent in each step as a Chrome trace" << endl;
+        cout << "    --threads N: number of threads hashing the input (default 1)" << endl;
+        cout << "    --huge-pages none|transparent|explicit: pages of the input buffer (default transparent)" << endl;
+        cout << "    --numa: spread the hashing threads and the input buffer over the NUMA nodes" << endl;
+        cout << "    --byte-order little|big: byte order of the input words (default "
+             << (UVMAC_PREFER_BIG_ENDIAN ? "big" : "little") << ")" << endl;
+        cout << "    --no-cache: keep the input out of the cpu and page caches (slower)" << endl;
+        cout << "    --decompress: tag the content of gzip and zstd inputs, decompressed on another thread" << endl;
+        cout << "    --no-profile: ignore the host profile written by '" << argv[0] << " tune'" << endl;
+        cout << "    --checkpoint N: also tag the first N, 2N... bytes of each input in 'inputFile'.checkpoints" << endl;
+        cout << "    --index FILE: also record the message number and tag of each input in the tag index FILE" << endl;
+        cout << endl;
+        cout << "  Verification:" << endl;
+        cout << "    " << argv[0] << " verify [options] hashKeyFile padKeyFile indexFile inputFile [inputFile...]" << endl;
+        cout << "      checks each input against its entry in the tag index, see uvmacindex.h" << endl;
+        cout << endl;
+        cout << "  Tuning:" << endl;
+        cout << "    " << argv[0] << " tune [--dir D] [--size N] [profileFile]" << endl;
+        cout << "      measures this host and writes the fastest settings to profileFile" << endl;
+        cout << "      (default " << uvmac_profile_path() << ")" << endl;
+        cout << endl;
+        cout << "  Service:" << endl;
+        cout << "    " << argv[0] << " serve [--port P] [--max-bytes N] hashKeyFile padKeyFile messageNumber" << endl;
+        cout << "      tags the messages sent to 127.0.0.1:P (default 7070), see uvmacserve.h" << endl;
+        cout << endl;
+        cout << "  Sealed containers:" << endl;
+        cout << "    " << argv[0] << " seal [--chunk N] hashKeyFile padKeyFile messageNumber input output" << endl;
+        cout << "    " << argv[0] << " unseal hashKeyFile padKeyFile messageNumber input output" << endl;
+        cout << "      chunks of N bytes (default 1 MB), each checked before it is passed on, see uvmacseal.h" << endl;
         cout << endl;
         cout << "  Parameters:" << endl;
         cout << "    hashKeyFile: key to be used to choose the hash function, in binary format" << endl;
-#if (UVMAC_TAG_LEN == 64)
-        cout << "      This file should contain 160 bytes." << endl;
-        cout << "      The two last 64-bit registers should be smaller than 0xfffffffffffffeff." << endl;
-#else
-        cout << "      This file should contain 208 bytes" << endl;
-        cout << "      The four last 64-bit registers should be smaller than 0xfffffffffffffeff." << endl;
-#endif
+        cout << "      This file should contain " << 8*UVMAC_KEY_LEN << " bytes." << endl;
+        cout << "      The " << 2*UVMAC_TAG_LEN/64 << " last 64-bit registers should be smaller than 0xfffffffffffffeff." << endl;
         cout << "    padKeyFile: the key to be used for one-time pad, in binary format" << endl;
-#if (UVMAC_TAG_LEN == 64)
-        cout << "      This file should contain at least 8*(messageNumber+1) bytes" << endl;
-#else
-        cout << "      This file should contain at least 16*(messageNumber+1) bytes" << endl;
-#endif
-        cout << "    inputFile: file to be authenticated" << endl;
+        cout << "      This file should contain at least " << UVMAC_TAG_LEN/8 << "*(messageNumber+1) bytes" << endl;
+        cout << "    inputFile: file to be authenticated; several files use consecutive message numbers" << endl;
         cout << "    messageNumber: integer >= 0, identifying the part of padKeyFile to be used" << endl;
         cout << "      Like a nonce: no message number should be used twice." << endl;
         cout << endl;
         cout << "  Output format:" << endl;
-        cout << "    The file 'inputFile'.tag containing the tag in hexadecimal format" << endl;
+        cout << "    For each input, the file 'inputFile'.tag containing the tag in hexadecimal format" << endl;
         cout << endl;
         return 1;
     }
 
-    string filename1 = argv[1];
-    string filename2 = argv[2];
-    string filename3 = argv[3];
-    string filename4 = filename3 + ".tag";
+    // Settings not given on the command line come from the host profile
+    if (use_profile) {
+        uvmac_profile_t profile;
+        int loaded = uvmac_profile_load(NULL, &profile);
+        if (loaded < 0)
+            cerr << "Warning: ignoring the profile " << uvmac_profile_path()
+                 << ", made for another tag length or block size" << endl;
+        if (loaded > 0 && !buf_len_set && profile.buffer_bytes &&
+            profile.buffer_bytes <= (UINT64_C(1) << 31))
+            buf_len = (unsigned int)profile.buffer_bytes;
+        if (loaded > 0 && !threads)
+            threads = profile.threads;
+    }
+    if (!threads)
+        threads = 1;
+    buf_len -= buf_len % UVMAC_NHBYTES;    // all parts but the last are whole blocks
+    if (drop_cache) {
+        unsigned int k = 0;
+        while (k < uvmac_kernel_count() && strcmp(uvmac_kernel_info(k)->name, "streaming") != 0)
+            ++k;
+        uvmac_kernel_select(k);
+    }
+
+    string filename1 = argv[arg];
+    string filename2 = argv[arg+1];
+    vector<string> inputs = verify ? vector<string>(argv + arg + 3, argv + argc)
+                                   : vector<string>(argv + arg + 2, argv + argc - 1);
 
 
     // 1. Loading the hash key
-#if (UVMAC_TAG_LEN == 64)
-    uint64_t key_length = 20; // For 64-bits tags
-#else
-    uint64_t key_length = 26; // 128-bit tags require longer key
-#endif
+    t0 = chrono::steady_clock::now();
+    const uint64_t key_length = UVMAC_KEY_LEN; // longer for longer tags
     alignas(4) unsigned char hash_key_data[key_length*8];
     ifstream file1;
     file1.open(filename1, ios::in | ios::binary);
@@ -112,102 +795,102 @@ int main(int argc, char* argv[])
     // 2. Initializing the hash function
     alignas(16) uvmax_ctx_t ctx;
     uvmac_set_key(hash_key_data, key_length, &ctx);
+    uvmac_set_byte_order(&ctx, big_endian);
+    stats.key = seconds_since(t0);
 
+    // With several threads each buffer is cut into segments, see uvmacparallel.h
+    unique_ptr<ParallelHasher> hasher;
+    if (threads > 1)
+        hasher.reset(new ParallelHasher(&ctx, threads, false, numa));
+    BufferPool pool(huge_pages, !hasher || !numa);
+    int status = 0;
 
-    // 3. Decode the message number
-    long long int messageNumber = atoll(argv[4]);
-
-
-    // 4. Loading the interesting part of the pad key
-#if (UVMAC_TAG_LEN == 64)
-    uint64_t running_key_length = 1; // For 64-bits tags
-#else
-    uint64_t running_key_length = 2; // 128-bit tags require longer key
-#endif
-    alignas(4) unsigned char running_key_data[running_key_length*8];
-    uint64_t *running_key = (uint64_t*) &running_key_data;
-    uint64_t running_key_position = 0;
-    long int co = 0;
-    ifstream file2;
-    file2.open(filename2, ios::in | ios::binary);
-    if (!file2)
-    {
-        cerr << "Opening pad key file " << filename2 << " failed" << endl;
-        return 1;
-    }
-    while (co <= messageNumber)
-    {
-        ++co;
-        file2.read((char*) running_key_data, running_key_length*8);
-        if (!file2) {
-            cerr << "Error while reading from the pad key file " << filename1 << endl;
+    if (verify) {
+        // One index lookup and one hash per input; each input takes the
+        // pad words of the message number it was tagged with
+        TagIndex index;
+        if (!index.open(argv[arg+2])) {
+            cerr << "Opening the tag index " << argv[arg+2] << " failed" << endl;
             return 1;
         }
-    }
-    file2.close();
-
+        if (verify_files(index, filename2, inputs, &ctx, hasher.get(), pool,
+                         buf_len, drop_cache, decompress, stats))
+            status = 1;
+    } else {
+        // 3. Decode the message number
+        long long int messageNumber = atoll(argv[argc-1]);
 
-    // 5. Load the input file and hash it
-    /* Initialize 16-byte aligned message buffer */
-    void *p;
-    unsigned char *m;
-    const unsigned int buf_len = 3 * (1 << 20);
-    p = malloc(buf_len + 32);
-    m = (unsigned char *)(((size_t)p + 16) & ~((size_t)15));
-    memset(m, 0, buf_len + 16);
-    uint64_t res, tagl;
 
-    /* Load data from file */
-    ifstream file3;
-    file3.open(filename3, ios::in | ios::binary | ios::ate);
-    if (!file3)
-    {
-        cerr << "Opening input file " << filename3 << " failed" << endl;
-        return 1;
-    }
-    streampos fileSize = file3.tellg(); // get the file size
-    file3.seekg (0, ios::beg); // Go back at the beginning of the file
-    for (long int pos(0); pos < fileSize; )
-    {
-        unsigned int lengthToRead;
-        if ((fileSize - pos) < buf_len)
-            lengthToRead = fileSize - pos;
-        else
-            lengthToRead = buf_len;
-
-        file3.read((char*) m, lengthToRead);
-        if ((file3.gcount() != lengthToRead) || (!file3))
+        // 4. Loading the interesting part of the pad key: one part per input
+        // file, from messageNumber on
+        t0 = chrono::steady_clock::now();
+        uint64_t running_key_length = UVMAC_TAG_LEN/64; // one word per lane
+        vector<uint64_t> running_key(running_key_length * inputs.size());
+        uint64_t running_key_position = 0;
+        ifstream file2;
+        file2.open(filename2, ios::in | ios::binary);
+        if (!file2)
         {
-            cerr << "File reading error. Read " << file3.gcount() << " bytes instead of " << lengthToRead << endl;
+            cerr << "Opening pad key file " << filename2 << " failed" << endl;
             return 1;
         }
-        if (pos + lengthToRead < fileSize)
         {
-            assert((lengthToRead % UVMAC_NHBYTES) == 0);
-            vhash_update(m, lengthToRead, &ctx);
+            TraceSpan span(TRACE_PAD, running_key.size()*8);
+            file2.seekg(messageNumber * running_key_length * 8, ios::beg);
+            file2.read((char*) running_key.data(), running_key.size()*8);
+            if (!file2) {
+                cerr << "Error while reading from the pad key file " << filename2 << endl;
+                return 1;
+            }
         }
-        else
-        {
-            // We need to complete the message with zeros up to the next 16 bytes
-            for (unsigned int j(lengthToRead-1); j < std::min(lengthToRead+16, buf_len+16); ++j)
-                m[j] = 0;
-            res = uvmac(m, lengthToRead-1, &tagl, &ctx, running_key, running_key_length, &running_key_position);
+        file2.close();
+        // Checkpoints take the parts of the pad after those of the inputs
+        if (checkpoints.every) {
+            checkpoints.pad.open(filename2, ios::in | ios::binary);
+            checkpoints.message = messageNumber + inputs.size();
+        }
+        stats.pad = seconds_since(t0);
+
+
+        // 5. Load the input files and hash them, recording their tags in
+        // the index if asked
+        vector<TagIndex::Entry> entries(index_file ? inputs.size() : 0);
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            uint64_t tag[UVMAC_TAG_LEN/64];
+            // The part of the pad this tag takes, the one recorded in the index
+            uint64_t part = running_key_position / running_key_length;
+            if (!tag_file(inputs[i], &ctx, hasher.get(), pool, buf_len, drop_cache, decompress,
+                          running_key.data(), running_key.size(), &running_key_position,
+                          stats, tag, &checkpoints))
+                return 1;
+            assert(part == i && running_key_position == (part + 1) * running_key_length);
+            if (index_file) {
+                entries[i].key = index_key(inputs[i]);
+                entries[i].message = messageNumber + part;
+                memcpy(entries[i].tag, tag, sizeof(tag));
+            }
+        }
+        if (index_file) {
+            t0 = chrono::steady_clock::now();
+            if (!TagIndex::merge(index_file, entries)) {
+                cerr << "Writing the tag index " << index_file << " failed" << endl;
+                return 1;
+            }
+            stats.output += seconds_since(t0);
         }
-        pos += lengthToRead;
     }
-    file3.close();
 
-    // If all is good we save the result in the output file
-    ofstream file4;
-    file4.open(filename4, ios::out);
-    if (!file4)
-    {
-        cerr << "Opening output file " << filename4 << " failed" << endl;
-        return 1;
+    if (trace_file) {
+        Trace::instance().stop();
+        if (!Trace::instance().write(trace_file)) {
+            cerr << "Writing the trace to " << trace_file << " failed" << endl;
+            return 1;
+        }
     }
-    file4 << hex << res;
-    file4.close();
 
-    return 0;
+    if (show_stats)
+        print_stats(stats, seconds_since(start), hasher.get());
+
+    return status;
 }
 
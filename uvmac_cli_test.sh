@@ -0,0 +1,158 @@
+#!/bin/sh
+# Checks the uvmac program end to end, on random keys and inputs in a
+# temporary directory: each input tagged in a run of several inputs, an
+# empty one among them, must get the tag it gets when tagged alone with
+# the message number it was given, "uvmac verify" must accept the inputs
+# recorded in a tag index and reject a changed one, and "uvmac unseal" must
+# give back what "uvmac seal" was given but pass on no byte of a tampered
+# chunk or of a container whose header was changed. With --decompress, the
+# tag of a gzip input is that of its content. Given uvmac_load, "uvmac
+# serve" must answer messages longer than --max-bytes with an error, on the
+# same connection and without using the pad.
+#
+# usage: uvmac_cli_test.sh path/to/uvmac [path/to/uvmac_load]
+
+set -e
+
+UVMAC=${1:?usage: $0 path/to/uvmac}
+case $UVMAC in /*) ;; *) UVMAC=$(pwd)/$UVMAC ;; esac
+LOAD=${2:-}
+case $LOAD in /*|"") ;; *) LOAD=$(pwd)/$LOAD ;; esac
+work=$(mktemp -d "${TMPDIR:-/tmp}/uvmac_cli_test.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+head -c 304 /dev/urandom > hash.key   # enough for any tag length
+head -c 4096 /dev/urandom > pad.key   # 128 parts of 256 bits
+
+fail() {
+    echo "FAILED: $*" >&2
+    exit 1
+}
+
+# Runs uvmac without the host profile, its output in uvmac.out
+uvmac() {
+    case $1 in
+        verify) shift; set -- verify --no-profile "$@" ;;
+        seal|unseal) ;;
+        *) set -- --no-profile "$@" ;;
+    esac
+    "$UVMAC" "$@" > uvmac.out 2>&1
+}
+
+# Inputs of 0, 1, 1000 and 70000 bytes; the last one spans several buffers
+: > empty
+head -c 1 /dev/urandom > one
+head -c 1000 /dev/urandom > small
+head -c 70000 /dev/urandom > large
+inputs="empty one small large"
+
+for threads in 1 2; do
+    mkdir -p alone
+    uvmac --threads $threads --buffer-size 4096 hash.key pad.key $inputs 5 ||
+        fail "tagging several inputs on $threads threads: $(cat uvmac.out)"
+    message=5
+    for name in $inputs; do
+        cp $name alone/$name
+        uvmac --threads $threads hash.key pad.key alone/$name $message ||
+            fail "tagging $name alone"
+        cmp -s $name.tag alone/$name.tag ||
+            fail "$name, message $message, $threads threads: $(cat $name.tag) instead of $(cat alone/$name.tag)"
+        message=$((message + 1))
+    done
+    rm -rf alone
+done
+
+# A tag index over two runs, checked with "uvmac verify"
+uvmac --index tags.idx hash.key pad.key empty one 20 || fail "indexing empty and one"
+uvmac --index tags.idx hash.key pad.key small large 30 || fail "indexing small and large"
+uvmac verify hash.key pad.key tags.idx $inputs || fail "verifying $inputs: $(cat uvmac.out)"
+for name in $inputs; do
+    grep -qx "$name: OK" uvmac.out || fail "verify did not accept $name"
+done
+printf x >> small
+if uvmac verify hash.key pad.key tags.idx small; then
+    fail "verify accepted a changed input"
+fi
+grep -q "small: FAILED" uvmac.out || fail "verify did not report the changed input"
+
+# Writes the byte at offset $2 of file $1 plus 1
+flip() {
+    byte=$(od -An -tu1 -j "$2" -N1 "$1")
+    printf "\\$(printf %o $(((byte + 1) % 256)))" |
+        dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+# Sealed containers: 17 full chunks and a short one, and an empty one
+uvmac seal --chunk 4096 hash.key pad.key 40 large large.sealed || fail "sealing large"
+uvmac unseal hash.key pad.key 40 large.sealed large.unsealed || fail "unsealing large: $(cat uvmac.out)"
+cmp -s large large.unsealed || fail "unseal did not give back large"
+uvmac seal hash.key pad.key 40 empty empty.sealed || fail "sealing empty"
+uvmac unseal hash.key pad.key 40 empty.sealed empty.unsealed || fail "unsealing empty: $(cat uvmac.out)"
+cmp -s empty empty.unsealed || fail "unseal did not give back empty"
+# The header is 48 bytes and a tag, the end record 16 bytes and a tag
+tag_bytes=$((($(wc -c < empty.sealed) - 64) / 2))
+chunk_record=$((8 + 4096 + tag_bytes))
+
+# A byte of chunk 2 changed: chunks 0 and 1 only are passed on
+cp large.sealed bad.sealed
+flip bad.sealed $((48 + tag_bytes + 2 * chunk_record + 8 + 100))
+if uvmac unseal hash.key pad.key 40 bad.sealed bad.unsealed; then
+    fail "unseal accepted a changed chunk"
+fi
+[ "$(wc -c < bad.unsealed)" -eq 8192 ] || fail "unseal passed on a changed chunk"
+# The chunk size in the header doubled: nothing is passed on
+cp large.sealed bad.sealed
+flip bad.sealed 25
+rm -f bad.unsealed
+if uvmac unseal hash.key pad.key 40 bad.sealed bad.unsealed; then
+    fail "unseal accepted a changed header"
+fi
+[ ! -s bad.unsealed ] || fail "unseal passed on data under a changed header"
+# Another message number, the container cut short
+if uvmac unseal hash.key pad.key 41 large.sealed bad.unsealed; then
+    fail "unseal accepted another message number"
+fi
+head -c $(($(wc -c < large.sealed) - 1)) large.sealed > bad.sealed
+if uvmac unseal hash.key pad.key 40 bad.sealed bad.unsealed; then
+    fail "unseal accepted a container cut short"
+fi
+
+# Compressed inputs, an empty one among them, when uvmac reads gzip
+if command -v gzip > /dev/null; then
+    gzip -c empty > empty.gz
+    gzip -c one > one.gz
+    if uvmac --decompress hash.key pad.key empty.gz one.gz 50; then
+        uvmac hash.key pad.key empty one 50 || fail "tagging empty and one"
+        cmp -s empty.gz.tag empty.tag || fail "empty.gz: $(cat empty.gz.tag) instead of $(cat empty.tag)"
+        cmp -s one.gz.tag one.tag || fail "one.gz: $(cat one.gz.tag) instead of $(cat one.tag)"
+    else
+        grep -q "without zlib" uvmac.out || fail "decompressing: $(cat uvmac.out)"
+    fi
+fi
+
+# Messages too long for the service, on a port not yet in use
+if [ -n "$LOAD" ]; then
+    port=$((20000 + $$ % 20000))
+    for try in 1 2 3 4 5; do
+        "$UVMAC" serve --port $port --max-bytes 1000 hash.key pad.key 0 > serve.out 2>&1 &
+        server=$!
+        while kill -0 $server 2> /dev/null && ! grep -q "serving on" serve.out; do
+            sleep 0.1
+        done
+        grep -q "serving on" serve.out && break
+        wait $server || true
+        port=$((port + 1))
+    done
+    grep -q "serving on" serve.out || fail "serving: $(cat serve.out)"
+    "$LOAD" --port $port --connections 2 --sizes 2000 --duration 0.5 --warmup 0 > load.out 2>&1 ||
+        fail "loading the service: $(cat load.out)"
+    kill -TERM $server
+    wait $server || fail "stopping the service: $(cat serve.out)"
+    ! grep -q "failed" load.out || fail "connections to the service cut: $(cat load.out)"
+    requests=$(sed -n 's/^requests: //p' load.out)
+    [ "$requests" -gt 0 ] || fail "no answer to a message too long"
+    grep -qx "errors: $requests" load.out || fail "messages too long tagged: $(cat load.out)"
+    grep -qx "next message number: 0" serve.out || fail "messages too long used the pad: $(cat serve.out)"
+fi
+
+echo "uvmac_cli_test: OK"
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Sweeps the input buffer size and the input size of the uvmac program, on
+# tmpfs and on disk, and prints one CSV line per run with the time spent in
+# each step as reported by "uvmac --stats", without the host profile so that
+# the buffer size is the one given.
+#
+# usage: uvmac_sweep.sh path/to/uvmac [diskDir] [tmpfsDir]
+#
+#   diskDir: directory on the disk to test (default: current directory)
+#   tmpfsDir: directory on a tmpfs (default: /dev/shm)
+#
+# Environment variables:
+#   SIZES: input sizes in bytes (default 4 kB to 256 MB)
+#   BUFFERS: buffer sizes in bytes (default 4 kB to 64 MB)
+#   REPEAT: runs per combination (default 3)
+#
+# Before each run on disk, the input file is dropped from the page cache
+# with dd's nocache flag, so that the read time includes the disk.
+
+set -e
+
+UVMAC=${1:?usage: $0 path/to/uvmac [diskDir] [tmpfsDir]}
+DISK_DIR=${2:-.}
+TMPFS_DIR=${3:-/dev/shm}
+SIZES=${SIZES:-"4096 1048576 16777216 268435456"}
+BUFFERS=${BUFFERS:-"4096 16384 65536 262144 1048576 3145728 16777216 67108864"}
+REPEAT=${REPEAT:-3}
+
+echo "location,input_bytes,buffer_bytes,key_s,pad_s,buffer_s,read_s,hash_s,output_s,total_s,gb_per_s"
+
+for location in tmpfs disk; do
+    if [ $location = tmpfs ]; then dir=$TMPFS_DIR; else dir=$DISK_DIR; fi
+    if [ ! -d "$dir" ]; then
+        echo "Skipping $location: $dir is not a directory" >&2
+        continue
+    fi
+    work=$(mktemp -d "$dir/uvmac_sweep.XXXXXX")
+    trap 'rm -rf "$work"' EXIT
+    head -c 304 /dev/urandom > "$work/hash.key"   # enough for any tag length
+    head -c 32 /dev/urandom > "$work/pad.key"
+
+    for size in $SIZES; do
+        head -c "$size" /dev/urandom > "$work/input"
+        for buffer in $BUFFERS; do
+            run=0
+            while [ $run -lt "$REPEAT" ]; do
+                if [ $location = disk ]; then
+                    sync "$work/input" 2>/dev/null || sync
+                    dd if="$work/input" iflag=nocache count=0 status=none 2>/dev/null || true
+                fi
+                # A failed run stops the sweep (set -e) rather than print an empty row
+                stats=$("$UVMAC" --no-profile --stats --buffer-size "$buffer" \
+                    "$work/hash.key" "$work/pad.key" "$work/input" 0)
+                printf '%s\n' "$stats" |
+                awk -v loc=$location -v size="$size" -v buf="$buffer" '
+                    { v[$1] = $2 }
+                    END { printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n", loc, size, buf,
+                          v["key:"], v["pad:"], v["buffer:"], v["read:"], v["hash:"],
+                          v["output:"], v["total:"], v["throughput:"] }'
+                run=$((run + 1))
+            done
+        done
+    done
+    rm -rf "$work"
+    trap - EXIT
+done
@@ -0,0 +1,593 @@
+/*  This program measures the speed of the uvmac library
+
+    usage: uvmac_bench [options]
+
+    options:
+
+      --min-size N: smallest message size in bytes (default 0)
+      --max-size N: largest message size in bytes (default 1 GB). Sizes go
+        from 0 and 1 byte up to max-size in powers of four.
+      --modes list: comma separated list of modes to run (default all)
+      --chunk N: chunk length passed to vhash_update in stream mode, a
+        multiple of UVMAC_NHBYTES (default 64 kB)
+      --cpu N: pin the benchmark to this cpu (default: the cpu it starts on)
+      --samples N: number of timed samples per case, the best one is
+        reported (default 5)
+      --time ms: approximate time spent on each case (default 200 ms)
+      --json file: also write the results in JSON format to this file ("-"
+        for the standard output)
+      --kernel name: block kernel to measure, as named by uvmac_check
+        (default: the default kernel of the library)
+      --byte-order little|big: byte order of the message words (default
+        given by UVMAC_PREFER_BIG_ENDIAN)
+      --neighbour N: working set in bytes of the neighbour mode (default
+        8 MB)
+      --prefetch N: prefetch distance in bytes of the pipelined kernel, 0
+        for none (default UVMAC_PREFETCH_BYTES)
+      --perf: also read hardware counters (cycles, instructions, L1 data
+        and last level cache misses, branch mispredictions) around each
+        measured region with perf_event_open, and report them per call
+
+    modes:
+
+      vhash:  hash only, one vhash() call per message
+      uvmac:  full tag, one uvmac() call per message with a fresh pad slice
+      stream: vhash_update() over fixed-size chunks followed by vhash() on
+              the remainder, as done by the uvmac program on large files
+      batch:  messages of the same size laid out back to back in a 4 MB
+              window and tagged one after the other, each with its own pad
+              slice
+      nh:     the NH hash (L1) of the UVMAC_NHBYTES blocks of a 16 kB window
+      poly:   1024 polynomial steps mod 2^127-1 (L2)
+      l3:     1024 final l3hash calls (L3)
+      neighbour: a cache-sensitive neighbour, a random walk over the lines
+              of a working set, run after each vhash() call on a message;
+              only the walks are timed, so the time per call is that of a
+              walk and grows with the neighbour's data evicted by hashing
+              (size 0 gives the walk with its data in cache). Not run by
+              default; compare e.g. --kernel pipelined and --kernel streaming
+
+      The last three modes do not depend on the message size. Each is run
+      twice: "latency", where every instance waits for the result of the
+      previous one, and "throughput", where the instances are independent.
+      UVMAC_NHBYTES and UVMAC_TAG_LEN are fixed at compile time; configure
+      with -DUVMAC_BUILD_VARIANTS=ON to get one uvmac_bench_<nhbytes>_<tag>
+      program per combination.
+
+    output format:
+
+      For each mode and message size, the number of cycles per byte (read
+      from the time-stamp counter on x86, not available elsewhere) and per
+      message (or stage instance), the time per call and the throughput.
+      With --perf, the instructions per cycle and the number of cache
+      misses and branch mispredictions per call. The JSON output is meant
+      to be stored together with the commit it was measured on, so that the
+      speed of the library can be tracked over time.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include "uvmaclib.h"
+#include "uvmaclib_internal.h"
+#include "uvmacperf.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+using namespace std;
+
+/* ----------------------------------------------------------------------- */
+/* Timing                                                                  */
+
+static inline uint64_t read_ticks()
+{
+#if HAVE_TSC
+    _mm_lfence();
+    uint64_t t = __rdtsc();
+    _mm_lfence();
+    return t;
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static inline double now_ns()
+{
+    return (double)chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Result
+{
+    string mode;
+    uint64_t bytes;          // message size
+    uint64_t messages;       // messages per call of the measured function
+    uint64_t iterations;     // calls per sample
+    double best_ticks;       // per call, best sample
+    double median_ticks;     // per call, median sample
+    double best_ns;          // per call, best sample
+    bool have_counters;
+    bool counter_available[PerfCounters::NUM_COUNTERS];
+    double counters[PerfCounters::NUM_COUNTERS]; // per call, all samples
+};
+
+/* Run f(iters) with enough iterations to last target_ns / samples, then
+   time 'samples' runs and keep the best and the median one. Hardware
+   counters, when given, are averaged over all samples. */
+template <class F>
+static void measure(F &&f, double target_ns, int samples, Result &r,
+                    PerfCounters *perf)
+{
+    uint64_t iters = 1;
+    for (;;) {
+        double t0 = now_ns();
+        f(iters);
+        double dt = now_ns() - t0;
+        if (dt >= target_ns / samples || iters >= (UINT64_C(1) << 40))
+            break;
+        if (dt < 1000)
+            iters *= 16;
+        else
+            iters = (uint64_t)(iters * 1.2 * (target_ns / samples) / dt) + 1;
+    }
+
+    vector<double> ticks(samples), ns(samples);
+    if (perf)
+        perf->reset();
+    for (int s = 0; s < samples; ++s) {
+        double t0 = now_ns();
+        uint64_t c0 = read_ticks();
+        if (perf)
+            perf->start();
+        f(iters);
+        if (perf)
+            perf->stop();
+        uint64_t c1 = read_ticks();
+        ns[s] = (now_ns() - t0) / iters;
+        ticks[s] = (double)(c1 - c0) / iters;
+    }
+    r.have_counters = (perf != NULL);
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i) {
+        r.counter_available[i] = perf && perf->available(i);
+        r.counters[i] = perf ? perf->value(i) / ((double)iters * samples) : 0;
+    }
+    r.iterations = iters;
+    r.best_ns = *min_element(ns.begin(), ns.end());
+    r.best_ticks = *min_element(ticks.begin(), ticks.end());
+    sort(ticks.begin(), ticks.end());
+    r.median_ticks = ticks[samples / 2];
+}
+
+/* Time of one walk over the working set after each call of hash(), the
+   walks only, with the same samples as measure() */
+template <class F>
+static void measure_after(F &&hash, const vector<uint64_t> &lines, double target_ns,
+                          int samples, Result &r, volatile uint64_t &sink)
+{
+    auto walk = [&]() {
+        uint64_t i = 0;
+        for (size_t k = 0; k < lines.size() / 8; ++k)
+            i = lines[i];
+        sink += i;
+    };
+    double t0 = now_ns();
+    hash();
+    walk();
+    uint64_t iters = max<uint64_t>(1, (uint64_t)(target_ns / samples / max(1.0, now_ns() - t0)));
+
+    vector<double> ticks(samples), ns(samples);
+    for (int s = 0; s < samples; ++s) {
+        for (uint64_t it = 0; it < iters; ++it) {
+            hash();
+            double t1 = now_ns();
+            uint64_t c0 = read_ticks();
+            walk();
+            ticks[s] += (double)(read_ticks() - c0);
+            ns[s] += now_ns() - t1;
+        }
+        ticks[s] /= iters;
+        ns[s] /= iters;
+    }
+    r.have_counters = false;
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; ++i) {
+        r.counter_available[i] = false;
+        r.counters[i] = 0;
+    }
+    r.iterations = iters;
+    r.best_ns = *min_element(ns.begin(), ns.end());
+    r.best_ticks = *min_element(ticks.begin(), ticks.end());
+    sort(ticks.begin(), ticks.end());
+    r.median_ticks = ticks[samples / 2];
+}
+
+/* ----------------------------------------------------------------------- */
+/* Setup                                                                   */
+
+static int pin_cpu(int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0)
+        cpu = sched_getcpu();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        cerr << "Warning: could not pin the benchmark to cpu " << cpu << endl;
+        return -1;
+    }
+    return cpu;
+#else
+    (void)cpu;
+    return -1;
+#endif
+}
+
+static string cpu_model()
+{
+    ifstream f("/proc/cpuinfo");
+    string line;
+    while (getline(f, line)) {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != string::npos)
+            return line.substr(line.find(':') + 2);
+    }
+    return "unknown";
+}
+
+static string json_escape(const string &s)
+{
+    string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+static void fill_random(unsigned char *p, size_t n, uint64_t seed)
+{
+    uint64_t x = seed;
+    for (size_t i = 0; i < n; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        p[i] = (unsigned char)x;
+    }
+}
+
+static void print_result(const Result &r, bool use_perf)
+{
+    double total = (double)r.bytes * r.messages;
+    printf("%-18s %10llu  %11.3f  %10.1f  %10.0f  %7.3f", r.mode.c_str(),
+           (unsigned long long)r.bytes,
+           (HAVE_TSC && total) ? r.best_ticks / total : 0.0,
+           HAVE_TSC ? r.best_ticks / r.messages : 0.0,
+           r.best_ns, total ? total / r.best_ns : 0.0);
+    if (use_perf) {
+        const double *c = r.counters;
+        printf("  %5.2f  %14.1f  %14.1f  %12.1f",
+               c[PerfCounters::CYCLES] ? c[PerfCounters::INSTRUCTIONS] / c[PerfCounters::CYCLES] : 0.0,
+               c[PerfCounters::L1D_MISSES], c[PerfCounters::LLC_MISSES],
+               c[PerfCounters::BRANCH_MISSES]);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+    uint64_t min_size = 0;
+    uint64_t max_size = UINT64_C(1) << 30;
+    uint64_t chunk = 1 << 16;
+    int cpu = -1;
+    int samples = 5;
+    double target_ms = 200;
+    string json_file;
+    bool use_perf = false;
+    string kernel_name;
+    uint64_t neighbour_bytes = 8 << 20;
+    int big_endian = UVMAC_PREFER_BIG_ENDIAN;
+    vector<string> modes = {"vhash", "uvmac", "stream", "batch", "nh", "poly", "l3"};
+
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--perf") {
+            use_perf = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Missing value for option " << a << endl;
+            return 1;
+        }
+        string v = argv[++i];
+        if (a == "--min-size")
+            min_size = strtoull(v.c_str(), NULL, 0);
+        else if (a == "--max-size")
+            max_size = strtoull(v.c_str(), NULL, 0);
+        else if (a == "--chunk")
+            chunk = strtoull(v.c_str(), NULL, 0);
+        else if (a == "--cpu")
+            cpu = atoi(v.c_str());
+        else if (a == "--samples")
+            samples = max(1, atoi(v.c_str()));
+        else if (a == "--time")
+            target_ms = atof(v.c_str());
+        else if (a == "--json")
+            json_file = v;
+        else if (a == "--kernel")
+            kernel_name = v;
+        else if (a == "--byte-order" && (v == "little" || v == "big"))
+            big_endian = (v == "big");
+        else if (a == "--neighbour")
+            neighbour_bytes = max<uint64_t>(64, strtoull(v.c_str(), NULL, 0));
+        else if (a == "--prefetch")
+            uvmac_prefetch_set((unsigned int)strtoul(v.c_str(), NULL, 0));
+        else if (a == "--modes") {
+            modes.clear();
+            stringstream ss(v);
+            string mode;
+            while (getline(ss, mode, ','))
+                modes.push_back(mode);
+        } else {
+            cerr << "Unknown option " << a << endl;
+            return 1;
+        }
+    }
+    if (max_size >= (UINT64_C(1) << 32) || min_size > max_size) {
+        cerr << "Message sizes must satisfy min-size <= max-size < 4 GB" << endl;
+        return 1;
+    }
+    if (chunk == 0 || (chunk % UVMAC_NHBYTES) != 0) {
+        cerr << "The chunk length must be a positive multiple of " << UVMAC_NHBYTES << endl;
+        return 1;
+    }
+    if (!kernel_name.empty()) {
+        unsigned int k = 0;
+        while (k < uvmac_kernel_count() && kernel_name != uvmac_kernel_info(k)->name)
+            ++k;
+        if (!uvmac_kernel_select(k)) {
+            cerr << "Unknown or unsupported kernel " << kernel_name << endl;
+            return 1;
+        }
+    }
+    cpu = pin_cpu(cpu);
+
+    PerfCounters perf;
+    if (use_perf && !perf.open()) {
+        cerr << "Warning: no hardware counters available on this host" << endl;
+        use_perf = false;
+    }
+    PerfCounters *counters = use_perf ? &perf : NULL;
+
+    vector<uint64_t> sizes;
+    if (min_size == 0)
+        sizes.push_back(0);
+    for (uint64_t n = 1; n <= max_size; n *= 4)
+        if (n >= min_size)
+            sizes.push_back(n);
+
+    // 1. Random hash key and pad, message buffer 64-byte aligned and
+    //    followed by 16 zero bytes
+    const uint64_t key_length = UVMAC_KEY_LEN;
+    vector<uint64_t> hash_key(key_length + 8);
+    fill_random((unsigned char*)hash_key.data(), hash_key.size() * 8, 1);
+    alignas(16) uvmax_ctx_t ctx;
+    uvmac_set_key((unsigned char*)hash_key.data(), hash_key.size(), &ctx);
+    uvmac_set_byte_order(&ctx, big_endian);
+
+    const uint64_t window = 4 << 20;
+    const uint64_t lanes = UVMAC_TAG_LEN / 64;
+    const uint64_t buf_len = max(max_size, window) + 64;
+    unsigned char *m = (unsigned char*)aligned_alloc(64, (buf_len + 63) & ~(uint64_t)63);
+    if (!m) {
+        cerr << "Could not allocate " << buf_len << " bytes" << endl;
+        return 1;
+    }
+    fill_random(m, buf_len, 2);
+
+    vector<uint64_t> pad(lanes * (window / 16 + 1));
+    fill_random((unsigned char*)pad.data(), pad.size() * 8, 3);
+
+    // Working set of the neighbour: one cycle through all its 64-byte
+    // lines in random order (Sattolo), the first word of each line holding
+    // the index of the next one
+    vector<uint64_t> lines;
+    if (find(modes.begin(), modes.end(), "neighbour") != modes.end()) {
+        size_t count = neighbour_bytes / 64;
+        vector<uint64_t> order(count);
+        for (size_t k = 0; k < count; ++k)
+            order[k] = k;
+        uint64_t x = 4;
+        for (size_t k = count - 1; k > 0; --k) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            swap(order[k], order[x % k]);
+        }
+        lines.assign(count * 8, 0);
+        for (size_t k = 0; k < count; ++k)
+            lines[8 * k] = 8 * order[k];
+    }
+
+    // 2. Run all cases
+    vector<Result> results;
+    volatile uint64_t sink = 0;
+    const double target_ns = target_ms * 1e6;
+
+    cout << "mode                  bytes  cycles/byte  cycles/msg     ns/call     GB/s";
+    if (use_perf)
+        cout << "    IPC   L1D miss/call   LLC miss/call  br miss/call";
+    cout << endl;
+    for (const string &mode : modes) {
+        if (mode == "nh" || mode == "poly" || mode == "l3") {
+            const unsigned int count = (mode == "nh") ?
+                max(4, (16 << 10) / UVMAC_NHBYTES) : 1024;
+            for (int dependent = 1; dependent >= 0; --dependent) {
+                Result r;
+                r.mode = mode + (dependent ? "-latency" : "-throughput");
+                r.bytes = (mode == "nh") ? UVMAC_NHBYTES : 0;
+                r.messages = count;
+                measure([&](uint64_t iters) {
+                    for (uint64_t it = 0; it < iters; ++it) {
+                        if (mode == "nh")
+                            sink += uvmac_stage_nh(m, count, &ctx, dependent);
+                        else if (mode == "poly")
+                            sink += uvmac_stage_poly(count, &ctx, dependent);
+                        else
+                            sink += uvmac_stage_l3(count, &ctx, dependent);
+                    }
+                }, target_ns, samples, r, counters);
+                results.push_back(r);
+                print_result(r, use_perf);
+            }
+            continue;
+        }
+        for (uint64_t n : sizes) {
+            Result r;
+            r.mode = mode;
+            r.bytes = n;
+            r.messages = 1;
+            unsigned int mbytes = (unsigned int)n;
+            uint64_t tagl[UVMAC_TAG_LEN/64] = {0};
+
+            // Messages must be followed by zeroes up to the next 16 bytes
+            unsigned char saved[16];
+            memcpy(saved, m + n, 16);
+            memset(m + n, 0, 16);
+
+            if (mode == "vhash") {
+                measure([&](uint64_t iters) {
+                    for (uint64_t it = 0; it < iters; ++it)
+                        sink += vhash(m, mbytes, tagl, &ctx);
+                }, target_ns, samples, r, counters);
+            } else if (mode == "uvmac") {
+                measure([&](uint64_t iters) {
+                    for (uint64_t it = 0; it < iters; ++it) {
+                        uint64_t pos = 0;
+                        sink += uvmac(m, mbytes, tagl, &ctx, pad.data(), lanes, &pos);
+                    }
+                }, target_ns, samples, r, counters);
+            } else if (mode == "stream") {
+                measure([&](uint64_t iters) {
+                    for (uint64_t it = 0; it < iters; ++it) {
+                        uint64_t off = 0;
+                        while (n - off > chunk) {
+                            vhash_update(m + off, (unsigned int)chunk, &ctx);
+                            off += chunk;
+                        }
+                        sink += vhash(m + off, (unsigned int)(n - off), tagl, &ctx);
+                    }
+                }, target_ns, samples, r, counters);
+            } else if (mode == "batch") {
+                uint64_t stride = (n + 15) & ~(uint64_t)15;
+                uint64_t count = stride ? max<uint64_t>(1, window / stride) : window / 16;
+                r.messages = count;
+                for (uint64_t k = 0; k < count; ++k)
+                    memset(m + k * stride + n, 0, stride - n);
+                measure([&](uint64_t iters) {
+                    for (uint64_t it = 0; it < iters; ++it) {
+                        uint64_t pos = 0;
+                        for (uint64_t k = 0; k < count; ++k)
+                            sink += uvmac(m + k * stride, mbytes, tagl, &ctx,
+                                          pad.data(), pad.size(), &pos);
+                    }
+                }, target_ns, samples, r, counters);
+            } else if (mode == "neighbour") {
+                measure_after([&]() {
+                    sink += vhash(m, mbytes, tagl, &ctx);
+                }, lines, target_ns, samples, r, sink);
+            } else {
+                cerr << "Unknown mode " << mode << endl;
+                return 1;
+            }
+            memcpy(m + n, saved, 16);
+            results.push_back(r);
+            print_result(r, use_perf);
+        }
+    }
+
+    // 3. JSON output
+    if (!json_file.empty()) {
+        ofstream file;
+        if (json_file != "-") {
+            file.open(json_file, ios::out);
+            if (!file) {
+                cerr << "Opening output file " << json_file << " failed" << endl;
+                return 1;
+            }
+        }
+        ostream &out = (json_file == "-") ? cout : file;
+        time_t t = time(NULL);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+        out << "{" << endl;
+        out << "  \"date\": \"" << date << "\"," << endl;
+        out << "  \"cpu_model\": \"" << json_escape(cpu_model()) << "\"," << endl;
+        out << "  \"cpu\": " << cpu << "," << endl;
+        out << "  \"compiler\": \"" << json_escape(__VERSION__) << "\"," << endl;
+        out << "  \"timer\": \"" << (HAVE_TSC ? "rdtsc" : "steady_clock") << "\"," << endl;
+        out << "  \"tag_len\": " << UVMAC_TAG_LEN << "," << endl;
+        out << "  \"nhbytes\": " << UVMAC_NHBYTES << "," << endl;
+        out << "  \"prefer_big_endian\": " << UVMAC_PREFER_BIG_ENDIAN << "," << endl;
+        out << "  \"kernel\": \"" << uvmac_kernel_info(uvmac_kernel_current())->name << "\"," << endl;
+        out << "  \"big_endian\": " << big_endian << "," << endl;
+        out << "  \"prefetch_bytes\": " << uvmac_prefetch_get() << "," << endl;
+        out << "  \"stream_chunk\": " << chunk << "," << endl;
+        out << "  \"perf_counters\": " << (use_perf ? "true" : "false") << "," << endl;
+        out << "  \"results\": [" << endl;
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            double total = (double)r.bytes * r.messages;
+            out << "    {\"mode\": \"" << r.mode << "\", \"bytes\": " << r.bytes
+                << ", \"messages\": " << r.messages
+                << ", \"iterations\": " << r.iterations;
+            if (HAVE_TSC)
+                out << ", \"cycles_per_call\": " << r.best_ticks
+                    << ", \"cycles_per_message\": " << r.best_ticks / r.messages;
+            if (HAVE_TSC && total)
+                out << ", \"cycles_per_byte\": " << r.best_ticks / total
+                    << ", \"cycles_per_byte_median\": " << r.median_ticks / total;
+            else
+                out << ", \"cycles_per_byte\": null, \"cycles_per_byte_median\": null";
+            out << ", \"ns_per_call\": " << r.best_ns
+                << ", \"gb_per_s\": " << (total ? total / r.best_ns : 0.0);
+            if (r.have_counters) {
+                out << ", \"counters_per_call\": {";
+                for (int c = 0; c < PerfCounters::NUM_COUNTERS; ++c) {
+                    out << (c ? ", " : "") << "\"" << PerfCounters::name(c) << "\": ";
+                    if (r.counter_available[c])
+                        out << r.counters[c];
+                    else
+                        out << "null";
+                }
+                out << "}";
+                if (r.counter_available[PerfCounters::CYCLES] &&
+                    r.counter_available[PerfCounters::INSTRUCTIONS] && r.counters[PerfCounters::CYCLES])
+                    out << ", \"ipc\": " << r.counters[PerfCounters::INSTRUCTIONS] / r.counters[PerfCounters::CYCLES];
+            }
+            out << "}"
+                << (i + 1 < results.size() ? "," : "") << endl;
+        }
+        out << "  ]" << endl;
+        out << "}" << endl;
+    }
+
+    free(m);
+    return 0;
+}
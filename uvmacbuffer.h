@@ -0,0 +1,151 @@
+#ifndef HEADER_UVMAC_BUFFER_H
+#define HEADER_UVMAC_BUFFER_H
+
+/* --------------------------------------------------------------------------
+ * Message buffers for the programs: 64-byte aligned, backed by huge pages
+ * when possible, pre-faulted and reused.
+ *
+ * acquire() hands out a released buffer of at least the requested size if
+ * there is one, otherwise maps a new one, with 16 more bytes for the zero
+ * padding that vhash() reads after a message. Fresh buffers are zero, but
+ * reused ones hold their previous content: callers zero the tail after
+ * each message (as they must anyway for the last, partial, read). With
+ * HUGE_TRANSPARENT the mapping is 2 MB aligned and advised as huge page
+ * (MADV_HUGEPAGE); with HUGE_EXPLICIT it comes from the reserved huge pages
+ * (MAP_HUGETLB, see /proc/sys/vm/nr_hugepages), falling back to transparent
+ * ones when none are left; buffers under 1 MB stay on small pages. Buffers
+ * are pre-faulted when mapped, so the page faults happen once per buffer,
+ * a few for huge pages, rather than during the first read into it; without
+ * prefault, the first thread to write each page decides on which NUMA node
+ * it goes (see ParallelHasher::first_touch).
+ * The buffers are unmapped by the destructor of the pool, which can be
+ * used by several threads.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+
+class BufferPool
+{
+public:
+    enum HugePages { HUGE_NONE, HUGE_TRANSPARENT, HUGE_EXPLICIT };
+
+    explicit BufferPool(HugePages huge = HUGE_TRANSPARENT, bool prefault = true)
+        : huge(huge), prefault(prefault) {}
+
+    ~BufferPool()
+    {
+        for (size_t i = 0; i < buffers.size(); ++i)
+            unmap(buffers[i]);
+    }
+
+    /* A buffer of at least bytes + 16 bytes, or NULL */
+    unsigned char *acquire(uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Buffer *best = NULL;
+        for (size_t i = 0; i < buffers.size(); ++i)
+            if (!buffers[i].used && buffers[i].bytes >= bytes + 16 &&
+                (!best || buffers[i].bytes < best->bytes))
+                best = &buffers[i];
+        if (!best) {
+            Buffer b = map(bytes + 16);
+            if (!b.data)
+                return NULL;
+            buffers.push_back(b);
+            best = &buffers.back();
+        }
+        best->used = true;
+        return best->data;
+    }
+
+    void release(unsigned char *data)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < buffers.size(); ++i)
+            if (buffers[i].data == data)
+                buffers[i].used = false;
+    }
+
+    /* Whether some buffer is backed by reserved huge pages */
+    bool explicit_huge_pages() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < buffers.size(); ++i)
+            if (buffers[i].hugetlb)
+                return true;
+        return false;
+    }
+
+private:
+    static const uint64_t huge_page = UINT64_C(1) << 21;
+
+    struct Buffer
+    {
+        unsigned char *data;
+        uint64_t bytes;         // usable from data on
+        void *map;              // whole mapping, data being aligned in it
+        uint64_t map_bytes;
+        bool hugetlb;
+        bool used;
+    };
+
+    Buffer map(uint64_t bytes)
+    {
+        Buffer b = {NULL, 0, NULL, 0, false, false};
+        bytes = (bytes + 63) & ~(uint64_t)63;
+#ifdef MAP_HUGETLB
+        if (huge == HUGE_EXPLICIT) {
+            b.map_bytes = (bytes + huge_page - 1) & ~(huge_page - 1);
+            b.map = mmap(NULL, b.map_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (prefault ? MAP_POPULATE : 0), -1, 0);
+            if (b.map != MAP_FAILED) {
+                b.data = (unsigned char *)b.map;
+                b.bytes = b.map_bytes;
+                b.hugetlb = true;
+                return b;
+            }
+        }
+#endif
+        // Small buffers stay on small pages: a huge page would cost more
+        // to fault and zero than it saves
+        bool thp = (huge != HUGE_NONE && bytes >= huge_page / 2);
+        uint64_t align = thp ? huge_page : 4096;
+        b.map_bytes = bytes + (thp ? huge_page : 0);
+        b.map = mmap(NULL, b.map_bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b.map == MAP_FAILED)
+            return Buffer();
+        b.data = (unsigned char *)(((uintptr_t)b.map + align - 1) & ~(uintptr_t)(align - 1));
+        b.bytes = b.map_bytes - (b.data - (unsigned char *)b.map);
+#ifdef MADV_HUGEPAGE
+        if (thp)
+            madvise(b.data, b.bytes, MADV_HUGEPAGE);
+#endif
+        if (!prefault)
+            return b;
+#ifdef MADV_POPULATE_WRITE
+        // Pre-faults after the advice, so that it takes effect
+        if (madvise(b.data, b.bytes, MADV_POPULATE_WRITE) != 0)
+#endif
+            for (uint64_t i = 0; i < b.bytes; i += 4096)
+                ((volatile unsigned char *)b.data)[i] = 0;
+        return b;
+    }
+
+    static void unmap(Buffer &b)
+    {
+        if (b.map)
+            munmap(b.map, b.map_bytes);
+    }
+
+    HugePages huge;
+    bool prefault;
+    std::vector<Buffer> buffers;
+    mutable std::mutex mutex;
+};
+
+#endif /* HEADER_UVMAC_BUFFER_H */
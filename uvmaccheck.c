@@ -0,0 +1,715 @@
+/* --------------------------------------------------------------------------
+ * Differential checks of the uvmac library.
+ *
+ *   usage: uvmac_check [--iterations N] [--seed S] [--max-len N]
+ *
+ * Every block kernel compiled into the library (see uvmaclib_internal.h)
+ * is compared against the simple, portable reference implementation of
+ * VHASH below, on random keys, random message lengths (biased towards
+ * block boundaries), random buffer alignments and random splits of the
+ * message into vhash_update calls. The NH, poly and l3 stages are also
+ * checked one by one, and every case reads the message words in a random
+ * byte order (uvmac_set_byte_order). The reference only uses 32x32->64-bit
+ * products and fully reduces every intermediate value, so it shares no
+ * code and no shortcut with the kernels it checks.
+ *
+ * The program exits with a non-zero status at the first mismatch, after
+ * printing the kernel, the seed and the case that failed.
+ *
+ * Compiled with -DUVMAC_FUZZ=1, the file provides LLVMFuzzerTestOneInput
+ * instead of main, for libFuzzer: the input is used as key, split points
+ * and message, and every kernel must agree with the reference.
+ * ----------------------------------------------------------------------- */
+
+#include "uvmaclib.h"
+#include "uvmaclib_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef UVMAC_FUZZ
+#define UVMAC_FUZZ 0
+#endif
+
+#define KEY_WORDS  ((UVMAC_KEY_LEN) + 8) /* Room for l3key rejections     */
+#define NH_WORDS   ((UVMAC_NHBYTES)/8 + 2*(UVMAC_LANES-1))
+
+/* ----------------------------------------------------------------------- */
+/* 128-bit arithmetic                                                      */
+
+typedef struct { uint64_t hi, lo; } u128;
+
+static const uint64_t ref_p64 = UINT64_C(0xfffffffffffffeff);
+
+static u128 mul_64(uint64_t a, uint64_t b)
+{
+    uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+    u128 r;
+    r.lo = (mid << 32) | (uint32_t)p00;
+    r.hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    return r;
+}
+
+static u128 add_128(u128 a, u128 b)
+{
+    u128 r;
+    r.lo = a.lo + b.lo;
+    r.hi = a.hi + b.hi + (r.lo < a.lo);
+    return r;
+}
+
+static int less_128(u128 a, u128 b)
+{
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+/* Remainder and quotient of a by d, one bit at a time */
+static uint64_t divmod_128(u128 a, uint64_t d, u128 *q)
+{
+    u128 quot = {0, 0};
+    uint64_t rem = 0;
+    int i;
+    for (i = 127; i >= 0; i--) {
+        uint64_t bit = (i >= 64) ? (a.hi >> (i - 64)) & 1 : (a.lo >> i) & 1;
+        uint64_t top = rem >> 63;
+        rem = (rem << 1) | bit;
+        quot.hi = (quot.hi << 1) | (quot.lo >> 63);
+        quot.lo <<= 1;
+        if (top || rem >= d) {
+            rem -= d;
+            quot.lo |= 1;
+        }
+    }
+    if (q)
+        *q = quot;
+    return rem;
+}
+
+/* Values mod p127 = 2^127 - 1 are kept fully reduced */
+static u128 mod_127(u128 a)
+{
+    const u128 p127 = {UINT64_C(0x7fffffffffffffff), UINT64_C(0xffffffffffffffff)};
+    u128 r, top = {0, a.hi >> 63};
+    r.hi = a.hi & UINT64_C(0x7fffffffffffffff);
+    r.lo = a.lo;
+    r = add_128(r, top);
+    if (!less_128(r, p127)) {
+        r.hi -= p127.hi + (r.lo < p127.lo);
+        r.lo -= p127.lo;
+    }
+    return r;
+}
+
+static u128 addmod_127(u128 a, u128 b)
+{
+    return mod_127(add_128(mod_127(a), mod_127(b)));
+}
+
+static u128 mulmod_127(u128 a, u128 b)
+{
+    /* 256-bit product in four limbs, then fold 2^127 = 1 */
+    uint64_t w[4] = {0, 0, 0, 0};
+    uint64_t x[2], y[2];
+    int i, j, k;
+    u128 lo, hi;
+
+    a = mod_127(a);
+    b = mod_127(b);
+    x[0] = a.lo; x[1] = a.hi; y[0] = b.lo; y[1] = b.hi;
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            u128 p = mul_64(x[i], y[j]);
+            uint64_t carry, add;
+            k = i + j;
+            w[k] += p.lo;
+            carry = (w[k] < p.lo);
+            add = p.hi + carry;          /* p.hi < 2^64 - 1 */
+            w[k+1] += add;
+            carry = (w[k+1] < add);
+            for (k += 2; carry && k < 4; k++) {
+                w[k] += 1;
+                carry = (w[k] == 0);
+            }
+        }
+    }
+    lo.hi = w[1] & UINT64_C(0x7fffffffffffffff);
+    lo.lo = w[0];
+    hi.lo = (w[1] >> 63) | (w[2] << 1);
+    hi.hi = (w[2] >> 63) | (w[3] << 1);
+    return mod_127(add_128(lo, mod_127(hi)));
+}
+
+/* ----------------------------------------------------------------------- */
+/* Reference VHASH                                                         */
+
+typedef struct {
+    uint64_t nhkey[NH_WORDS];
+    u128 polykey[UVMAC_LANES];
+    uint64_t l3key[2*UVMAC_LANES];
+} ref_key_t;
+
+static uint64_t load_be(const unsigned char *p)
+{
+    uint64_t x = 0;
+    int i;
+    for (i = 0; i < 8; i++)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+static uint64_t load_le(const unsigned char *p)
+{
+    uint64_t x = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+/* Byte order of the message words in the current case */
+static int big_endian = UVMAC_PREFER_BIG_ENDIAN;
+
+static uint64_t load_word(const unsigned char *m, uint64_t mbytes, uint64_t i)
+{
+    unsigned char w[8];
+    uint64_t j;
+    for (j = 0; j < 8; j++)
+        w[j] = (8*i + j < mbytes) ? m[8*i + j] : 0;
+    return big_endian ? load_be(w) : load_le(w);
+}
+
+static void ref_set_key(const unsigned char *key, ref_key_t *rk)
+{
+    const uint64_t mpoly = UINT64_C(0x1fffffff1fffffff);
+    int pos = 0, i;
+    for (i = 0; i < NH_WORDS; i++)
+        rk->nhkey[i] = load_be(key + 8*pos++);
+    for (i = 0; i < UVMAC_LANES; i++) {
+        rk->polykey[i].hi = load_be(key + 8*pos++) & mpoly;
+        rk->polykey[i].lo = load_be(key + 8*pos++) & mpoly;
+    }
+    for (i = 0; i < 2*UVMAC_LANES; i++) {
+        do {
+            rk->l3key[i] = load_be(key + 8*pos++);
+        } while (rk->l3key[i] >= ref_p64);
+    }
+}
+
+/* NH of nw words of m starting at word 'first', for lane 'lane', with the
+   top two bits cleared */
+static u128 ref_nh(const unsigned char *m, uint64_t mbytes, uint64_t first,
+                   unsigned int nw, const ref_key_t *rk, int lane)
+{
+    u128 sum = {0, 0};
+    unsigned int i;
+    for (i = 0; i < nw; i += 2) {
+        uint64_t a = load_word(m, mbytes, first + i) + rk->nhkey[i + 2*lane];
+        uint64_t b = load_word(m, mbytes, first + i + 1) + rk->nhkey[i + 1 + 2*lane];
+        sum = add_128(sum, mul_64(a, b));
+    }
+    return sum;
+}
+
+static uint64_t ref_l3(u128 p, uint64_t k1, uint64_t k2, uint64_t len)
+{
+    const uint64_t d = UINT64_C(0xffffffff00000000);  /* 2^64 - 2^32 */
+    u128 t = {len, 0}, q, s;
+    uint64_t r;
+
+    p = addmod_127(p, t);
+    r = divmod_128(p, d, &q);
+    /* q < 2^64 since p < 2^127 */
+    t.hi = 0; t.lo = q.lo;
+    s.hi = 0; s.lo = k1;
+    q.lo = divmod_128(add_128(t, s), ref_p64, NULL);
+    t.lo = r;
+    s.lo = k2;
+    r = divmod_128(add_128(t, s), ref_p64, NULL);
+    return divmod_128(mul_64(q.lo, r), ref_p64, NULL);
+}
+
+static void ref_vhash(const unsigned char *m, uint64_t mbytes,
+                      const ref_key_t *rk, uint64_t out[UVMAC_LANES])
+{
+    uint64_t nblocks = mbytes / UVMAC_NHBYTES, rem = mbytes % UVMAC_NHBYTES;
+    uint64_t b;
+    int lane;
+
+    for (lane = 0; lane < UVMAC_LANES; lane++) {
+        u128 acc = rk->polykey[lane];
+        for (b = 0; b <= nblocks; b++) {
+            unsigned int nw = (b < nblocks) ? UVMAC_NHBYTES/8
+                                            : (unsigned int)(2*((rem + 15)/16));
+            u128 nh;
+            if (nw == 0)
+                break;
+            nh = ref_nh(m, mbytes, b*(UVMAC_NHBYTES/8), nw, rk, lane);
+            nh.hi &= UINT64_C(0x3fffffffffffffff);
+            if (b == 0)
+                acc = addmod_127(acc, nh);
+            else
+                acc = addmod_127(mulmod_127(acc, rk->polykey[lane]), nh);
+        }
+        out[lane] = ref_l3(mod_127(acc), rk->l3key[2*lane], rk->l3key[2*lane+1], 8*rem);
+    }
+}
+
+/* ----------------------------------------------------------------------- */
+/* Random numbers                                                          */
+
+#if ! UVMAC_FUZZ
+static uint64_t rng_state;
+
+static uint64_t rnd(void)
+{
+    /* splitmix64 */
+    uint64_t z = (rng_state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+static void fill_random(unsigned char *p, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        p[i] = (unsigned char)rnd();
+}
+#endif
+
+/* Buffers may start at any byte on x86, elsewhere on 16-byte boundaries */
+#if (__x86_64__ || _M_X64 || ((__i386__ || _M_IX86) && !(__SSE2__ || _M_IX86_FP >= 2)))
+#define ALIGN_STEP 1
+#else
+#define ALIGN_STEP 16
+#endif
+
+/* ----------------------------------------------------------------------- */
+/* Checks                                                                  */
+
+static unsigned char *msgbuf, *scratch;
+static size_t max_len = 1 << 16;
+
+static int report(const char *what, unsigned int k, uint64_t len, const uint64_t *got,
+                  const uint64_t *want)
+{
+    int lane;
+    printf("MISMATCH in %s, kernel %s, %s-endian words, length %llu\n", what,
+           uvmac_kernel_info(k)->name, big_endian ? "big" : "little",
+           (unsigned long long)len);
+    for (lane = 0; lane < UVMAC_LANES; lane++)
+        printf("  lane %d: got %016llx, reference %016llx\n", lane,
+               (unsigned long long)got[lane], (unsigned long long)want[lane]);
+    return 0;
+}
+
+static void lib_vhash(unsigned char *m, unsigned int mbytes, uvmax_ctx_t *ctx,
+                      uint64_t out[UVMAC_LANES])
+{
+#if (UVMAC_TAG_LEN != 64)
+    out[0] = vhash(m, mbytes, &out[1], ctx);
+#else
+    out[0] = vhash(m, mbytes, NULL, ctx);
+#endif
+}
+
+/* Hash m[0..mbytes) with vhash_update calls split at the given block
+   counts, each piece copied to its own alignment, and a final vhash.
+   prefix, when not null, receives the checkpoint taken before the vhash
+   and snap a snapshot of the state at that point */
+static void lib_vhash_split(const unsigned char *m, unsigned int mbytes,
+                            const unsigned int *splits, int nsplits,
+                            const size_t *offsets, uvmax_ctx_t *ctx,
+                            uint64_t out[UVMAC_LANES], uint64_t prefix[UVMAC_LANES],
+                            uvmac_prefix_t *snap)
+{
+    unsigned int pos = 0, len;
+    int i;
+    for (i = 0; i < nsplits; i++) {
+        len = splits[i] * UVMAC_NHBYTES;
+        memcpy(scratch + offsets[i], m + pos, len);
+        vhash_update(scratch + offsets[i], len, ctx);
+        pos += len;
+    }
+    if (prefix) {
+#if (UVMAC_TAG_LEN != 64)
+        prefix[0] = vhash_checkpoint(ctx, &prefix[1]);
+#else
+        prefix[0] = vhash_checkpoint(ctx, NULL);
+#endif
+        vhash_snapshot(ctx, snap);
+    }
+    len = mbytes - pos;
+    memcpy(scratch + offsets[nsplits], m + pos, len);
+    memset(scratch + offsets[nsplits] + len, 0, 16);
+    lib_vhash(scratch + offsets[nsplits], len, ctx, out);
+}
+
+/* Same split, but each piece hashed as its own segment and the segments
+   combined from the left or, when from_right, from the right */
+static void lib_vhash_segments(const unsigned char *m, unsigned int mbytes,
+                               const unsigned int *splits, int nsplits,
+                               const size_t *offsets, int from_right,
+                               const uvmax_ctx_t *ctx, uint64_t out[UVMAC_LANES])
+{
+    uvmac_segment_t seg[9];
+    unsigned int pos = 0, len;
+    int i;
+    for (i = 0; i <= nsplits; i++) {
+        len = (i < nsplits) ? splits[i] * UVMAC_NHBYTES : mbytes - pos;
+        memcpy(scratch + offsets[i], m + pos, len);
+        memset(scratch + offsets[i] + len, 0, 16);
+        uvmac_segment_init(&seg[i]);
+        uvmac_segment_update(scratch + offsets[i], len, ctx, &seg[i]);
+        pos += len;
+    }
+    if (from_right) {
+        for (i = nsplits; i > 0; i--)
+            uvmac_segment_combine(&seg[i-1], &seg[i], ctx);
+    } else {
+        for (i = 1; i <= nsplits; i++)
+            uvmac_segment_combine(&seg[0], &seg[i], ctx);
+    }
+#if (UVMAC_TAG_LEN != 64)
+    out[0] = uvmac_segment_vhash(&seg[0], &out[1], ctx);
+#else
+    out[0] = uvmac_segment_vhash(&seg[0], NULL, ctx);
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+#if UVMAC_FUZZ
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static unsigned char key[8*KEY_WORDS];
+    uint64_t want[UVMAC_LANES], got[UVMAC_LANES];
+    unsigned int splits[8], nsplits = 0, blocks, mbytes, k;
+    size_t offsets[9], i, used;
+    uvmax_ctx_t ctx;
+    ref_key_t rk;
+    int lane;
+
+    if (!msgbuf) {
+        msgbuf = (unsigned char *)malloc(max_len + 128);
+        scratch = (unsigned char *)malloc(max_len + 128);
+    }
+
+    /* Key first (zero words past the input are valid l3 keys), then one
+       byte per split point, then the message */
+    used = size < 8*UVMAC_KEY_LEN ? size : 8*UVMAC_KEY_LEN;
+    memset(key, 0, sizeof(key));
+    memcpy(key, data, used);
+    data += used; size -= used;
+    mbytes = (unsigned int)(size > 8 ? size - 8 : 0);
+    if (mbytes > max_len)
+        mbytes = (unsigned int)max_len;
+    memcpy(msgbuf, data + (size - mbytes), mbytes);
+    memset(msgbuf + mbytes, 0, 16);
+
+    blocks = mbytes / UVMAC_NHBYTES;
+    for (i = 0; i < 8 && i < size - mbytes && blocks; i++) {
+        splits[nsplits] = 1 + data[i] % blocks;
+        blocks -= splits[nsplits++];
+    }
+    for (i = 0; i <= nsplits; i++)
+        offsets[i] = (i < size - mbytes ? data[i] % 64 : 0) & ~(size_t)(ALIGN_STEP - 1);
+
+    uvmac_set_key(key, KEY_WORDS, &ctx);
+    big_endian = (int)(mbytes & 1);
+    uvmac_set_byte_order(&ctx, big_endian);
+    ref_set_key(key, &rk);
+    ref_vhash(msgbuf, mbytes, &rk, want);
+
+    for (k = 0; k < uvmac_kernel_count(); k++) {
+        if (!uvmac_kernel_select(k))
+            continue;
+        lib_vhash(msgbuf, mbytes, &ctx, got);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane]) {
+                report("vhash", k, mbytes, got, want);
+                abort();
+            }
+        lib_vhash_split(msgbuf, mbytes, splits, nsplits, offsets, &ctx, got, NULL, NULL);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane]) {
+                report("vhash_update", k, mbytes, got, want);
+                abort();
+            }
+        lib_vhash_segments(msgbuf, mbytes, splits, nsplits, offsets, (int)(mbytes & 1),
+                           &ctx, got);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane]) {
+                report("uvmac_segment", k, mbytes, got, want);
+                abort();
+            }
+    }
+    return 0;
+}
+
+#else
+
+static int check_kernel(unsigned int k, unsigned long iterations)
+{
+    unsigned long it;
+    unsigned char key[8*KEY_WORDS];
+    uint64_t pad[UVMAC_LANES];
+    ref_key_t rk;
+    uvmax_ctx_t ctx;
+
+    for (it = 0; it < iterations; it++) {
+        uint64_t want[UVMAC_LANES], got[UVMAC_LANES];
+        uint64_t prefix[UVMAC_LANES], want_prefix[UVMAC_LANES];
+        uvmac_prefix_t snap;
+        unsigned int mbytes, splits[8], nsplits = 0, blocks;
+        size_t offsets[9], off;
+        unsigned int i;
+        int lane;
+
+        fill_random(key, sizeof(key));
+        uvmac_set_key(key, KEY_WORDS, &ctx);
+        big_endian = (int)(rnd() & 1);
+        uvmac_set_byte_order(&ctx, big_endian);
+        ref_set_key(key, &rk);
+
+        /* Lengths: small, around block boundaries or anywhere */
+        switch (rnd() % 3) {
+        case 0: mbytes = rnd() % (3*UVMAC_NHBYTES + 1); break;
+        case 1: mbytes = (rnd() % (max_len/UVMAC_NHBYTES + 1))*UVMAC_NHBYTES
+                         + (unsigned int)(rnd() % 3) - 1;
+                if (mbytes > max_len) mbytes = 0;
+                break;
+        default: mbytes = rnd() % (max_len + 1); break;
+        }
+        off = (rnd() % 64) & ~(size_t)(ALIGN_STEP - 1);
+        fill_random(msgbuf + off, mbytes);
+        memset(msgbuf + off + mbytes, 0, 16);
+        ref_vhash(msgbuf + off, mbytes, &rk, want);
+
+        /* One call */
+        lib_vhash(msgbuf + off, mbytes, &ctx, got);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane])
+                return report("vhash", k, mbytes, got, want);
+
+        /* Split into vhash_update calls */
+        blocks = mbytes / UVMAC_NHBYTES;
+        while (blocks && nsplits < 8 && rnd() % 4) {
+            splits[nsplits] = 1 + (unsigned int)(rnd() % blocks);
+            blocks -= splits[nsplits++];
+        }
+        for (i = 0; i <= nsplits; i++)
+            offsets[i] = (rnd() % 64) & ~(size_t)(ALIGN_STEP - 1);
+        lib_vhash_split(msgbuf + off, mbytes, splits, nsplits, offsets, &ctx, got, prefix, &snap);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane]) {
+                printf("split into %u vhash_update calls:", nsplits);
+                for (i = 0; i < nsplits; i++)
+                    printf(" %u", splits[i]);
+                printf(" blocks\n");
+                return report("vhash_update", k, mbytes, got, want);
+            }
+
+        /* The checkpoint before the last call covers the blocks passed */
+        for (i = 0, blocks = 0; i < nsplits; i++)
+            blocks += splits[i];
+        ref_vhash(msgbuf + off, blocks * UVMAC_NHBYTES, &rk, want_prefix);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (prefix[lane] != want_prefix[lane])
+                return report("vhash_checkpoint", k, blocks * UVMAC_NHBYTES,
+                              prefix, want_prefix);
+
+        /* Forked from the snapshot, the rest of the message hashes the same */
+        memcpy(scratch, msgbuf + off + blocks * UVMAC_NHBYTES, mbytes - blocks * UVMAC_NHBYTES);
+        memset(scratch + mbytes - blocks * UVMAC_NHBYTES, 0, 16);
+        vhash_fork(&ctx, &snap);
+        lib_vhash(scratch, mbytes - blocks * UVMAC_NHBYTES, &ctx, got);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane])
+                return report("vhash_fork", k, mbytes, got, want);
+        lib_vhash_segments(msgbuf + off, mbytes, splits, nsplits, offsets,
+                           (int)(it & 1), &ctx, got);
+        for (lane = 0; lane < UVMAC_LANES; lane++)
+            if (got[lane] != want[lane]) {
+                printf("split into %u segments:", nsplits + 1);
+                for (i = 0; i < nsplits; i++)
+                    printf(" %u", splits[i]);
+                printf(" blocks and the rest\n");
+                return report("uvmac_segment", k, mbytes, got, want);
+            }
+
+        /* A range changed in place: the segment of the old message, updated,
+           hashes as the new message */
+        if (mbytes) {
+            uvmac_segment_t seg;
+            uint64_t changed[UVMAC_LANES];
+            unsigned int from = (unsigned int)(rnd() % ((mbytes - 1) / UVMAC_NHBYTES + 1)) * UVMAC_NHBYTES;
+            unsigned int full = (mbytes - from) / UVMAC_NHBYTES, len;
+            len = (full && rnd() % 2) ? (1 + (unsigned int)(rnd() % full)) * UVMAC_NHBYTES
+                                      : mbytes - from;
+            memcpy(scratch, msgbuf + off, mbytes);
+            memset(scratch + mbytes, 0, 16);
+            fill_random(scratch + from, len);
+            ref_vhash(scratch, mbytes, &rk, changed);
+            uvmac_segment_init(&seg);
+            uvmac_segment_update(msgbuf + off, mbytes, &ctx, &seg);
+            uvmac_segment_replace(&seg, from, msgbuf + off + from, scratch + from, len, &ctx);
+#if (UVMAC_TAG_LEN != 64)
+            got[0] = uvmac_segment_vhash(&seg, &got[1], &ctx);
+#else
+            got[0] = uvmac_segment_vhash(&seg, NULL, &ctx);
+#endif
+            for (lane = 0; lane < UVMAC_LANES; lane++)
+                if (got[lane] != changed[lane]) {
+                    printf("bytes %u to %u replaced\n", from, from + len);
+                    return report("uvmac_segment_replace", k, mbytes, got, changed);
+                }
+        }
+
+        /* Full tag */
+        {
+            uint64_t pos = 0, tagl[UVMAC_LANES] = {0};
+            fill_random((unsigned char *)pad, sizeof(pad));
+            got[0] = uvmac(msgbuf + off, mbytes, tagl, &ctx, pad, UVMAC_LANES, &pos);
+            for (lane = 1; lane < UVMAC_LANES; lane++)
+                got[lane] = tagl[lane-1];
+            for (lane = 0; lane < UVMAC_LANES; lane++) {
+                want[lane] += load_be((unsigned char *)&pad[lane]);
+                if (got[lane] != want[lane])
+                    return report("uvmac", k, mbytes, got, want);
+            }
+        }
+    }
+    return 1;
+}
+
+static int check_stages(unsigned long iterations)
+{
+    unsigned long it;
+    unsigned char key[8*KEY_WORDS];
+    ref_key_t rk;
+    uvmax_ctx_t ctx;
+
+    for (it = 0; it < iterations; it++) {
+        uint64_t rh[UVMAC_LANES], rl[UVMAC_LANES];
+        unsigned int rem = 1 + (unsigned int)(rnd() % (UVMAC_NHBYTES - 1));
+        u128 a, k, mm, want;
+        uint64_t ah, al, len, l3;
+        int lane;
+
+        fill_random(key, sizeof(key));
+        uvmac_set_key(key, KEY_WORDS, &ctx);
+        big_endian = (int)(rnd() & 1);
+        uvmac_set_byte_order(&ctx, big_endian);
+        ref_set_key(key, &rk);
+        fill_random(msgbuf, UVMAC_NHBYTES);
+
+        /* NH, full and partial block */
+        uvmac_nh_block(msgbuf, &ctx, rh, rl);
+        for (lane = 0; lane < UVMAC_LANES; lane++) {
+            want = ref_nh(msgbuf, UVMAC_NHBYTES, 0, UVMAC_NHBYTES/8, &rk, lane);
+            if (rh[lane] != want.hi || rl[lane] != want.lo) {
+                printf("MISMATCH in NH of a full block, lane %d\n", lane);
+                return 0;
+            }
+        }
+        memset(msgbuf + rem, 0, 16);
+        uvmac_nh_partial(msgbuf, rem, &ctx, rh, rl);
+        for (lane = 0; lane < UVMAC_LANES; lane++) {
+            want = ref_nh(msgbuf, rem, 0, 2*((rem + 15)/16), &rk, lane);
+            if (rh[lane] != want.hi || rl[lane] != want.lo) {
+                printf("MISMATCH in NH of a %u-byte block, lane %d\n", rem, lane);
+                return 0;
+            }
+        }
+
+        /* Poly step, from a reduced accumulator and a 126-bit NH output */
+        a.hi = rnd() & UINT64_C(0x7fffffffffffffff); a.lo = rnd();
+        a = mod_127(a);
+        mm.hi = rnd() & UINT64_C(0x3fffffffffffffff); mm.lo = rnd();
+        k = rk.polykey[0];
+        ah = a.hi; al = a.lo;
+        uvmac_poly_step(&ah, &al, k.hi, k.lo, mm.hi, mm.lo);
+        want = addmod_127(mulmod_127(a, k), mm);
+        a.hi = ah; a.lo = al;
+        a = mod_127(a);
+        if (a.hi != want.hi || a.lo != want.lo) {
+            printf("MISMATCH in poly_step\n");
+            return 0;
+        }
+
+        /* l3hash */
+        len = 8*(rnd() % UVMAC_NHBYTES);
+        l3 = uvmac_l3hash(want.hi, want.lo, rk.l3key[0], rk.l3key[1], len);
+        if (l3 != ref_l3(want, rk.l3key[0], rk.l3key[1], len)) {
+            printf("MISMATCH in l3hash\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ----------------------------------------------------------------------- */
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = 2000;
+    uint64_t seed = 1;
+    unsigned int k;
+    int i, ok = 1;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--iterations") == 0)
+            iterations = strtoul(argv[i+1], NULL, 0);
+        else if (strcmp(argv[i], "--seed") == 0)
+            seed = strtoull(argv[i+1], NULL, 0);
+        else if (strcmp(argv[i], "--max-len") == 0)
+            max_len = strtoul(argv[i+1], NULL, 0);
+        else
+            break;
+    }
+    if (i < argc) {
+        printf("usage: %s [--iterations N] [--seed S] [--max-len N]\n", argv[0]);
+        return 1;
+    }
+
+    msgbuf = (unsigned char *)malloc(max_len + 128);
+    scratch = (unsigned char *)malloc(max_len + 128);
+    if (!msgbuf || !scratch) {
+        printf("Could not allocate buffers of %lu bytes\n", (unsigned long)max_len);
+        return 1;
+    }
+
+    printf("UVMAC_TAG_LEN %d, UVMAC_NHBYTES %d, seed %llu\n", UVMAC_TAG_LEN,
+           UVMAC_NHBYTES, (unsigned long long)seed);
+    rng_state = seed;
+    if (check_stages(iterations))
+        printf("stages: %lu cases OK\n", iterations);
+    else
+        ok = 0;
+
+    for (k = 0; k < uvmac_kernel_count() && ok; k++) {
+        if (!uvmac_kernel_select(k)) {
+            printf("kernel %s: not supported on this cpu, skipped\n",
+                   uvmac_kernel_info(k)->name);
+            continue;
+        }
+        rng_state = seed + k;
+        if (check_kernel(k, iterations))
+            printf("kernel %s: %lu cases OK\n", uvmac_kernel_info(k)->name, iterations);
+        else {
+            printf("seed %llu\n", (unsigned long long)(seed + k));
+            ok = 0;
+        }
+    }
+    uvmac_kernel_select(0);
+
+    free(msgbuf);
+    free(scratch);
+    return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,373 @@
+#ifndef HEADER_UVMAC_DECOMPRESS_H
+#define HEADER_UVMAC_DECOMPRESS_H
+
+/* --------------------------------------------------------------------------
+ * Decompressed input for the uvmac program, so that the tag of a .gz or
+ * .zst file is the tag of its content without writing that content to
+ * disk.
+ *
+ * A Decompressor reads a file on its own thread, decompressing it when it
+ * starts as gzip (with UVMAC_ZLIB) or zstd (with UVMAC_ZSTD) data and
+ * copying it otherwise, into parts of part_bytes bytes taken from a
+ * BufferPool, so that decompressing one part overlaps with hashing the
+ * previous one on the calling thread. next() hands out the parts in order,
+ * all full but the last one, which is flagged as such and is empty when
+ * the data is (so that there is always a last part); it returns null at
+ * the end of the data or on an error, after which error() is non-empty.
+ * Each part is handed back with release(). Concatenated gzip members and
+ * zstd frames are decompressed one after the other, as gzip -d and zstd -d
+ * do. The parts in flight are depth buffers of part_bytes + 16 bytes: the
+ * memory used does not depend on the size of the data.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "uvmacbuffer.h"
+#include "uvmactrace.h"
+
+#ifndef UVMAC_ZLIB
+#define UVMAC_ZLIB 0       /* Set by CMake when zlib is found               */
+#endif
+#ifndef UVMAC_ZSTD
+#define UVMAC_ZSTD 0       /* Set by the UVMAC_ZSTD CMake option            */
+#endif
+
+#if UVMAC_ZLIB
+#include <zlib.h>
+#endif
+#if UVMAC_ZSTD
+#include <zstd.h>
+#endif
+
+class Decompressor
+{
+public:
+    enum Format { PLAIN, GZIP, ZSTD };
+
+    Decompressor(const std::string &path, BufferPool &pool, unsigned int part_bytes,
+                 unsigned int depth = 4)
+        : path(path), pool(pool), part_bytes(part_bytes), format(PLAIN), file(NULL),
+          in(1 << 18), in_pos(0), in_len(0), in_eof(false), done(false), quit(false)
+    {
+        for (unsigned int i = 0; i < depth; ++i) {
+            unsigned char *m = pool.acquire(part_bytes);
+            if (!m) {
+                fail("Could not allocate a buffer of " + std::to_string(part_bytes) + " bytes");
+                return;
+            }
+            free_parts.push_back(m);
+        }
+        file = fopen(path.c_str(), "rb");
+        if (!file) {
+            fail("Opening input file " + path + " failed");
+            return;
+        }
+        // The format from the first bytes, which are kept for the decoder
+        refill();
+        format = detect(in.data(), in_len);
+        if (format == GZIP && !UVMAC_ZLIB)
+            fail(path + " is gzip-compressed, but uvmac was built without zlib");
+        else if (format == ZSTD && !UVMAC_ZSTD)
+            fail(path + " is zstd-compressed, but uvmac was built without zstd");
+        else
+            producer = std::thread(&Decompressor::run, this);
+    }
+
+    ~Decompressor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cv.notify_all();
+        if (producer.joinable())
+            producer.join();
+        for (size_t i = 0; i < ready.size(); ++i)
+            pool.release(ready[i].data);
+        for (size_t i = 0; i < free_parts.size(); ++i)
+            pool.release(free_parts[i]);
+        if (file)
+            fclose(file);
+    }
+
+    static Format detect(const unsigned char *p, size_t n)
+    {
+        if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b)
+            return GZIP;
+        if (n >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd)
+            return ZSTD;
+        return PLAIN;
+    }
+
+    Format input_format() const { return format; }
+
+    /* The next part and its length, null after the last one or on error */
+    unsigned char *next(unsigned int &bytes, bool &last)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return !ready.empty() || done; });
+        if (ready.empty())
+            return NULL;
+        Part part = ready.front();
+        ready.pop_front();
+        bytes = part.bytes;
+        last = part.last;
+        return part.data;
+    }
+
+    void release(unsigned char *m)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_parts.push_back(m);
+        }
+        cv.notify_all();
+    }
+
+    std::string error() const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failure;
+    }
+
+private:
+    struct Part
+    {
+        unsigned char *data;
+        unsigned int bytes;
+        bool last;
+    };
+
+    void fail(const std::string &message)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failure.empty())
+            failure = message;
+        done = true;
+    }
+
+    // Compressed (or plain) bytes in in[in_pos, in_len)
+    bool refill()
+    {
+        if (in_pos < in_len || in_eof)
+            return in_pos < in_len;
+        in_pos = 0;
+        in_len = fread(in.data(), 1, in.size(), file);
+        in_eof = in_len < in.size();
+        return in_len > 0;
+    }
+
+    /* Fills m with up to part_bytes bytes of data, fewer only at the end;
+       false on an error */
+    bool fill(unsigned char *m, unsigned int &n)
+    {
+        n = 0;
+        while (n < part_bytes) {
+            bool more = refill();
+            size_t used = 0, made = 0;
+            if (format == PLAIN) {
+                if (!more)
+                    break;
+                made = std::min((size_t)(part_bytes - n), in_len - in_pos);
+                memcpy(m + n, in.data() + in_pos, made);
+                used = made;
+                // Past the bytes read for the detection, straight into m
+                if (in_pos + used == in_len && !in_eof && n + made < part_bytes) {
+                    size_t room = part_bytes - n - made;
+                    size_t got = fread(m + n + made, 1, room, file);
+                    made += got;
+                    in_eof = got < room;
+                }
+            } else {
+                // The decoder may still hold output when the input is used up
+                if (!more && stream_complete())
+                    break;
+                if (!decode(m + n, part_bytes - n, used, made))
+                    return false;
+                if (!more && !made)
+                    break;
+            }
+            in_pos += used;
+            n += (unsigned int)made;
+        }
+        if (ferror(file)) {
+            fail("Reading input file " + path + " failed");
+            return false;
+        }
+        if (n < part_bytes && !stream_complete()) {
+            fail(path + " is truncated");
+            return false;
+        }
+        return true;
+    }
+
+#if UVMAC_ZLIB
+    z_stream zs;
+    bool zs_open = false, zs_end = true;
+#endif
+#if UVMAC_ZSTD
+    ZSTD_DCtx *zd = NULL;
+    size_t zd_left = 0;     // non-zero in the middle of a frame
+#endif
+
+    /* Decodes compressed bytes from in[in_pos, in_len) into out[0, room),
+       telling how many bytes it used and made */
+    bool decode(unsigned char *out, unsigned int room, size_t &used, size_t &made)
+    {
+#if UVMAC_ZLIB
+        if (format == GZIP) {
+            if (!zs_open) {
+                memset(&zs, 0, sizeof(zs));
+                if (inflateInit2(&zs, 15 + 16) != Z_OK) {   // gzip header
+                    fail("Initializing zlib failed");
+                    return false;
+                }
+                zs_open = true;
+            } else if (zs_end)
+                inflateReset(&zs);                          // next member
+            zs.next_in = in.data() + in_pos;
+            zs.avail_in = (uInt)(in_len - in_pos);
+            zs.next_out = out;
+            zs.avail_out = room;
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            used = (in_len - in_pos) - zs.avail_in;
+            made = room - zs.avail_out;
+            zs_end = (ret == Z_STREAM_END);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                fail(path + ": gzip data error" + (zs.msg ? std::string(": ") + zs.msg : ""));
+                return false;
+            }
+            return true;
+        }
+#endif
+#if UVMAC_ZSTD
+        if (format == ZSTD) {
+            if (!zd && !(zd = ZSTD_createDCtx())) {
+                fail("Initializing zstd failed");
+                return false;
+            }
+            ZSTD_inBuffer src = {in.data() + in_pos, in_len - in_pos, 0};
+            ZSTD_outBuffer dst = {out, room, 0};
+            zd_left = ZSTD_decompressStream(zd, &dst, &src);
+            if (ZSTD_isError(zd_left)) {
+                fail(path + ": zstd data error: " + ZSTD_getErrorName(zd_left));
+                return false;
+            }
+            used = src.pos;
+            made = dst.pos;
+            return true;
+        }
+#endif
+        (void)out;
+        (void)room;
+        used = made = 0;
+        return false;
+    }
+
+    // Whether the compressed data ended at the end of a member or frame
+    bool stream_complete() const
+    {
+#if UVMAC_ZLIB
+        if (format == GZIP)
+            return zs_end;
+#endif
+#if UVMAC_ZSTD
+        if (format == ZSTD)
+            return zd_left == 0;
+#endif
+        return true;
+    }
+
+    void finish_decoder()
+    {
+#if UVMAC_ZLIB
+        if (zs_open)
+            inflateEnd(&zs);
+#endif
+#if UVMAC_ZSTD
+        ZSTD_freeDCtx(zd);
+#endif
+    }
+
+    /* Keeps one filled part back until the next one is known, so that the
+       last part is flagged even when the data ends at a part boundary */
+    void run()
+    {
+        Part held = {NULL, 0, false};
+        for (;;) {
+            unsigned char *m;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return !free_parts.empty() || quit; });
+                if (quit)
+                    break;
+                m = free_parts.back();
+                free_parts.pop_back();
+            }
+            unsigned int n;
+            bool ok;
+            {
+                TraceSpan span(TRACE_READ, part_bytes);
+                ok = fill(m, n);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok) {
+                free_parts.push_back(m);
+                break;
+            }
+            if (held.data) {
+                held.last = (n == 0);
+                ready.push_back(held);
+                held.data = NULL;
+            } else if (n == 0) {
+                // No data at all: one empty last part, for the caller's tag
+                ready.push_back(Part{m, 0, true});
+                break;
+            }
+            if (n == 0)
+                free_parts.push_back(m);
+            else if (n < part_bytes)
+                ready.push_back(Part{m, n, true});
+            else
+                held = Part{m, n, false};
+            if (n < part_bytes)
+                break;
+            cv.notify_all();
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (held.data)
+                free_parts.push_back(held.data);
+            done = true;
+        }
+        cv.notify_all();
+        finish_decoder();
+    }
+
+    std::string path;
+    BufferPool &pool;
+    unsigned int part_bytes;
+    Format format;
+    FILE *file;
+    std::vector<unsigned char> in;
+    size_t in_pos, in_len;
+    bool in_eof;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<unsigned char *> free_parts;
+    std::deque<Part> ready;
+    std::string failure;
+    bool done, quit;
+    std::thread producer;
+};
+
+#endif /* HEADER_UVMAC_DECOMPRESS_H */
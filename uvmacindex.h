@@ -0,0 +1,288 @@
+#ifndef HEADER_UVMAC_INDEX_H
+#define HEADER_UVMAC_INDEX_H
+
+/* --------------------------------------------------------------------------
+ * Tag index: one file mapping keys (the absolute paths of the files tagged
+ * by "uvmac --index", or any other string such as a content ID) to their
+ * message number and tag, so that verifying a file takes one lookup instead
+ * of finding its .tag file.
+ *
+ * File layout, integers in host byte order:
+ *   header: "UVMACIDX", version, UVMAC_TAG_LEN/64, entries, bucket bits b
+ *   directory: 2^b + 1 offsets, of the first record of each bucket then of
+ *     the end of the records
+ *   records, sorted by key hash then key: hash, message number, the tag
+ *     words (the value uvmac returns first), key length and key, padded to
+ *     8 bytes.
+ * The bucket of a key is the top b bits of its 64-bit FNV-1a hash, and b is
+ * chosen for about one record per bucket: find() maps the file and reads
+ * the directory slot and the records of one bucket, whatever the number of
+ * entries. merge() writes a new index holding the records of the existing
+ * one and the new entries, a new entry replacing a record of the same key,
+ * reading the existing file once in order; the new file replaces the old
+ * one by rename, so readers see one or the other.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "uvmaclib.h"
+
+class TagIndex
+{
+public:
+    static const unsigned int tag_words = UVMAC_TAG_LEN / 64;
+
+    struct Entry
+    {
+        std::string key;
+        uint64_t message;
+        uint64_t tag[tag_words];
+    };
+
+    TagIndex() : map(NULL), map_bytes(0), header(NULL), dir(NULL) {}
+    ~TagIndex() { close(); }
+
+    /* Maps the index at path; false if it cannot be read or is not an
+       index for this tag length */
+    bool open(const std::string &path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0)
+            return false;
+        if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(Header)) {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        map = (const unsigned char *)p;
+        map_bytes = (uint64_t)st.st_size;
+        header = (const Header *)map;
+        if (memcmp(header->magic, magic, 8) != 0 || header->version != version ||
+            header->tag_words != tag_words || header->bucket_bits > 40 ||
+            sizeof(Header) + (buckets(header->bucket_bits) + 1) * 8 > map_bytes) {
+            close();
+            return false;
+        }
+        dir = (const uint64_t *)(map + sizeof(Header));
+        return true;
+    }
+
+    void close()
+    {
+        if (map)
+            munmap((void *)map, (size_t)map_bytes);
+        map = NULL;
+        header = NULL;
+        dir = NULL;
+    }
+
+    uint64_t size() const { return header ? header->entries : 0; }
+
+    /* The message number and tag of key, false if it is not in the index */
+    bool find(const std::string &key, uint64_t &message, uint64_t tag[]) const
+    {
+        if (!header)
+            return false;
+        uint64_t h = hash(key), b = bucket(h, header->bucket_bits);
+        for (uint64_t off = dir[b]; off < dir[b + 1] && off < map_bytes; ) {
+            Record r;
+            if (!read_record(off, r))
+                return false;
+            if (r.hash == h && r.key_bytes == key.size() &&
+                memcmp(r.key, key.data(), key.size()) == 0) {
+                message = r.message;
+                memcpy(tag, r.tag, sizeof(uint64_t) * tag_words);
+                return true;
+            }
+            if (r.hash > h)
+                break;
+            off = r.next;
+        }
+        return false;
+    }
+
+    /* Writes to path the index of the records already there (if any) and
+       of entries; false on a write error or when path exists but is not an
+       index for this tag length */
+    static bool merge(const std::string &path, std::vector<Entry> entries)
+    {
+        // Sorted like the records; of several entries for a key the last wins
+        std::vector<std::pair<uint64_t, size_t> > order(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+            order[i] = std::make_pair(hash(entries[i].key), i);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b) {
+                             return a.first != b.first ? a.first < b.first
+                                                       : entries[a.second].key < entries[b.second].key;
+                         });
+        std::vector<std::pair<uint64_t, size_t> > sorted;
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (!sorted.empty() && sorted.back().first == order[i].first &&
+                entries[sorted.back().second].key == entries[order[i].second].key)
+                sorted.back() = order[i];
+            else
+                sorted.push_back(order[i]);
+        }
+
+        TagIndex old;
+        if (!old.open(path) && access(path.c_str(), F_OK) == 0)
+            return false;
+        uint64_t bound = old.size() + sorted.size();
+        unsigned int bits = 0;
+        while (bits < 40 && buckets(bits) < bound)
+            ++bits;
+
+        std::string tmp = path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        std::vector<uint64_t> directory(buckets(bits) + 1, 0);
+        Header h;
+        memcpy(h.magic, magic, 8);
+        h.version = version;
+        h.tag_words = tag_words;
+        h.entries = 0;
+        h.bucket_bits = bits;
+        h.reserved = 0;
+        uint64_t off = sizeof(Header) + directory.size() * 8, next_bucket = 0;
+        bool ok = fseek(f, (long)off, SEEK_SET) == 0;
+
+        // Merge of the two sorted sequences, the new entry winning a tie
+        uint64_t old_off = old.header ? old.dir[0] : 0;
+        uint64_t old_end = old.header ? old.dir[buckets(old.header->bucket_bits)] : 0;
+        size_t i = 0;
+        Record r;
+        bool have_old = old.header && old_off < old_end && old.read_record(old_off, r);
+        while (ok && (have_old || i < sorted.size())) {
+            const Entry *e = i < sorted.size() ? &entries[sorted[i].second] : NULL;
+            uint64_t eh = e ? sorted[i].first : 0;
+            int cmp = !have_old ? 1 : !e ? -1 : compare(r.hash, r.key, r.key_bytes, eh, *e);
+            uint64_t rh = cmp < 0 ? r.hash : eh;
+            for (uint64_t b = bucket(rh, bits); next_bucket <= b; ++next_bucket)
+                directory[next_bucket] = off;
+            if (cmp < 0)
+                ok = write_record(f, r.hash, r.message, r.tag, r.key, r.key_bytes, off);
+            else
+                ok = write_record(f, eh, e->message, e->tag, e->key.data(), (uint32_t)e->key.size(), off);
+            ++h.entries;
+            if (cmp <= 0) {
+                old_off = r.next;
+                have_old = old_off < old_end && old.read_record(old_off, r);
+            }
+            if (cmp >= 0)
+                ++i;
+        }
+        for ( ; next_bucket < directory.size(); ++next_bucket)
+            directory[next_bucket] = off;
+
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(directory.data(), 8, directory.size(), f) == directory.size();
+        ok = (fclose(f) == 0) && ok;
+        old.close();
+        if (ok)
+            ok = rename(tmp.c_str(), path.c_str()) == 0;
+        if (!ok)
+            remove(tmp.c_str());
+        return ok;
+    }
+
+    /* 64-bit FNV-1a */
+    static uint64_t hash(const std::string &key)
+    {
+        uint64_t h = UINT64_C(0xcbf29ce484222325);
+        for (size_t i = 0; i < key.size(); ++i)
+            h = (h ^ (unsigned char)key[i]) * UINT64_C(0x100000001b3);
+        return h;
+    }
+
+private:
+    static const uint32_t version = 1;
+    static constexpr const char *magic = "UVMACIDX";
+
+    struct Header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t tag_words;
+        uint64_t entries;
+        uint32_t bucket_bits;
+        uint32_t reserved;
+    };
+
+    struct Record
+    {
+        uint64_t hash;
+        uint64_t message;
+        uint64_t tag[tag_words];
+        uint32_t key_bytes;
+        const char *key;            // in the mapping
+        uint64_t next;              // offset of the next record
+    };
+
+    static uint64_t buckets(unsigned int bits) { return UINT64_C(1) << bits; }
+
+    static uint64_t bucket(uint64_t h, unsigned int bits)
+    {
+        return bits ? h >> (64 - bits) : 0;
+    }
+
+    static int compare(uint64_t ha, const char *ka, uint32_t na, uint64_t hb, const Entry &b)
+    {
+        if (ha != hb)
+            return ha < hb ? -1 : 1;
+        int c = memcmp(ka, b.key.data(), std::min((size_t)na, b.key.size()));
+        if (c)
+            return c;
+        return na == b.key.size() ? 0 : (na < b.key.size() ? -1 : 1);
+    }
+
+    static const uint64_t fixed_bytes = 8 * (2 + tag_words) + 4;
+
+    bool read_record(uint64_t off, Record &r) const
+    {
+        if (off + fixed_bytes > map_bytes)
+            return false;
+        const unsigned char *p = map + off;
+        memcpy(&r.hash, p, 8);
+        memcpy(&r.message, p + 8, 8);
+        memcpy(r.tag, p + 16, 8 * tag_words);
+        memcpy(&r.key_bytes, p + 16 + 8 * tag_words, 4);
+        r.key = (const char *)p + fixed_bytes;
+        r.next = off + ((fixed_bytes + r.key_bytes + 7) & ~(uint64_t)7);
+        return r.next <= map_bytes;
+    }
+
+    static bool write_record(FILE *f, uint64_t h, uint64_t message, const uint64_t tag[],
+                             const char *key, uint32_t key_bytes, uint64_t &off)
+    {
+        static const char zeros[8] = {0};
+        uint64_t bytes = (fixed_bytes + key_bytes + 7) & ~(uint64_t)7;
+        bool ok = fwrite(&h, 8, 1, f) == 1 && fwrite(&message, 8, 1, f) == 1 &&
+                  fwrite(tag, 8, tag_words, f) == tag_words &&
+                  fwrite(&key_bytes, 4, 1, f) == 1 &&
+                  fwrite(key, 1, key_bytes, f) == key_bytes &&
+                  fwrite(zeros, 1, bytes - fixed_bytes - key_bytes, f) == bytes - fixed_bytes - key_bytes;
+        off += bytes;
+        return ok;
+    }
+
+    const unsigned char *map;
+    uint64_t map_bytes;
+    const Header *header;
+    const uint64_t *dir;
+};
+
+#endif /* HEADER_UVMAC_INDEX_H */
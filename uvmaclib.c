@@ -16,8 +16,10 @@
  * ----------------------------------------------------------------------- */
 
 #include "uvmaclib.h"
+#include "uvmaclib_internal.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
 /* Enable code tuned for 64-bit registers; otherwise tuned for 32-bit */
@@ -26,9 +28,10 @@
 #endif
 
 /* Enable code tuned for Intel SSE2 instruction set                   */
+#ifndef UVMAC_USE_SSE2
 #if ((__SSE2__ || (_M_IX86_FP >= 2)) && ( ! UVMAC_ARCH_64))
 #define UVMAC_USE_SSE2    1
-#include <emmintrin.h>
+#endif
 #endif
 
 /* Native word reads. Update (or define via compiler) if incorrect */
@@ -38,6 +41,40 @@
        _M_X64 || __ARMEL__ || __MIPSEL__))
 #endif
 
+/* Enable the SSE2 intrinsics kernel (x86, either byte order)         */
+#ifndef UVMAC_SSE2_KERNEL
+#define UVMAC_SSE2_KERNEL ((__SSE2__ || (_M_IX86_FP >= 2) || _M_X64) && \
+                           ! UVMAC_ARCH_BIG_ENDIAN)
+#endif
+
+/* Enable the SSSE3 and AVX2 kernels, compiled for these instruction sets
+   whatever the compiler flags and selectable when the cpu has them      */
+#ifndef UVMAC_X86_TARGET_KERNELS
+#define UVMAC_X86_TARGET_KERNELS (UVMAC_SSE2_KERNEL && __GNUC__ && \
+                                  (__x86_64__ || __i386__))
+#endif
+
+/* Enable the portable kernel written with GNU C vector extensions      */
+#ifndef UVMAC_VECTOR_KERNEL
+#define UVMAC_VECTOR_KERNEL (__GNUC__ >= 9 || __clang__)
+#endif
+
+#if (UVMAC_TAG_LEN != 64 && UVMAC_TAG_LEN != 128 && UVMAC_TAG_LEN != 256)
+#error "UVMAC_TAG_LEN must be 64, 128 or 256"
+#endif
+
+/* Default prefetch distance of the pipelined kernel, in bytes           */
+#ifndef UVMAC_PREFETCH_BYTES
+#define UVMAC_PREFETCH_BYTES 2048
+#endif
+
+#if (UVMAC_USE_SSE2 || UVMAC_SSE2_KERNEL || (UVMAC_VECTOR_KERNEL && __SSE2__))
+#include <emmintrin.h>
+#endif
+#if UVMAC_X86_TARGET_KERNELS
+#include <immintrin.h>
+#endif
+
 /* ----------------------------------------------------------------------- */
 /* Constants and masks                                                     */
 
@@ -178,15 +215,30 @@ const uint64_t mpoly = UINT64_C(0x1fffffff1fffffff);  /* Poly key mask     */
 #if __GNUC__
 #define ALIGN(n)      __attribute__ ((aligned(n)))
 #define NOINLINE      __attribute__ ((noinline))
+#define ALWAYS_INLINE __attribute__ ((always_inline)) inline
 #define FASTCALL
+#define PREFETCH(p)   __builtin_prefetch((p), 0, 3)
+#define PREFETCH_NTA(p) __builtin_prefetch((p), 0, 0)
 #elif _MSC_VER
 #define ALIGN(n)      __declspec(align(n))
 #define NOINLINE      __declspec(noinline)
+#define ALWAYS_INLINE __forceinline
 #define FASTCALL      __fastcall
+#if (_M_IX86 || _M_X64)
+#define PREFETCH(p)   _mm_prefetch((const char *)(p), _MM_HINT_T0)
+#define PREFETCH_NTA(p) _mm_prefetch((const char *)(p), _MM_HINT_NTA)
+#include <xmmintrin.h>
+#else
+#define PREFETCH(p)
+#define PREFETCH_NTA(p)
+#endif
 #else
 #define ALIGN(n)
 #define NOINLINE
+#define ALWAYS_INLINE
 #define FASTCALL
+#define PREFETCH(p)
+#define PREFETCH_NTA(p)
 #endif
 
 /* ----------------------------------------------------------------------- */
@@ -248,11 +300,10 @@ const uint64_t mpoly = UINT64_C(0x1fffffff1fffffff);  /* Poly key mask     */
 
 /* ----------------------------------------------------------------------- */
 
-#if (UVMAC_PREFER_BIG_ENDIAN)
-#  define get64PE get64BE
-#else
-#  define get64PE get64LE
-#endif
+/* Reads a message word in the byte order of the context: every function
+   using the NH macros below has msg_be in scope, either ctx->big_endian
+   or a constant for loops specialized for one order                     */
+#define get64PE(ptr) (msg_be ? get64BE(ptr) : get64LE(ptr))
 
 #if (UVMAC_ARCH_BIG_ENDIAN)
 #  define get64BE(ptr) (*(uint64_t *)(ptr))
@@ -272,13 +323,106 @@ const uint64_t mpoly = UINT64_C(0x1fffffff1fffffff);  /* Poly key mask     */
  * For each, nh_16 *must* be defined (works on multiples of 16 bytes).
  * Optionally, nh_vhash_nhbytes can be defined (for multiples of
  * UVMAC_NHBYTES), and nh_16_2 and nh_vhash_nhbytes_2 (versions that do two
- * NH computations at once).
+ * NH computations at once), and nh_16_4 and nh_vhash_nhbytes_4 (four NH
+ * computations, for 256-bit tags, into arrays rh[4] and rl[4]). These
+ * default to two passes of the two-lane versions: with general purpose
+ * registers, four lanes sharing each message load run out of registers
+ * for their accumulators, and were slower when measured.
  * --------------------------------------------------------------------- */
 
+#if ( ! UVMAC_ARCH_64)
+/* Portable 32-bit NH, also used by the MMX version below for big-endian
+   words */
+#define nh_16_c32(mp, kp, nw, rh, rl)                                   \
+{   uint64_t t1,t2,m1,m2,t;                                             \
+    int i;                                                              \
+    rh = rl = t = 0;                                                    \
+    for (i = 0; i < nw; i+=2)  {                                        \
+        t1  = get64PE(mp+i) + kp[i];                                    \
+        t2  = get64PE(mp+i+1) + kp[i+1];                                \
+        m2  = MUL32(t1 >> 32, t2);                                      \
+        m1  = MUL32(t1, t2 >> 32);                                      \
+        ADD128(rh,rl,MUL32(t1 >> 32,t2 >> 32),MUL32(t1,t2));            \
+        rh += (uint64_t)(uint32_t)(m1 >> 32) + (uint32_t)(m2 >> 32);    \
+        t  += (uint64_t)(uint32_t)m1 + (uint32_t)m2;                    \
+    }                                                                   \
+    ADD128(rh,rl,(t >> 32),(t << 32));                                  \
+}
+
+/* Portable 32-bit poly step: (ah,al) = (ah,al)*(kh,kl) + (mh,ml), with
+   32x32->64-bit multiplications only. It needs no MMX state, unlike the
+   SSE2 assembly version below */
+static void poly_step_c32(uint64_t *ahi, uint64_t *alo, const uint64_t *kh,
+              const uint64_t *kl, const uint64_t *mh, const uint64_t *ml)
+{
+    /* Work on copies: reading the 64-bit words through 32-bit pointers
+       breaks strict aliasing, and the compiler may then read them before
+       the caller has stored them */
+    const uint64_t av0 = *alo, av1 = *ahi, kv0 = *kl, kv1 = *kh;
+
+#define a0 ((uint32_t)av0)
+#define a1 ((uint32_t)(av0 >> 32))
+#define a2 ((uint32_t)av1)
+#define a3 ((uint32_t)(av1 >> 32))
+#define k0 ((uint32_t)kv0)
+#define k1 ((uint32_t)(kv0 >> 32))
+#define k2 ((uint32_t)kv1)
+#define k3 ((uint32_t)(kv1 >> 32))
+
+    uint64_t p, q, t;
+    uint32_t t2;
+
+    p = MUL32(a3, k3);
+    p += p;
+    p += *(uint64_t *)mh;
+    p += MUL32(a0, k2);
+    p += MUL32(a1, k1);
+    p += MUL32(a2, k0);
+    t = (uint32_t)(p);
+    p >>= 32;
+    p += MUL32(a0, k3);
+    p += MUL32(a1, k2);
+    p += MUL32(a2, k1);
+    p += MUL32(a3, k0);
+    t |= ((uint64_t)((uint32_t)p & 0x7fffffff)) << 32;
+    p >>= 31;
+    p += (uint64_t)(uint32_t)(*ml);
+    p += MUL32(a0, k0);
+    q =  MUL32(a1, k3);
+    q += MUL32(a2, k2);
+    q += MUL32(a3, k1);
+    q += q;
+    p += q;
+    t2 = (uint32_t)(p);
+    p >>= 32;
+    p += (*ml >> 32);
+    p += MUL32(a0, k1);
+    p += MUL32(a1, k0);
+    q =  MUL32(a2, k3);
+    q += MUL32(a3, k2);
+    q += q;
+    p += q;
+    *(uint64_t *)(alo) = (p << 32) | t2;
+    p >>= 32;
+    *(uint64_t *)(ahi) = p + t;
+
+#undef a0
+#undef a1
+#undef a2
+#undef a3
+#undef k0
+#undef k1
+#undef k2
+#undef k3
+}
+#endif
+
 /* ----------------------------------------------------------------------- */
 #if UVMAC_ARCH_64
 /* ----------------------------------------------------------------------- */
 
+#define NATIVE_KERNEL_NAME "64bit"
+
 #define nh_16(mp, kp, nw, rh, rl)                                            \
 {   int i; uint64_t th, tl;                                                  \
     rh = rl = 0;                                                             \
@@ -363,6 +507,8 @@ const uint64_t mpoly = UINT64_C(0x1fffffff1fffffff);  /* Poly key mask     */
 #elif UVMAC_USE_SSE2
 /* ----------------------------------------------------------------------- */
 
+#define NATIVE_KERNEL_NAME "sse2-mmx"
+
 // macros from Crypto++ for sharing inline assembly code between MSVC and GNU C
 #if defined(__GNUC__)
 	// define these in two steps to allow arguments to be expanded
@@ -485,7 +631,14 @@ static void NOINLINE nh_16_func(const uint64_t *mp, const uint64_t *kp, size_t n
 	);
 #endif
 }
-#define nh_16(mp, kp, nw, rh, rl)   nh_16_func(mp, kp, nw, &(rh), &(rl));
+/* The assembly reads little-endian words only */
+#define nh_16(mp, kp, nw, rh, rl)                                       \
+{   if (msg_be) {                                                       \
+        nh_16_c32(mp, kp, nw, rh, rl);                                  \
+    } else {                                                            \
+        nh_16_func(mp, kp, nw, &(rh), &(rl));                           \
+    }                                                                   \
+}
 
 static void poly_step_func(uint64_t *ahi, uint64_t *alo, const uint64_t *kh,
                const uint64_t *kl, const uint64_t *mh, const uint64_t *ml)
@@ -616,94 +769,13 @@ static void poly_step_func(uint64_t *ahi, uint64_t *alo, const uint64_t *kh,
 #else /* not UVMAC_ARCH_64 and not SSE2 */
 /* ----------------------------------------------------------------------- */
 
-#ifndef nh_16
-#define nh_16(mp, kp, nw, rh, rl)                                       \
-{   uint64_t t1,t2,m1,m2,t;                                             \
-    int i;                                                              \
-    rh = rl = t = 0;                                                    \
-    for (i = 0; i < nw; i+=2)  {                                        \
-        t1  = get64PE(mp+i) + kp[i];                                    \
-        t2  = get64PE(mp+i+1) + kp[i+1];                                \
-        m2  = MUL32(t1 >> 32, t2);                                      \
-        m1  = MUL32(t1, t2 >> 32);                                      \
-        ADD128(rh,rl,MUL32(t1 >> 32,t2 >> 32),MUL32(t1,t2));            \
-        rh += (uint64_t)(uint32_t)(m1 >> 32) + (uint32_t)(m2 >> 32);    \
-        t  += (uint64_t)(uint32_t)m1 + (uint32_t)m2;                    \
-    }                                                                   \
-    ADD128(rh,rl,(t >> 32),(t << 32));                                  \
-}
-#endif
-
-static void poly_step_func(uint64_t *ahi, uint64_t *alo, const uint64_t *kh,
-               const uint64_t *kl, const uint64_t *mh, const uint64_t *ml)
-{
-
-#if UVMAC_ARCH_BIG_ENDIAN
-#define INDEX_HIGH 0
-#define INDEX_LOW 1
-#else
-#define INDEX_HIGH 1
-#define INDEX_LOW 0
-#endif
-
-#define a0 *(((uint32_t*)alo)+INDEX_LOW)
-#define a1 *(((uint32_t*)alo)+INDEX_HIGH)
-#define a2 *(((uint32_t*)ahi)+INDEX_LOW)
-#define a3 *(((uint32_t*)ahi)+INDEX_HIGH)
-#define k0 *(((uint32_t*)kl)+INDEX_LOW)
-#define k1 *(((uint32_t*)kl)+INDEX_HIGH)
-#define k2 *(((uint32_t*)kh)+INDEX_LOW)
-#define k3 *(((uint32_t*)kh)+INDEX_HIGH)
-
-    uint64_t p, q, t;
-    uint32_t t2;
+#define NATIVE_KERNEL_NAME "32bit"
 
-    p = MUL32(a3, k3);
-    p += p;
-    p += *(uint64_t *)mh;
-    p += MUL32(a0, k2);
-    p += MUL32(a1, k1);
-    p += MUL32(a2, k0);
-    t = (uint32_t)(p);
-    p >>= 32;
-    p += MUL32(a0, k3);
-    p += MUL32(a1, k2);
-    p += MUL32(a2, k1);
-    p += MUL32(a3, k0);
-    t |= ((uint64_t)((uint32_t)p & 0x7fffffff)) << 32;
-    p >>= 31;
-    p += (uint64_t)(((uint32_t*)ml)[INDEX_LOW]);
-    p += MUL32(a0, k0);
-    q =  MUL32(a1, k3);
-    q += MUL32(a2, k2);
-    q += MUL32(a3, k1);
-    q += q;
-    p += q;
-    t2 = (uint32_t)(p);
-    p >>= 32;
-    p += (uint64_t)(((uint32_t*)ml)[INDEX_HIGH]);
-    p += MUL32(a0, k1);
-    p += MUL32(a1, k0);
-    q =  MUL32(a2, k3);
-    q += MUL32(a3, k2);
-    q += q;
-    p += q;
-    *(uint64_t *)(alo) = (p << 32) | t2;
-    p >>= 32;
-    *(uint64_t *)(ahi) = p + t;
+#define nh_16 nh_16_c32
 
-#undef a0
-#undef a1
-#undef a2
-#undef a3
-#undef k0
-#undef k1
-#undef k2
-#undef k3
-}
 
 #define poly_step(ah, al, kh, kl, mh, ml)   \
-        poly_step_func(&(ah), &(al), &(kh), &(kl), &(mh), &(ml))
+        poly_step_c32(&(ah), &(al), &(kh), &(kl), &(mh), &(ml))
 
 /* ----------------------------------------------------------------------- */
 #endif  /* end of specialized NH and poly definitions */
@@ -724,18 +796,154 @@ static void poly_step_func(uint64_t *ahi, uint64_t *alo, const uint64_t *kh,
     nh_vhash_nhbytes(mp, kp, nw, rh, rl);                                \
     nh_vhash_nhbytes(mp, ((kp)+2), nw, rh2, rl2);
 #endif
+#ifndef nh_16_4
+#define nh_16_4(mp, kp, nw, rh, rl)                                      \
+    nh_16_2(mp, kp, nw, rh[0], rl[0], rh[1], rl[1]);                     \
+    nh_16_2(mp, ((kp)+4), nw, rh[2], rl[2], rh[3], rl[3]);
+#endif
+#ifndef nh_vhash_nhbytes_4
+#define nh_vhash_nhbytes_4(mp, kp, nw, rh, rl)                           \
+    nh_vhash_nhbytes_2(mp, kp, nw, rh[0], rl[0], rh[1], rl[1]);          \
+    nh_vhash_nhbytes_2(mp, ((kp)+4), nw, rh[2], rl[2], rh[3], rl[3]);
+#endif
+
+/* Poly steps (with the given poly_step macro) of the four lanes of a
+   256-bit tag, accumulators in c[8] and keys in pk[8], from the NH outputs
+   rh[4] and rl[4]; the first block is added instead. The lanes are written
+   out so that the arrays can live in registers                          */
+#define poly_step_lane(c, pk, rh, rl, l, first, STEP)                    \
+{   rh[l] &= m62;                                                       \
+    if (first) {                                                        \
+        ADD128(c[2*l],c[2*l+1],rh[l],rl[l]);                            \
+    } else {                                                            \
+        STEP(c[2*l],c[2*l+1],pk[2*l],pk[2*l+1],rh[l],rl[l]);            \
+    }                                                                   \
+}
+#define poly_step_4(c, pk, rh, rl, first, STEP)                          \
+{   poly_step_lane(c, pk, rh, rl, 0, first, STEP);                      \
+    poly_step_lane(c, pk, rh, rl, 1, first, STEP);                      \
+    poly_step_lane(c, pk, rh, rl, 2, first, STEP);                      \
+    poly_step_lane(c, pk, rh, rl, 3, first, STEP);                      \
+}
 
+/* ----------------------------------------------------------------------- */
+/* Usage counters (UVMAC_STATS)                                            */
 /* ----------------------------------------------------------------------- */
 
-void vhash_abort(uvmax_ctx_t *ctx)
+#if UVMAC_STATS
+
+#ifndef UVMAC_STATS_MAX_THREADS     /* Threads beyond share one slot      */
+#define UVMAC_STATS_MAX_THREADS 256
+#endif
+
+#if __GNUC__
+#define THREAD_LOCAL        __thread
+#define ATOMIC_LOAD(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ATOMIC_STORE(p,v)   __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define ATOMIC_ADD(p,v)     __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#elif _MSC_VER
+#define THREAD_LOCAL        __declspec(thread)
+#define ATOMIC_LOAD(p)      (*(volatile const uint64_t *)(p))
+#define ATOMIC_STORE(p,v)   (*(volatile uint64_t *)(p) = (v))
+#define ATOMIC_ADD(p,v)     _InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(v))
+#endif
+
+/* One cache line aligned slot per thread, the last one shared by the
+   threads beyond UVMAC_STATS_MAX_THREADS */
+typedef union {
+    uvmac_stats_t c;
+    unsigned char line[(sizeof(uvmac_stats_t) + 63) & ~(size_t)63];
+} stats_slot_t;
+
+static ALIGN(64) stats_slot_t stats_slots[UVMAC_STATS_MAX_THREADS + 1];
+static uint64_t stats_threads = 0;
+static THREAD_LOCAL stats_slot_t *stats_mine = 0;
+
+static stats_slot_t *stats_slot(void)
 {
-    ctx->polytmp[0] = ctx->polykey[0] ;
-    ctx->polytmp[1] = ctx->polykey[1] ;
-#if (UVMAC_TAG_LEN == 128)
-    ctx->polytmp[2] = ctx->polykey[2] ;
-    ctx->polytmp[3] = ctx->polykey[3] ;
+    if ( ! stats_mine) {
+        uint64_t i = ATOMIC_ADD(&stats_threads, 1);
+        stats_mine = &stats_slots[(i < UVMAC_STATS_MAX_THREADS) ?
+                                  i : UVMAC_STATS_MAX_THREADS];
+    }
+    return stats_mine;
+}
+
+/* Owned slots have a single writer and need no atomic read-modify-write */
+#define STATS_ADD(s, field, v)                                            \
+    {   if ((s) == &stats_slots[UVMAC_STATS_MAX_THREADS])                 \
+            ATOMIC_ADD(&(s)->c.field, (uint64_t)(v));                     \
+        else                                                              \
+            ATOMIC_STORE(&(s)->c.field,                                   \
+                         ATOMIC_LOAD(&(s)->c.field) + (uint64_t)(v));     \
+    }
+
+static void stats_hashed(unsigned int mbytes)
+{
+    stats_slot_t *s = stats_slot();
+    STATS_ADD(s, bytes, mbytes);
+    STATS_ADD(s, blocks, mbytes / UVMAC_NHBYTES);
+}
+
+static void stats_finished(uint64_t message_bytes)
+{
+    stats_slot_t *s = stats_slot();
+    unsigned int b = 0;
+#if __GNUC__
+    if (message_bytes)
+        b = 64 - __builtin_clzll(message_bytes);
+#else
+    while (message_bytes >> b)
+        b++;
+#endif
+    if (b >= UVMAC_STATS_BUCKETS)
+        b = UVMAC_STATS_BUCKETS - 1;
+    STATS_ADD(s, hashes, 1);
+    STATS_ADD(s, size_histogram[b], 1);
+}
+
+static void stats_count(int tags, int pad_slices)
+{
+    stats_slot_t *s = stats_slot();
+    STATS_ADD(s, tags, tags);
+    STATS_ADD(s, pad_slices, pad_slices);
+}
+
 #endif
+
+int uvmac_stats_snapshot(uvmac_stats_t *stats)
+{
+#if UVMAC_STATS
+    unsigned int i, j;
+#endif
+    memset(stats, 0, sizeof(*stats));
+#if UVMAC_STATS
+    for (i = 0; i <= UVMAC_STATS_MAX_THREADS; i++) {
+        const uvmac_stats_t *c = &stats_slots[i].c;
+        stats->bytes      += ATOMIC_LOAD(&c->bytes);
+        stats->blocks     += ATOMIC_LOAD(&c->blocks);
+        stats->hashes     += ATOMIC_LOAD(&c->hashes);
+        stats->tags       += ATOMIC_LOAD(&c->tags);
+        stats->pad_slices += ATOMIC_LOAD(&c->pad_slices);
+        for (j = 0; j < UVMAC_STATS_BUCKETS; j++)
+            stats->size_histogram[j] += ATOMIC_LOAD(&c->size_histogram[j]);
+    }
+    stats->threads = ATOMIC_LOAD(&stats_threads);
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+void vhash_abort(uvmax_ctx_t *ctx)
+{
+    memcpy(ctx->polytmp, ctx->polykey, sizeof(ctx->polytmp));
     ctx->first_block_processed = 0;
+#if UVMAC_STATS
+    ctx->message_bytes = 0;
+#endif
 }
 
 /* ----------------------------------------------------------------------- */
@@ -781,13 +989,45 @@ static uint64_t l3hash(uint64_t p1, uint64_t p2,
 
 /* ----------------------------------------------------------------------- */
 
-void vhash_update(unsigned char *m,
-                  unsigned int   mbytes, /* Pos multiple of UVMAC_NHBYTES */
-                  uvmax_ctx_t    *ctx)
+/* --------------------------------------------------------------------- *
+ * Block kernels. A kernel hashes nblocks full UVMAC_NHBYTES blocks into
+ * polytmp (NH followed by one poly step per block, the first block being
+ * added to polytmp instead when first is set). All kernels compute the
+ * same value; they only differ in speed. vhash_update, vhash and the
+ * segments go through the kernel currently selected, the native one by
+ * default.
+ * --------------------------------------------------------------------- */
+
+#if (UVMAC_TAG_LEN == 256)
+/* With 256-bit tags the four lanes are kept in arrays, only indexed by
+   constants so that the compiler can keep them in registers            */
+static ALWAYS_INLINE void blocks_native_order(const uint64_t *mptr,
+                          unsigned int nblocks, const uvmax_ctx_t *ctx,
+                          uint64_t polytmp[], int first, const int msg_be)
+{
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    uint64_t rh[4], rl[4], c[8], pk[8];
+
+    memcpy(c, polytmp, sizeof(c));
+    memcpy(pk, ctx->polykey, sizeof(pk));
+    for ( ; nblocks; nblocks--, first = 0) {
+        nh_vhash_nhbytes_4(mptr,kptr,UVMAC_NHBYTES/8,rh,rl);
+        poly_step_4(c,pk,rh,rl,first,poly_step);
+        mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
+    }
+    memcpy(polytmp, c, sizeof(c));
+#if UVMAC_USE_SSE2
+    _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
+#endif
+}
+#else
+static ALWAYS_INLINE void blocks_native_order(const uint64_t *mptr,
+                          unsigned int nblocks, const uvmax_ctx_t *ctx,
+                          uint64_t polytmp[], int first, const int msg_be)
 {
-    uint64_t rh, rl, *mptr;
+    uint64_t rh, rl;
     const uint64_t *kptr = (uint64_t *)ctx->nhkey;
-    int i;
+    unsigned int i = nblocks;
     uint64_t ch, cl;
     uint64_t pkh = ctx->polykey[0];
     uint64_t pkl = ctx->polykey[1];
@@ -797,18 +1037,14 @@ void vhash_update(unsigned char *m,
     uint64_t pkl2 = ctx->polykey[3];
 #endif
 
-    mptr = (uint64_t *)m;
-    i = mbytes / UVMAC_NHBYTES;  /* Must be non-zero */
-
-    ch = ctx->polytmp[0];
-    cl = ctx->polytmp[1];
+    ch = polytmp[0];
+    cl = polytmp[1];
 #if (UVMAC_TAG_LEN == 128)
-    ch2 = ctx->polytmp[2];
-    cl2 = ctx->polytmp[3];
+    ch2 = polytmp[2];
+    cl2 = polytmp[3];
 #endif
 
-    if ( ! ctx->first_block_processed) {
-        ctx->first_block_processed = 1;
+    if (first) {
 #if (UVMAC_TAG_LEN == 64)
         nh_vhash_nhbytes(mptr,kptr,UVMAC_NHBYTES/8,rh,rl);
 #else
@@ -835,176 +1071,1072 @@ void vhash_update(unsigned char *m,
         mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
     }
 
-    ctx->polytmp[0] = ch;
-    ctx->polytmp[1] = cl;
+    polytmp[0] = ch;
+    polytmp[1] = cl;
 #if (UVMAC_TAG_LEN == 128)
-    ctx->polytmp[2] = ch2;
-    ctx->polytmp[3] = cl2;
+    polytmp[2] = ch2;
+    polytmp[3] = cl2;
 #endif
 #if UVMAC_USE_SSE2
     _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
 #endif
 }
+#endif
 
-/* ----------------------------------------------------------------------- */
+/* One loop per byte order, so that no word waits on a test of it */
+static void blocks_native(const uint64_t *mptr, unsigned int nblocks,
+                          const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                          int first)
+{
+    if (ctx->big_endian)
+        blocks_native_order(mptr, nblocks, ctx, polytmp, first, 1);
+    else
+        blocks_native_order(mptr, nblocks, ctx, polytmp, first, 0);
+}
+
+/* --------------------------------------------------------------------- *
+ * Software-pipelined native kernel, for inputs that are not in cache yet
+ * (freshly read or mapped files): the NH of block i+1 is computed before
+ * the poly step of block i, so that its loads are issued while the
+ * multiplications of the poly step run, and the lines prefetch_bytes
+ * ahead are prefetched as each block starts.
+ * The "streaming" kernel is the same loop for inputs that will not be
+ * read again: it prefetches them as non-temporal (PREFETCHNTA on x86), so
+ * that they pass through the caches without evicting the data of other
+ * programs. Evicting each block after its NH instead (CLFLUSH) made
+ * hashing ten times slower, and CLFLUSHOPT kept no more of the other data
+ * than the non-temporal prefetches. Data hashed twice is read from memory
+ * both times, so it is slower than the others on inputs that fit in cache
+ * and is only meant to be selected on purpose (uvmac --no-cache).
+ * --------------------------------------------------------------------- */
+
+static unsigned int prefetch_bytes = UVMAC_PREFETCH_BYTES & ~63u;
 
-uint64_t xvhash(unsigned char m[],
-                unsigned int mbytes,
-                uint64_t *tagl,
-                uvmax_ctx_t *ctx)
+void uvmac_prefetch_set(unsigned int bytes)
 {
-    uint64_t ch, cl, rh, rl, *mptr;
-#if (UVMAC_TAG_LEN == 128)
-    uint64_t ch2, cl2, rh2, rl2;
-#endif
-    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
-    int i, remaining;
+    prefetch_bytes = bytes & ~63u;
+}
 
-    remaining = mbytes % UVMAC_NHBYTES;
-    i = mbytes-remaining;
-    mptr = (uint64_t *)(m+i);
-    if (i) vhash_update(m,i,ctx);
+unsigned int uvmac_prefetch_get(void)
+{
+    return prefetch_bytes;
+}
 
-    ch = ctx->polytmp[0];
-    cl = ctx->polytmp[1];
+#define prefetch_block(p, ahead, nta)                              \
+    { const char *_p = (const char *)(p) + (ahead);                \
+      unsigned int _j;                                             \
+      for (_j = 0; _j < UVMAC_NHBYTES; _j += 64)                   \
+          if (nta) { PREFETCH_NTA(_p + _j); } else { PREFETCH(_p + _j); } }
+
+#if (UVMAC_TAG_LEN == 256)
+static ALWAYS_INLINE void blocks_pipelined_order(const uint64_t *mptr,
+                          unsigned int nblocks, const uvmax_ctx_t *ctx,
+                          uint64_t polytmp[], int first, const int msg_be,
+                          const int nta)
+{
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    const unsigned int ahead = prefetch_bytes;
+    unsigned int i, j;
+    uint64_t rh[4], rl[4], sh[4] = {0}, sl[4] = {0}, c[8], pk[8];
+
+    if ( ! nblocks)
+        return;
+    memcpy(c, polytmp, sizeof(c));
+    memcpy(pk, ctx->polykey, sizeof(pk));
+    if (ahead)
+        for (j = 0; j < ahead && j < nblocks * UVMAC_NHBYTES; j += UVMAC_NHBYTES)
+            prefetch_block(mptr, j, nta);
+
+    nh_vhash_nhbytes_4(mptr,kptr,UVMAC_NHBYTES/8,rh,rl);
+    for (i = 1; i <= nblocks; i++) {
+        if (i < nblocks) {
+            mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
+            if (ahead)
+                prefetch_block(mptr, ahead, nta);
+            nh_vhash_nhbytes_4(mptr,kptr,UVMAC_NHBYTES/8,sh,sl);
+        }
+        poly_step_4(c,pk,rh,rl,first,poly_step);
+        memcpy(rh, sh, sizeof(rh));
+        memcpy(rl, sl, sizeof(rl));
+        first = 0;
+    }
+    memcpy(polytmp, c, sizeof(c));
+#if UVMAC_USE_SSE2
+    _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
+#endif
+}
+#else
+static ALWAYS_INLINE void blocks_pipelined_order(const uint64_t *mptr,
+                          unsigned int nblocks, const uvmax_ctx_t *ctx,
+                          uint64_t polytmp[], int first, const int msg_be,
+                          const int nta)
+{
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    const unsigned int ahead = prefetch_bytes;
+    unsigned int i, j;
+    uint64_t rh, rl, sh = 0, sl = 0;
+    uint64_t ch = polytmp[0], cl = polytmp[1];
+    uint64_t pkh = ctx->polykey[0], pkl = ctx->polykey[1];
 #if (UVMAC_TAG_LEN == 128)
-    ch2 = ctx->polytmp[2];
-    cl2 = ctx->polytmp[3];
+    uint64_t rh2, rl2, sh2 = 0, sl2 = 0;
+    uint64_t ch2 = polytmp[2], cl2 = polytmp[3];
+    uint64_t pkh2 = ctx->polykey[2], pkl2 = ctx->polykey[3];
 #endif
 
-    if (remaining) {
-#if (UVMAC_TAG_LEN == 128)
-        nh_16_2(mptr,kptr,2*((remaining+15)/16),rh,rl,rh2,rl2);
-        rh2 &= m62;
+    if ( ! nblocks)
+        return;
+    /* The lines up to the prefetch distance, which the loop does not ask */
+    if (ahead)
+        for (j = 0; j < ahead && j < nblocks * UVMAC_NHBYTES; j += UVMAC_NHBYTES)
+            prefetch_block(mptr, j, nta);
+
+#if (UVMAC_TAG_LEN == 64)
+    nh_vhash_nhbytes(mptr,kptr,UVMAC_NHBYTES/8,rh,rl);
 #else
-        nh_16(mptr,kptr,2*((remaining+15)/16),rh,rl);
+    nh_vhash_nhbytes_2(mptr,kptr,UVMAC_NHBYTES/8,rh,rl,rh2,rl2);
 #endif
+    for (i = 1; i <= nblocks; i++) {
+        /* NH of block i, none after the last one */
+        if (i < nblocks) {
+            mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
+            if (ahead)
+                prefetch_block(mptr, ahead, nta);
+#if (UVMAC_TAG_LEN == 64)
+            nh_vhash_nhbytes(mptr,kptr,UVMAC_NHBYTES/8,sh,sl);
+#else
+            nh_vhash_nhbytes_2(mptr,kptr,UVMAC_NHBYTES/8,sh,sl,sh2,sl2);
+#endif
+        }
+        /* Poly step of block i-1 */
         rh &= m62;
-        if (i) {
-            poly_step(ch,cl,ctx->polykey[0],ctx->polykey[1],rh,rl);
+        if (first) {
+            ADD128(ch,cl,rh,rl);
+        } else {
+            poly_step(ch,cl,pkh,pkl,rh,rl);
+        }
+        rh = sh;
+        rl = sl;
 #if (UVMAC_TAG_LEN == 128)
-            poly_step(ch2,cl2,ctx->polykey[2],ctx->polykey[3],rh2,rl2);
-#endif
+        rh2 &= m62;
+        if (first) {
+            ADD128(ch2,cl2,rh2,rl2);
         } else {
+            poly_step(ch2,cl2,pkh2,pkl2,rh2,rl2);
+        }
+        rh2 = sh2;
+        rl2 = sl2;
+#endif
+        first = 0;
+    }
+
+    polytmp[0] = ch;
+    polytmp[1] = cl;
+#if (UVMAC_TAG_LEN == 128)
+    polytmp[2] = ch2;
+    polytmp[3] = cl2;
+#endif
+#if UVMAC_USE_SSE2
+    _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
+#endif
+}
+#endif
+
+static void blocks_pipelined(const uint64_t *mptr, unsigned int nblocks,
+                             const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                             int first)
+{
+    if (ctx->big_endian)
+        blocks_pipelined_order(mptr, nblocks, ctx, polytmp, first, 1, 0);
+    else
+        blocks_pipelined_order(mptr, nblocks, ctx, polytmp, first, 0, 0);
+}
+
+static void blocks_streaming(const uint64_t *mptr, unsigned int nblocks,
+                             const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                             int first)
+{
+    if (ctx->big_endian)
+        blocks_pipelined_order(mptr, nblocks, ctx, polytmp, first, 1, 1);
+    else
+        blocks_pipelined_order(mptr, nblocks, ctx, polytmp, first, 0, 1);
+}
+
+#if (UVMAC_SSE2_KERNEL || UVMAC_VECTOR_KERNEL)
+/* --------------------------------------------------------------------- *
+ * Shared by the SIMD kernels below: they only differ in their NH, and use
+ * the native poly step on 64-bit builds and the portable 32-bit one
+ * otherwise, so that no MMX register, and no EMMS, is needed.
+ * --------------------------------------------------------------------- */
+
+typedef void (*nh_func_t)(const uint64_t *mp, const uint64_t *kp,
+                          unsigned int nw, uint64_t *rh, uint64_t *rl);
+
+#if UVMAC_ARCH_64
+#define poly_step_simd poly_step
+#else
+#define poly_step_simd(ah, al, kh, kl, mh, ml)   \
+        poly_step_c32(&(ah), &(al), &(kh), &(kl), &(mh), &(ml))
+#endif
+
+/* Blocks loop of the SIMD kernels, nh being a constant once inlined */
+#if (UVMAC_TAG_LEN == 256)
+/* (nh computing the four lanes of a 256-bit tag at once)               */
+static ALWAYS_INLINE void blocks_simd(const uint64_t *mptr,
+                        unsigned int nblocks, const uvmax_ctx_t *ctx,
+                        uint64_t polytmp[], int first, nh_func_t nh)
+{
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    uint64_t rh[4], rl[4], c[8], pk[8];
+
+    memcpy(c, polytmp, sizeof(c));
+    memcpy(pk, ctx->polykey, sizeof(pk));
+    for ( ; nblocks; nblocks--, first = 0) {
+        nh(mptr, kptr, UVMAC_NHBYTES/8, rh, rl);
+        poly_step_4(c,pk,rh,rl,first,poly_step_simd);
+        mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
+    }
+    memcpy(polytmp, c, sizeof(c));
+}
+#else
+static ALWAYS_INLINE void blocks_simd(const uint64_t *mptr,
+                        unsigned int nblocks, const uvmax_ctx_t *ctx,
+                        uint64_t polytmp[], int first, nh_func_t nh)
+{
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    uint64_t rh, rl;
+    uint64_t ch = polytmp[0], cl = polytmp[1];
+    uint64_t pkh = ctx->polykey[0], pkl = ctx->polykey[1];
+#if (UVMAC_TAG_LEN == 128)
+    uint64_t rh2, rl2;
+    uint64_t ch2 = polytmp[2], cl2 = polytmp[3];
+    uint64_t pkh2 = ctx->polykey[2], pkl2 = ctx->polykey[3];
+#endif
+
+    for ( ; nblocks; nblocks--, first = 0) {
+        nh(mptr, kptr, UVMAC_NHBYTES/8, &rh, &rl);
+        rh &= m62;
+        if (first) {
             ADD128(ch,cl,rh,rl);
+        } else {
+            poly_step_simd(ch,cl,pkh,pkl,rh,rl);
+        }
 #if (UVMAC_TAG_LEN == 128)
+        nh(mptr, kptr+2, UVMAC_NHBYTES/8, &rh2, &rl2);
+        rh2 &= m62;
+        if (first) {
             ADD128(ch2,cl2,rh2,rl2);
-#endif
+        } else {
+            poly_step_simd(ch2,cl2,pkh2,pkl2,rh2,rl2);
         }
+#endif
+        mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
     }
 
+    polytmp[0] = ch;
+    polytmp[1] = cl;
+#if (UVMAC_TAG_LEN == 128)
+    polytmp[2] = ch2;
+    polytmp[3] = cl2;
+#endif
+}
+#endif
+#endif
+
+#if UVMAC_SSE2_KERNEL
+/* --------------------------------------------------------------------- *
+ * SSE2 intrinsics kernel, for 32-bit x86 builds foremost (where it is the
+ * default, before the MMX assembly of the native kernel) and on x86-64
+ * for comparison. NH takes two pairs of words at a time, one pair per
+ * 64-bit lane of the XMM registers: the four 32x32->64-bit products of
+ * each pair (pmuludq) are split into 32-bit halves and summed by column
+ * of 32 bits in four accumulators, whose carries are propagated once per
+ * block; with at most UVMAC_NHBYTES/32 pairs per lane the sums cannot
+ * overflow.
+ * Big-endian words are byte-swapped a vector at a time as they are
+ * loaded: with shifts and word shuffles in SSE2, with one pshufb in the
+ * SSSE3 kernel and one vpshufb for four words in the AVX2 kernel, which
+ * also takes four pairs at a time. These two are compiled for their
+ * instruction set whatever the compiler flags, and only selectable on a
+ * cpu that has it.
+ * --------------------------------------------------------------------- */
+
+/* Adds the four 32x32->64-bit products of each pair of words (x, y) to
+   the column sums s0..s3 of its lane                                    */
+#define NH_SSE2_MUL(x, y, s0, s1, s2, s3)                                \
+{   __m128i xh = _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));         \
+    __m128i yh = _mm_shuffle_epi32(y, _MM_SHUFFLE(2, 3, 0, 1));         \
+    __m128i ll = _mm_mul_epu32(x, y);                                   \
+    __m128i lh = _mm_mul_epu32(x, yh);                                  \
+    __m128i hl = _mm_mul_epu32(xh, y);                                  \
+    __m128i hh = _mm_mul_epu32(xh, yh);                                 \
+    s0 = _mm_add_epi64(s0, _mm_and_si128(ll, lo32));                    \
+    s1 = _mm_add_epi64(s1, _mm_srli_epi64(ll, 32));                     \
+    s1 = _mm_add_epi64(s1, _mm_and_si128(lh, lo32));                    \
+    s1 = _mm_add_epi64(s1, _mm_and_si128(hl, lo32));                    \
+    s2 = _mm_add_epi64(s2, _mm_srli_epi64(lh, 32));                     \
+    s2 = _mm_add_epi64(s2, _mm_srli_epi64(hl, 32));                     \
+    s2 = _mm_add_epi64(s2, _mm_and_si128(hh, lo32));                    \
+    s3 = _mm_add_epi64(s3, _mm_srli_epi64(hh, 32));                     \
+}
+
+#define NH_SSE2_STEP(v0, v1)                                             \
+{   __m128i x = _mm_unpacklo_epi64(v0, v1);                             \
+    __m128i y = _mm_unpackhi_epi64(v0, v1);                             \
+    NH_SSE2_MUL(x, y, s0, s1, s2, s3);                                  \
+}
+
+/* Two message words, as they are or byte-swapped                        */
+#define SSE2_LOAD_LE(p)  _mm_loadu_si128((const __m128i *)(p))
+#define SSE2_LOAD_BE(p)  sse2_bswap64(_mm_loadu_si128((const __m128i *)(p)))
+
+static ALWAYS_INLINE __m128i sse2_bswap64(__m128i x)
+{
+    x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+    x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+    return _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+/* NH steps from word i to the (even) word count nw, message words read
+   by LOAD                                                               */
+#define NH_SSE2_LOOP(mp, kp, i, nw, LOAD)                                \
+{   for ( ; i + 4 <= nw; i += 4) {                                      \
+        __m128i v0 = _mm_add_epi64(LOAD((mp)+i),                        \
+                        _mm_loadu_si128((const __m128i *)((kp)+i)));    \
+        __m128i v1 = _mm_add_epi64(LOAD((mp)+i+2),                      \
+                        _mm_loadu_si128((const __m128i *)((kp)+i+2)));  \
+        NH_SSE2_STEP(v0, v1);                                           \
+    }                                                                   \
+    if (i < nw) {                       /* one pair left, the other is 0 */\
+        __m128i v0 = _mm_add_epi64(LOAD((mp)+i),                        \
+                        _mm_loadu_si128((const __m128i *)((kp)+i)));    \
+        __m128i v1 = _mm_setzero_si128();                               \
+        NH_SSE2_STEP(v0, v1);                                           \
+    }                                                                   \
+}
+
+/* Propagates the carries of the column sums c0..c3 of a lane into its
+   128-bit NH output                                                     */
+static ALWAYS_INLINE void nh_carry(uint64_t c0, uint64_t c1, uint64_t c2,
+                                   uint64_t c3, uint64_t *rh, uint64_t *rl)
+{
+    uint64_t t = c0;
+
+    *rl = (uint32_t)t;
+    t = (t >> 32) + c1;
+    *rl |= t << 32;
+    t = (t >> 32) + c2;
+    *rh = (uint32_t)t;
+    t = (t >> 32) + c3;
+    *rh |= t << 32;
+}
+
+/* Stores the column sums of the two 64-bit lanes of s0..s3 in c         */
+#define SSE2_STORE_SUMS(c, s0, s1, s2, s3)                               \
+{   _mm_storeu_si128((__m128i *)c[0], s0);                              \
+    _mm_storeu_si128((__m128i *)c[1], s1);                              \
+    _mm_storeu_si128((__m128i *)c[2], s2);                              \
+    _mm_storeu_si128((__m128i *)c[3], s3);                              \
+}
+
+/* NH output of two pairs at a time, whose column sums are added first   */
+static ALWAYS_INLINE void nh_sse2_sum(__m128i s0, __m128i s1, __m128i s2,
+                                      __m128i s3, uint64_t *rh, uint64_t *rl)
+{
+    uint64_t c[4][2];
+
+    SSE2_STORE_SUMS(c, s0, s1, s2, s3);
+    nh_carry(c[0][0] + c[0][1], c[1][0] + c[1][1], c[2][0] + c[2][1],
+             c[3][0] + c[3][1], rh, rl);
+}
+
+/* NH of nw words (an even number), as nh_16 */
+#define NH_SSE2(mp, kp, nw, rh, rl, LOAD)                                \
+{   const __m128i lo32 = _mm_set_epi32(0, -1, 0, -1);                   \
+    __m128i s0 = _mm_setzero_si128(), s1 = s0, s2 = s0, s3 = s0;        \
+    unsigned int i = 0;                                                 \
+    NH_SSE2_LOOP(mp, kp, i, nw, LOAD);                                  \
+    nh_sse2_sum(s0, s1, s2, s3, rh, rl);                                \
+}
+
+#if (UVMAC_TAG_LEN == 256)
+/* NH of the four lanes of a 256-bit tag, lane j using the key from word
+   2*j on: each pair of message words is loaded once and broadcast, lanes
+   0 and 1 summing in a0..a3 and lanes 2 and 3 in b0..b3                 */
+#define SSE2_KEYS(p)  _mm_loadu_si128((const __m128i *)(p))
+
+#define NH_SSE2_X4(mp, kp, nw, rh, rl, LOAD)                             \
+{   const __m128i lo32 = _mm_set_epi32(0, -1, 0, -1);                   \
+    __m128i a0 = _mm_setzero_si128(), a1 = a0, a2 = a0, a3 = a0;        \
+    __m128i b0 = a0, b1 = a0, b2 = a0, b3 = a0;                         \
+    uint64_t c[4][2];                                                   \
+    unsigned int i;                                                     \
+    for (i = 0; i < nw; i += 2) {                                       \
+        __m128i v = LOAD((mp)+i);                                       \
+        __m128i m0 = _mm_unpacklo_epi64(v, v);                          \
+        __m128i m1 = _mm_unpackhi_epi64(v, v);                          \
+        __m128i ka = SSE2_KEYS((kp)+i), kb = SSE2_KEYS((kp)+i+2);       \
+        __m128i kc = SSE2_KEYS((kp)+i+4), kd = SSE2_KEYS((kp)+i+6);     \
+        __m128i x = _mm_add_epi64(m0, _mm_unpacklo_epi64(ka, kb));      \
+        __m128i y = _mm_add_epi64(m1, _mm_unpackhi_epi64(ka, kb));      \
+        NH_SSE2_MUL(x, y, a0, a1, a2, a3);                              \
+        x = _mm_add_epi64(m0, _mm_unpacklo_epi64(kc, kd));              \
+        y = _mm_add_epi64(m1, _mm_unpackhi_epi64(kc, kd));              \
+        NH_SSE2_MUL(x, y, b0, b1, b2, b3);                              \
+    }                                                                   \
+    SSE2_STORE_SUMS(c, a0, a1, a2, a3);                                 \
+    nh_carry(c[0][0], c[1][0], c[2][0], c[3][0], &(rh)[0], &(rl)[0]);   \
+    nh_carry(c[0][1], c[1][1], c[2][1], c[3][1], &(rh)[1], &(rl)[1]);   \
+    SSE2_STORE_SUMS(c, b0, b1, b2, b3);                                 \
+    nh_carry(c[0][0], c[1][0], c[2][0], c[3][0], &(rh)[2], &(rl)[2]);   \
+    nh_carry(c[0][1], c[1][1], c[2][1], c[3][1], &(rh)[3], &(rl)[3]);   \
+}
+
+static void nh_sse2(const uint64_t *mp, const uint64_t *kp, unsigned int nw,
+                    uint64_t *rh, uint64_t *rl)
+{
+    NH_SSE2_X4(mp, kp, nw, rh, rl, SSE2_LOAD_LE);
+}
+
+static void nh_sse2_be(const uint64_t *mp, const uint64_t *kp,
+                       unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    NH_SSE2_X4(mp, kp, nw, rh, rl, SSE2_LOAD_BE);
+}
+#else
+static void nh_sse2(const uint64_t *mp, const uint64_t *kp, unsigned int nw,
+                    uint64_t *rh, uint64_t *rl)
+{
+    NH_SSE2(mp, kp, nw, rh, rl, SSE2_LOAD_LE);
+}
+
+static void nh_sse2_be(const uint64_t *mp, const uint64_t *kp,
+                       unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    NH_SSE2(mp, kp, nw, rh, rl, SSE2_LOAD_BE);
+}
+#endif
+
+static void blocks_sse2(const uint64_t *mptr, unsigned int nblocks,
+                        const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                        int first)
+{
+    if (ctx->big_endian)
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_sse2_be);
+    else
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_sse2);
+}
+
+#if UVMAC_X86_TARGET_KERNELS
+
+#define TARGET(isa)   __attribute__ ((target(isa)))
+
+/* Reverses the bytes of each 64-bit word of a 128-bit lane */
+#define BSWAP64_SHUFFLE \
+        _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7)
+
+#define SSSE3_LOAD_BE(p) \
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap)
+
+static TARGET("ssse3") void nh_ssse3_be(const uint64_t *mp,
+                const uint64_t *kp, unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    const __m128i swap = BSWAP64_SHUFFLE;
+#if (UVMAC_TAG_LEN == 256)
+    NH_SSE2_X4(mp, kp, nw, rh, rl, SSSE3_LOAD_BE);
+#else
+    NH_SSE2(mp, kp, nw, rh, rl, SSSE3_LOAD_BE);
+#endif
+}
+
+/* Same as the SSE2 kernel for little-endian words */
+static TARGET("ssse3") void blocks_ssse3(const uint64_t *mptr,
+                unsigned int nblocks, const uvmax_ctx_t *ctx,
+                uint64_t polytmp[], int first)
+{
+    if (ctx->big_endian)
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_ssse3_be);
+    else
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_sse2);
+}
+
+/* NH_SSE2_MUL on four pairs, one per 64-bit lane of the YMM registers */
+#define NH_AVX2_MUL(x, y, t0, t1, t2, t3)                                \
+{   __m256i xh = _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1));      \
+    __m256i yh = _mm256_shuffle_epi32(y, _MM_SHUFFLE(2, 3, 0, 1));      \
+    __m256i ll = _mm256_mul_epu32(x, y);                                \
+    __m256i lh = _mm256_mul_epu32(x, yh);                               \
+    __m256i hl = _mm256_mul_epu32(xh, y);                               \
+    __m256i hh = _mm256_mul_epu32(xh, yh);                              \
+    t0 = _mm256_add_epi64(t0, _mm256_and_si256(ll, lo32x4));            \
+    t1 = _mm256_add_epi64(t1, _mm256_srli_epi64(ll, 32));               \
+    t1 = _mm256_add_epi64(t1, _mm256_and_si256(lh, lo32x4));            \
+    t1 = _mm256_add_epi64(t1, _mm256_and_si256(hl, lo32x4));            \
+    t2 = _mm256_add_epi64(t2, _mm256_srli_epi64(lh, 32));               \
+    t2 = _mm256_add_epi64(t2, _mm256_srli_epi64(hl, 32));               \
+    t2 = _mm256_add_epi64(t2, _mm256_and_si256(hh, lo32x4));            \
+    t3 = _mm256_add_epi64(t3, _mm256_srli_epi64(hh, 32));               \
+}
+
+/* NH_SSE2_STEP on four pairs (unpacklo and unpackhi work within each
+   128-bit half)                                                         */
+#define NH_AVX2_STEP(v0, v1)                                             \
+{   __m256i x = _mm256_unpacklo_epi64(v0, v1);                          \
+    __m256i y = _mm256_unpackhi_epi64(v0, v1);                          \
+    NH_AVX2_MUL(x, y, t0, t1, t2, t3);                                  \
+}
+
+#define AVX2_LOAD_LE(p)  _mm256_loadu_si256((const __m256i *)(p))
+#define AVX2_LOAD_BE(p) \
+        _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(p)), swap4)
+
+#define AVX2_FOLD(t) \
+        _mm_add_epi64(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1))
+
+/* NH as NH_SSE2, by eight words then by four and two for the rest */
+#define NH_AVX2(mp, kp, nw, rh, rl, LOAD4, LOAD2)                        \
+{   const __m128i lo32 = _mm_set_epi32(0, -1, 0, -1);                   \
+    const __m256i lo32x4 = _mm256_broadcastsi128_si256(lo32);           \
+    __m256i t0 = _mm256_setzero_si256(), t1 = t0, t2 = t0, t3 = t0;     \
+    __m128i s0, s1, s2, s3;                                             \
+    unsigned int i;                                                     \
+    for (i = 0; i + 8 <= nw; i += 8) {                                  \
+        __m256i v0 = _mm256_add_epi64(LOAD4((mp)+i),                    \
+                        _mm256_loadu_si256((const __m256i *)((kp)+i))); \
+        __m256i v1 = _mm256_add_epi64(LOAD4((mp)+i+4),                  \
+                        _mm256_loadu_si256((const __m256i *)((kp)+i+4)));\
+        NH_AVX2_STEP(v0, v1);                                           \
+    }                                                                   \
+    s0 = AVX2_FOLD(t0);                                                 \
+    s1 = AVX2_FOLD(t1);                                                 \
+    s2 = AVX2_FOLD(t2);                                                 \
+    s3 = AVX2_FOLD(t3);                                                 \
+    NH_SSE2_LOOP(mp, kp, i, nw, LOAD2);                                 \
+    nh_sse2_sum(s0, s1, s2, s3, rh, rl);                                \
+}
+
+#if (UVMAC_TAG_LEN == 256)
+/* NH of the four lanes of a 256-bit tag, one per 64-bit lane of the YMM
+   registers. Each pair of message words is loaded once into both halves
+   (vbroadcasti128) and added to the keys of two lanes at a time; the
+   unpacks, which work within each 128-bit half, then put the x and y
+   words of the lanes in the order 0, 2, 1, 3. The high halves come from
+   shifts rather than shuffles, which leaves port 5 to the unpacks, and
+   the products are summed lazily: the low and middle products whole,
+   modulo 2^64, next to the sums of their high halves, from which
+   nh_avx2_x4_sum recovers the exact column sums, and the high products
+   only modulo 2^64, all that the NH output modulo 2^128 needs of them.
+   That is 16 vector operations per pair for the four lanes, instead of
+   the 22 of NH_AVX2_MUL                                                 */
+#define NH_AVX2_MUL_X4(x, y, l, lh, m, mh, hh)                           \
+{   __m256i xh = _mm256_srli_epi64(x, 32);                              \
+    __m256i yh = _mm256_srli_epi64(y, 32);                              \
+    __m256i ll = _mm256_mul_epu32(x, y);                                \
+    __m256i lo = _mm256_mul_epu32(x, yh);                               \
+    __m256i hi = _mm256_mul_epu32(xh, y);                               \
+    hh = _mm256_add_epi64(hh, _mm256_mul_epu32(xh, yh));                \
+    l = _mm256_add_epi64(l, ll);                                        \
+    lh = _mm256_add_epi64(lh, _mm256_srli_epi64(ll, 32));               \
+    m = _mm256_add_epi64(m, _mm256_add_epi64(lo, hi));                  \
+    mh = _mm256_add_epi64(mh, _mm256_add_epi64(_mm256_srli_epi64(lo, 32),\
+                                               _mm256_srli_epi64(hi, 32)));\
+}
+
+/* The NH outputs of the four lanes from the sums of NH_AVX2_MUL_X4: l
+   and m are the sums of the low and middle products modulo 2^64, lh and
+   mh the exact sums of their high halves, hh the sum of the high
+   products. The carry out of the low word comes from a signed compare
+   of the words with their top bits flipped                              */
+static ALWAYS_INLINE TARGET("avx2") void nh_avx2_x4_sum(__m256i l, __m256i lh,
+                __m256i m, __m256i mh, __m256i hh, uint64_t *rh, uint64_t *rl)
+{
+    const __m256i top = _mm256_set1_epi64x((long long)(UINT64_C(1) << 63));
+    /* The low halves of the low products, and the column of weight 2^32 */
+    __m256i c0 = _mm256_sub_epi64(l, _mm256_slli_epi64(lh, 32));
+    __m256i c1 = _mm256_sub_epi64(_mm256_add_epi64(lh, m), _mm256_slli_epi64(mh, 32));
+    __m256i lo = _mm256_add_epi64(c0, _mm256_slli_epi64(c1, 32));
+    __m256i carry = _mm256_cmpgt_epi64(_mm256_xor_si256(c0, top),
+                                       _mm256_xor_si256(lo, top));
+    __m256i hi = _mm256_add_epi64(_mm256_add_epi64(_mm256_srli_epi64(c1, 32), mh),
+                                  _mm256_sub_epi64(hh, carry));
+
+    /* Lanes 0, 2, 1, 3 back in order */
+    lo = _mm256_permute4x64_epi64(lo, _MM_SHUFFLE(3, 1, 2, 0));
+    hi = _mm256_permute4x64_epi64(hi, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *)rl, lo);
+    _mm256_storeu_si256((__m256i *)rh, hi);
+}
+
+#define AVX2_BCAST_LE(p) \
+        _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p)))
+#define AVX2_BCAST_BE(p)  _mm256_shuffle_epi8(AVX2_BCAST_LE(p), swap4)
+
+#define NH_AVX2_X4(mp, kp, nw, rh, rl, BCAST)                            \
+{   __m256i l = _mm256_setzero_si256(), lh = l, m = l, mh = l, hh = l;  \
+    unsigned int i;                                                     \
+    for (i = 0; i < nw; i += 2) {                                       \
+        __m256i v = BCAST((mp)+i);                                      \
+        __m256i a = _mm256_add_epi64(v,                                 \
+                        _mm256_loadu_si256((const __m256i *)((kp)+i))); \
+        __m256i b = _mm256_add_epi64(v,                                 \
+                        _mm256_loadu_si256((const __m256i *)((kp)+i+4)));\
+        __m256i x = _mm256_unpacklo_epi64(a, b);                        \
+        __m256i y = _mm256_unpackhi_epi64(a, b);                        \
+        NH_AVX2_MUL_X4(x, y, l, lh, m, mh, hh);                         \
+    }                                                                   \
+    nh_avx2_x4_sum(l, lh, m, mh, hh, rh, rl);                           \
+}
+
+#if !UVMAC_ARCH_64
+static TARGET("avx2") void nh_avx2(const uint64_t *mp, const uint64_t *kp,
+                unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    NH_AVX2_X4(mp, kp, nw, rh, rl, AVX2_BCAST_LE);
+}
+#endif
+
+static TARGET("avx2") void nh_avx2_be(const uint64_t *mp,
+                const uint64_t *kp, unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    const __m256i swap4 = _mm256_broadcastsi128_si256(BSWAP64_SHUFFLE);
+    NH_AVX2_X4(mp, kp, nw, rh, rl, AVX2_BCAST_BE);
+}
+#else
+static TARGET("avx2") void nh_avx2(const uint64_t *mp, const uint64_t *kp,
+                unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    NH_AVX2(mp, kp, nw, rh, rl, AVX2_LOAD_LE, SSE2_LOAD_LE);
+}
+
+static TARGET("avx2") void nh_avx2_be(const uint64_t *mp,
+                const uint64_t *kp, unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    const __m128i swap = BSWAP64_SHUFFLE;
+    const __m256i swap4 = _mm256_broadcastsi128_si256(swap);
+    NH_AVX2(mp, kp, nw, rh, rl, AVX2_LOAD_BE, SSSE3_LOAD_BE);
+}
+#endif
+
+#if (UVMAC_TAG_LEN == 256) && UVMAC_ARCH_64
+/* With 256-bit tags the 64-bit multiplier of the native kernel still
+   hashes little-endian words faster than NH_AVX2_X4 (0.53 cycles per
+   byte against 0.59 on a Xeon with AVX-512), but not big-endian ones
+   (0.77 against 0.63), which it byte-swaps one at a time               */
+static TARGET("avx2") void blocks_avx2(const uint64_t *mptr,
+                unsigned int nblocks, const uvmax_ctx_t *ctx,
+                uint64_t polytmp[], int first)
+{
+    if (ctx->big_endian)
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_avx2_be);
+    else
+        blocks_native(mptr, nblocks, ctx, polytmp, first);
+}
+#else
+static TARGET("avx2") void blocks_avx2(const uint64_t *mptr,
+                unsigned int nblocks, const uvmax_ctx_t *ctx,
+                uint64_t polytmp[], int first)
+{
+    if (ctx->big_endian)
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_avx2_be);
+    else
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_avx2);
+}
+#endif
+
+static int supports_ssse3(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int supports_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+#endif
+
+#if UVMAC_VECTOR_KERNEL
+/* --------------------------------------------------------------------- *
+ * Portable vector kernel, written with the vector extensions of GNU C and
+ * Clang instead of intrinsics, for the targets without a 64-bit multiply
+ * (32-bit ARM, MIPS, PowerPC...): the compiler turns it into NEON, AltiVec
+ * or SSE code, or into scalar 32-bit code when there is no vector unit.
+ * Its NH is the one of the SSE2 kernel, on vectors of two 64-bit words:
+ * two pairs at a time, split into the first and the second words of the
+ * pairs, whose 32-bit halves are multiplied into 64-bit products summed
+ * by column of 32 bits. Big-endian words are byte-swapped with shifts and
+ * masks of the whole vector. The 32x32->64-bit products are written as
+ * 64-bit products of masked lanes, which Clang narrows to pmuludq or
+ * vmull.u32; GCC does not, and on SSE2 it is given pmuludq itself.
+ * --------------------------------------------------------------------- */
+
+typedef uint64_t vec_u64 __attribute__ ((vector_size(16)));
+
+#if __clang__
+#define VEC_EVEN(a, b)  __builtin_shufflevector(a, b, 0, 2)
+#define VEC_ODD(a, b)   __builtin_shufflevector(a, b, 1, 3)
+#else
+#define VEC_EVEN(a, b)  __builtin_shuffle(a, b, (vec_u64){0, 2})
+#define VEC_ODD(a, b)   __builtin_shuffle(a, b, (vec_u64){1, 3})
+#endif
+
+#if (__SSE2__ && ! __clang__)
+#define VEC_MUL32(a, b) ((vec_u64)_mm_mul_epu32((__m128i)(a), (__m128i)(b)))
+#else
+#define VEC_MUL32(a, b) (((a) & lo32) * ((b) & lo32))
+#endif
+
+#define VEC_BSWAP64(v)                                                   \
+{   v = (((v) & m8) << 8) | (((v) >> 8) & m8);                          \
+    v = (((v) & m16) << 16) | (((v) >> 16) & m16);                      \
+    v = ((v) << 32) | ((v) >> 32);                                      \
+}
+
+/* Two message words at i plus their key words, in v                     */
+#define VEC_WORDS(v, i)                                                  \
+{   vec_u64 _k;                                                         \
+    memcpy(&(v), mp + (i), sizeof(v));                                  \
+    memcpy(&_k, kp + (i), sizeof(_k));                                  \
+    if (msg_be)                                                         \
+        VEC_BSWAP64(v);                                                 \
+    v += _k;                                                            \
+}
+
+/* Two pairs of words, a holding the first pair and b the second one     */
+#define NH_VECTOR_STEP(a, b)                                             \
+{   vec_u64 x = VEC_EVEN(a, b), y = VEC_ODD(a, b);                      \
+    vec_u64 xh = x >> 32, yh = y >> 32;                                 \
+    vec_u64 ll = VEC_MUL32(x, y), lh = VEC_MUL32(x, yh);                \
+    vec_u64 hl = VEC_MUL32(xh, y), hh = VEC_MUL32(xh, yh);              \
+    s0 += ll & lo32;                                                    \
+    s1 += (ll >> 32) + (lh & lo32) + (hl & lo32);                       \
+    s2 += (lh >> 32) + (hl >> 32) + (hh & lo32);                        \
+    s3 += hh >> 32;                                                     \
+}
+
+static ALWAYS_INLINE void nh_vector_order(const uint64_t *mp,
+                        const uint64_t *kp, unsigned int nw,
+                        uint64_t *rh, uint64_t *rl, const int msg_be)
+{
+    const vec_u64 lo32 = {0xffffffffu, 0xffffffffu};
+    const vec_u64 m8 = {UINT64_C(0x00ff00ff00ff00ff), UINT64_C(0x00ff00ff00ff00ff)};
+    const vec_u64 m16 = {UINT64_C(0x0000ffff0000ffff), UINT64_C(0x0000ffff0000ffff)};
+    vec_u64 a, b, s0 = {0, 0}, s1 = s0, s2 = s0, s3 = s0;
+    uint64_t t;
+    unsigned int i;
+
+    for (i = 0; i + 4 <= nw; i += 4) {
+        VEC_WORDS(a, i);
+        VEC_WORDS(b, i + 2);
+        NH_VECTOR_STEP(a, b);
+    }
+    if (i < nw) {                       /* one pair left, the other is 0 */
+        VEC_WORDS(a, i);
+        b = s0 - s0;
+        NH_VECTOR_STEP(a, b);
+    }
+
+    t = s0[0] + s0[1];
+    *rl = (uint32_t)t;
+    t = (t >> 32) + s1[0] + s1[1];
+    *rl |= t << 32;
+    t = (t >> 32) + s2[0] + s2[1];
+    *rh = (uint32_t)t;
+    t = (t >> 32) + s3[0] + s3[1];
+    *rh |= t << 32;
+}
+
+#if (UVMAC_TAG_LEN == 256)
+/* The four lanes of a 256-bit tag one after the other, with their own
+   loads of the message (which is in L1 by the second lane)              */
+static ALWAYS_INLINE void nh_vector_x4(const uint64_t *mp,
+                        const uint64_t *kp, unsigned int nw,
+                        uint64_t *rh, uint64_t *rl, const int msg_be)
+{
+    int j;
+
+    for (j = 0; j < 4; j++)
+        nh_vector_order(mp, kp + 2*j, nw, rh + j, rl + j, msg_be);
+}
+
+static void nh_vector(const uint64_t *mp, const uint64_t *kp,
+                      unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    nh_vector_x4(mp, kp, nw, rh, rl, 0);
+}
+
+static void nh_vector_be(const uint64_t *mp, const uint64_t *kp,
+                         unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    nh_vector_x4(mp, kp, nw, rh, rl, 1);
+}
+#else
+static void nh_vector(const uint64_t *mp, const uint64_t *kp,
+                      unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    nh_vector_order(mp, kp, nw, rh, rl, 0);
+}
+
+static void nh_vector_be(const uint64_t *mp, const uint64_t *kp,
+                         unsigned int nw, uint64_t *rh, uint64_t *rl)
+{
+    nh_vector_order(mp, kp, nw, rh, rl, 1);
+}
+#endif
+
+static void blocks_vector(const uint64_t *mptr, unsigned int nblocks,
+                          const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                          int first)
+{
+    if (ctx->big_endian)
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_vector_be);
+    else
+        blocks_simd(mptr, nblocks, ctx, polytmp, first, nh_vector);
+}
+#endif
+
+static const uvmac_kernel_t kernels[] = {
+#if (UVMAC_USE_SSE2 && UVMAC_SSE2_KERNEL)
+    {"sse2", blocks_sse2, 0},
+    {NATIVE_KERNEL_NAME, blocks_native, 0},
+    {"pipelined", blocks_pipelined, 0},
+    {"streaming", blocks_streaming, 0},
+#else
+    {NATIVE_KERNEL_NAME, blocks_native, 0},
+    {"pipelined", blocks_pipelined, 0},
+    {"streaming", blocks_streaming, 0},
+#if UVMAC_SSE2_KERNEL
+    {"sse2", blocks_sse2, 0},
+#endif
+#endif
+#if UVMAC_VECTOR_KERNEL
+    {"vector", blocks_vector, 0},
+#endif
+#if UVMAC_X86_TARGET_KERNELS
+    {"ssse3", blocks_ssse3, supports_ssse3},
+    {"avx2", blocks_avx2, supports_avx2},
+#endif
+};
+
+static const uvmac_kernel_t *kernel = &kernels[0];
+
+unsigned int uvmac_kernel_count(void)
+{
+    return sizeof(kernels)/sizeof(kernels[0]);
+}
+
+const uvmac_kernel_t *uvmac_kernel_info(unsigned int i)
+{
+    return (i < uvmac_kernel_count()) ? &kernels[i] : 0;
+}
+
+int uvmac_kernel_select(unsigned int i)
+{
+    if (i >= uvmac_kernel_count() ||
+        (kernels[i].supported && ! kernels[i].supported()))
+        return 0;
+    kernel = &kernels[i];
+    return 1;
+}
+
+unsigned int uvmac_kernel_current(void)
+{
+    return (unsigned int)(kernel - kernels);
+}
+
+/* ----------------------------------------------------------------------- */
+
+const char *uvmac_profile_path(void)
+{
+    static char path[4096];
+    const char *env = getenv("UVMAC_PROFILE");
+    if (env && *env)
+        return env;
+    env = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.uvmac_profile", env ? env : ".");
+    return path;
+}
+
+int uvmac_profile_load(const char *path, uvmac_profile_t *profile)
+{
+    char line[256], name[64], value[64];
+    unsigned long long tag_len = 0, nhbytes = 0;
+    uvmac_profile_t p;
+    unsigned int i;
+    FILE *f;
+
+    f = fopen(path ? path : uvmac_profile_path(), "r");
+    if ( ! f)
+        return 0;
+    memset(&p, 0, sizeof(p));
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || sscanf(line, "%63s %63s", name, value) != 2)
+            continue;
+        if (strcmp(name, "tag_len") == 0)
+            tag_len = strtoull(value, NULL, 10);
+        else if (strcmp(name, "nhbytes") == 0)
+            nhbytes = strtoull(value, NULL, 10);
+        else if (strcmp(name, "kernel") == 0)
+            snprintf(p.kernel, sizeof(p.kernel), "%.*s", (int)sizeof(p.kernel) - 1, value);
+        else if (strcmp(name, "buffer_bytes") == 0)
+            p.buffer_bytes = strtoull(value, NULL, 10);
+        else if (strcmp(name, "threads") == 0)
+            p.threads = (unsigned int)strtoul(value, NULL, 10);
+        else if (strcmp(name, "prefetch_bytes") == 0)
+            p.prefetch_bytes = (unsigned int)strtoul(value, NULL, 10);
+    }
+    fclose(f);
+    if (tag_len != UVMAC_TAG_LEN || nhbytes != UVMAC_NHBYTES ||
+        p.buffer_bytes % UVMAC_NHBYTES != 0)
+        return -1;
+
+    for (i = 0; i < uvmac_kernel_count(); i++)
+        if (strcmp(kernels[i].name, p.kernel) == 0)
+            uvmac_kernel_select(i);
+    if (p.prefetch_bytes)
+        uvmac_prefetch_set(p.prefetch_bytes);
+    *profile = p;
+    return 1;
+}
+
+int uvmac_profile_save(const char *path, const uvmac_profile_t *profile)
+{
+    FILE *f = fopen(path ? path : uvmac_profile_path(), "w");
+    int ok;
+
+    if ( ! f)
+        return 0;
+    fprintf(f, "# uvmac host profile, written by uvmac tune\n");
+    fprintf(f, "tag_len %d\n", UVMAC_TAG_LEN);
+    fprintf(f, "nhbytes %d\n", UVMAC_NHBYTES);
+    if (profile->kernel[0])
+        fprintf(f, "kernel %s\n", profile->kernel);
+    if (profile->buffer_bytes)
+        fprintf(f, "buffer_bytes %llu\n", (unsigned long long)profile->buffer_bytes);
+    if (profile->threads)
+        fprintf(f, "threads %u\n", profile->threads);
+    if (profile->prefetch_bytes)
+        fprintf(f, "prefetch_bytes %u\n", profile->prefetch_bytes);
+    ok = ! ferror(f);
+    return (fclose(f) == 0) && ok;
+}
+
+/* ----------------------------------------------------------------------- */
+
+void vhash_update(unsigned char *m,
+                  unsigned int   mbytes, /* Pos multiple of UVMAC_NHBYTES */
+                  uvmax_ctx_t    *ctx)
+{
+    if (mbytes < UVMAC_NHBYTES)
+        return;
+    kernel->blocks((uint64_t *)m, mbytes / UVMAC_NHBYTES, ctx, ctx->polytmp,
+                   ! ctx->first_block_processed);
+    ctx->first_block_processed = 1;
+#if UVMAC_STATS
+    stats_hashed(mbytes);
+    ctx->message_bytes += mbytes;
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+/* Hashes the last, incomplete block of mbytes < UVMAC_NHBYTES bytes into
+   polytmp, like a kernel */
+#if (UVMAC_TAG_LEN == 256)
+static void partial_block(const uint64_t *mptr, unsigned int mbytes,
+                          const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                          int first)
+{
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    const uint64_t *pk = ctx->polykey;
+    const int msg_be = ctx->big_endian;
+    uint64_t rh[4], rl[4];
+
+    nh_16_4(mptr,kptr,(int)(2*((mbytes+15)/16)),rh,rl);
+    poly_step_4(polytmp,pk,rh,rl,first,poly_step);
 #if UVMAC_USE_SSE2
     _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
 #endif
-    vhash_abort(ctx);
-    remaining *= 8;
+}
+#else
+static void partial_block(const uint64_t *mptr, unsigned int mbytes,
+                          const uvmax_ctx_t *ctx, uint64_t polytmp[],
+                          int first)
+{
+    uint64_t ch, cl, rh, rl;
+#if (UVMAC_TAG_LEN == 128)
+    uint64_t ch2, cl2, rh2, rl2;
+#endif
+    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
+    const int msg_be = ctx->big_endian;
+
+    ch = polytmp[0];
+    cl = polytmp[1];
+#if (UVMAC_TAG_LEN == 128)
+    ch2 = polytmp[2];
+    cl2 = polytmp[3];
+    nh_16_2(mptr,kptr,(int)(2*((mbytes+15)/16)),rh,rl,rh2,rl2);
+    rh2 &= m62;
+#else
+    nh_16(mptr,kptr,(int)(2*((mbytes+15)/16)),rh,rl);
+#endif
+    rh &= m62;
+    if ( ! first) {
+        poly_step(ch,cl,ctx->polykey[0],ctx->polykey[1],rh,rl);
 #if (UVMAC_TAG_LEN == 128)
-    *tagl = l3hash(ch2, cl2, ctx->l3key[2], ctx->l3key[3],remaining);
+        poly_step(ch2,cl2,ctx->polykey[2],ctx->polykey[3],rh2,rl2);
+#endif
+    } else {
+        ADD128(ch,cl,rh,rl);
+#if (UVMAC_TAG_LEN == 128)
+        ADD128(ch2,cl2,rh2,rl2);
+#endif
+    }
+#if UVMAC_USE_SSE2
+    _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
+#endif
+    polytmp[0] = ch;
+    polytmp[1] = cl;
+#if (UVMAC_TAG_LEN == 128)
+    polytmp[2] = ch2;
+    polytmp[3] = cl2;
 #endif
-    return l3hash(ch, cl, ctx->l3key[0], ctx->l3key[1],remaining);
 }
+#endif
+
+/* ----------------------------------------------------------------------- */
 
 uint64_t vhash(unsigned char m[],
                unsigned int mbytes,
                uint64_t *tagl,
                uvmax_ctx_t *ctx)
 {
-    uint64_t rh, rl, *mptr;
-    const uint64_t *kptr = (uint64_t *)ctx->nhkey;
-    int i, remaining;
-    uint64_t ch, cl;
-    uint64_t pkh = ctx->polykey[0];
-    uint64_t pkl = ctx->polykey[1];
-#if (UVMAC_TAG_LEN == 128)
-    uint64_t ch2, cl2, rh2, rl2;
-        uint64_t pkh2 = ctx->polykey[2];
-        uint64_t pkl2 = ctx->polykey[3];
-#endif
+    uint64_t acc[2*UVMAC_LANES];
+    unsigned int i, remaining, lane;
 
-    mptr = (uint64_t *)m;
-    i = mbytes / UVMAC_NHBYTES;
     remaining = mbytes % UVMAC_NHBYTES;
-
-    if (ctx->first_block_processed)
-    {
-        ch = ctx->polytmp[0];
-        cl = ctx->polytmp[1];
-#if (UVMAC_TAG_LEN == 128)
-        ch2 = ctx->polytmp[2];
-        cl2 = ctx->polytmp[3];
-#endif
-    }
-    else if (i)
-    {
-#if (UVMAC_TAG_LEN == 64)
-        nh_vhash_nhbytes(mptr,kptr,UVMAC_NHBYTES/8,ch,cl);
-#else
-        nh_vhash_nhbytes_2(mptr,kptr,UVMAC_NHBYTES/8,ch,cl,ch2,cl2);
-        ch2 &= m62;
-        ADD128(ch2,cl2,pkh2,pkl2);
-#endif
-        ch &= m62;
-        ADD128(ch,cl,pkh,pkl);
-        mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
-        i--;
-    }
-    else if (remaining)
-    {
-#if (UVMAC_TAG_LEN == 64)
-        nh_16(mptr,kptr,2*((remaining+15)/16),ch,cl);
-#else
-        nh_16_2(mptr,kptr,2*((remaining+15)/16),ch,cl,ch2,cl2);
-        ch2 &= m62;
-        ADD128(ch2,cl2,pkh2,pkl2);
-#endif
-        ch &= m62;
-        ADD128(ch,cl,pkh,pkl);
-        mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
-        goto do_l3;
-    }
-    else /* Empty String */
-    {
-        ch = pkh; cl = pkl;
-#if (UVMAC_TAG_LEN == 128)
-        ch2 = pkh2; cl2 = pkl2;
-#endif
-        goto do_l3;
+    i = mbytes-remaining;
+    if (i) {
+        kernel->blocks((uint64_t *)m, i / UVMAC_NHBYTES, ctx, ctx->polytmp,
+                       ! ctx->first_block_processed);
+        ctx->first_block_processed = 1;
     }
+    if (remaining)
+        partial_block((uint64_t *)(m+i), remaining, ctx, ctx->polytmp,
+                      ! ctx->first_block_processed);
 
-    while (i--) {
-#if (UVMAC_TAG_LEN == 64)
-        nh_vhash_nhbytes(mptr,kptr,UVMAC_NHBYTES/8,rh,rl);
-#else
-        nh_vhash_nhbytes_2(mptr,kptr,UVMAC_NHBYTES/8,rh,rl,rh2,rl2);
-        rh2 &= m62;
-        poly_step(ch2,cl2,pkh2,pkl2,rh2,rl2);
-#endif
-        rh &= m62;
-        poly_step(ch,cl,pkh,pkl,rh,rl);
-        mptr += (UVMAC_NHBYTES/sizeof(uint64_t));
-    }
-    if (remaining) {
-#if (UVMAC_TAG_LEN == 64)
-        nh_16(mptr,kptr,2*((remaining+15)/16),rh,rl);
-#else
-        nh_16_2(mptr,kptr,2*((remaining+15)/16),rh,rl,rh2,rl2);
-        rh2 &= m62;
-        poly_step(ch2,cl2,pkh2,pkl2,rh2,rl2);
-#endif
-        rh &= m62;
-        poly_step(ch,cl,pkh,pkl,rh,rl);
-    }
+    memcpy(acc, ctx->polytmp, sizeof(acc));
 
-    do_l3:
-#if UVMAC_USE_SSE2
-    _mm_empty(); /* SSE2 version of poly_step uses mmx instructions */
+#if UVMAC_STATS
+    stats_hashed(mbytes);
+    stats_finished(ctx->message_bytes + mbytes);
 #endif
     vhash_abort(ctx);
     remaining *= 8;
-#if (UVMAC_TAG_LEN == 128)
-    *tagl = l3hash(ch2, cl2, ctx->l3key[2], ctx->l3key[3],remaining);
-#endif
-    return l3hash(ch, cl, ctx->l3key[0], ctx->l3key[1],remaining);
+    for (lane = 1; lane < UVMAC_LANES; lane++)
+        tagl[lane-1] = l3hash(acc[2*lane], acc[2*lane+1], ctx->l3key[2*lane],
+                              ctx->l3key[2*lane+1], remaining);
+    return l3hash(acc[0], acc[1], ctx->l3key[0], ctx->l3key[1],remaining);
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1017,6 +2149,9 @@ uint64_t uvmac(unsigned char m[],
                const uint64_t consumable_key_length,
                uint64_t* consumable_key_position)
 {
+#if UVMAC_STATS
+    stats_count(1, 0);
+#endif
 #if (UVMAC_TAG_LEN == 64)
     uint64_t *out_p;
     uint64_t p, h;
@@ -1026,16 +2161,346 @@ uint64_t uvmac(unsigned char m[],
     return p + h;
 #else
     uint64_t *out_p;
-    uint64_t th,tl;
+    uint64_t th,tl[UVMAC_LANES-1];
+    unsigned int lane;
+    out_p = get64bitsOfKey(consumable_key, consumable_key_length, consumable_key_position);
+    th = vhash(m, mbytes, tl, ctx);
+    th += get64BE(out_p);
+    for (lane = 1; lane < UVMAC_LANES; lane++) {
+        out_p = get64bitsOfKey(consumable_key, consumable_key_length, consumable_key_position);
+        tagl[lane-1] = tl[lane-1] + get64BE(out_p);
+    }
+    return th;
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+uint64_t vhash_checkpoint(const uvmax_ctx_t *ctx, uint64_t *tagl)
+{
+    unsigned int lane;
+
+#if UVMAC_STATS
+    stats_finished(ctx->message_bytes);
+#endif
+    /* polytmp holds the poly hash of the blocks so far (the poly key when
+       there are none), as vhash would pass it on with no partial block */
+    for (lane = 1; lane < UVMAC_LANES; lane++)
+        tagl[lane-1] = l3hash(ctx->polytmp[2*lane], ctx->polytmp[2*lane+1],
+                              ctx->l3key[2*lane], ctx->l3key[2*lane+1], 0);
+    return l3hash(ctx->polytmp[0], ctx->polytmp[1], ctx->l3key[0],
+                  ctx->l3key[1], 0);
+}
+
+/* ----------------------------------------------------------------------- */
+
+uint64_t uvmac_checkpoint(const uvmax_ctx_t *ctx,
+                          uint64_t *tagl,
+                          uint64_t* consumable_key,
+                          const uint64_t consumable_key_length,
+                          uint64_t* consumable_key_position)
+{
+    uint64_t *out_p;
+    uint64_t th;
+#if (UVMAC_TAG_LEN != 64)
+    uint64_t tl[UVMAC_LANES-1];
+    unsigned int lane;
+#endif
+
+#if UVMAC_STATS
+    stats_count(1, 0);
+#endif
     out_p = get64bitsOfKey(consumable_key, consumable_key_length, consumable_key_position);
-    th = vhash(m, mbytes, &tl, ctx);
+#if (UVMAC_TAG_LEN == 64)
+    th = vhash_checkpoint(ctx, tagl);
+    return th + get64BE(out_p);
+#else
+    th = vhash_checkpoint(ctx, tl);
     th += get64BE(out_p);
+    for (lane = 1; lane < UVMAC_LANES; lane++) {
+        out_p = get64bitsOfKey(consumable_key, consumable_key_length, consumable_key_position);
+        tagl[lane-1] = tl[lane-1] + get64BE(out_p);
+    }
+    return th;
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+void vhash_snapshot(const uvmax_ctx_t *ctx, uvmac_prefix_t *prefix)
+{
+    memcpy(prefix->polytmp, ctx->polytmp, sizeof(prefix->polytmp));
+    prefix->first_block_processed = ctx->first_block_processed;
+#if UVMAC_STATS
+    prefix->message_bytes = ctx->message_bytes;
+#endif
+}
+
+void vhash_fork(uvmax_ctx_t *ctx, const uvmac_prefix_t *prefix)
+{
+    memcpy(ctx->polytmp, prefix->polytmp, sizeof(ctx->polytmp));
+    ctx->first_block_processed = prefix->first_block_processed;
+#if UVMAC_STATS
+    ctx->message_bytes = prefix->message_bytes;
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+/* Segments                                                                */
+/* ----------------------------------------------------------------------- */
+
+/* --------------------------------------------------------------------- *
+ * The poly hash of n blocks m_1..m_n (the last one possibly partial) is
+ * k^n + m_1 k^(n-1) + ... + m_n mod p127. A segment keeps the same sum
+ * without the k^n term, so that the segments of a message combine as
+ * a k^(blocks of b) + b, and k^n is added when finishing.
+ * The functions below reduce their results to [0, p127); they only run
+ * once per segment and favour clarity over speed.
+ * --------------------------------------------------------------------- */
+
+/* (h,l) < 2^128 to [0, p127) */
+static void reduce127(uint64_t *h, uint64_t *l)
+{
+    uint64_t th = *h, tl = *l, t, z = 0;
+
+    t = th >> 63;
+    th &= m63;
+    ADD128(th, tl, z, t);          /* now at most 2^127 */
+    t = th >> 63;
+    th &= m63;
+    ADD128(th, tl, z, t);
+    if (th == m63 && tl == m64)
+        th = tl = 0;
+    *h = th;
+    *l = tl;
+}
+
+/* (ah,al) += (bh,bl), both in [0, p127) */
+static void addmod127(uint64_t *ah, uint64_t *al, uint64_t bh, uint64_t bl)
+{
+    uint64_t th = *ah, tl = *al;
+
+    ADD128(th, tl, bh, bl);
+    reduce127(&th, &tl);
+    *ah = th;
+    *al = tl;
+}
+
+/* (rh,rl) = (ah,al) * (bh,bl), both in [0, p127) */
+static void mulmod127(uint64_t *rh, uint64_t *rl,
+                      uint64_t ah, uint64_t al, uint64_t bh, uint64_t bl)
+{
+    uint64_t t0h, t0l, t1h, t1l, t2h, t2l, t3h, t3l, th, tl;
+
+    MUL64(t0h, t0l, al, bl);
+    MUL64(t1h, t1l, ah, bl);
+    MUL64(t2h, t2l, al, bh);
+    MUL64(t3h, t3l, ah, bh);
+    ADD128(t1h, t1l, t2h, t2l);    /* middle term, below 2^128 */
+
+    /* 2^128 = 2 mod p127, so the product is
+       t0 + t1l 2^64 + 2 t1h + 2 t3 with t3 < 2^126 */
+    reduce127(&t0h, &t0l);
+    th = t1l;
+    tl = 0;
+    reduce127(&th, &tl);
+    addmod127(&t0h, &t0l, th, tl);
+    th = t1h >> 63;
+    tl = t1h << 1;
+    addmod127(&t0h, &t0l, th, tl);
+    th = (t3h << 1) | (t3l >> 63);
+    tl = t3l << 1;
+    reduce127(&th, &tl);
+    addmod127(&t0h, &t0l, th, tl);
+    *rh = t0h;
+    *rl = t0l;
+}
+
+/* (rh,rl) = (kh,kl)^e, with (kh,kl) in [0, p127) */
+static void powmod127(uint64_t *rh, uint64_t *rl,
+                      uint64_t kh, uint64_t kl, uint64_t e)
+{
+    uint64_t h = 0, l = 1;
+
+    while (e) {
+        if (e & 1)
+            mulmod127(&h, &l, h, l, kh, kl);
+        mulmod127(&kh, &kl, kh, kl, kh, kl);
+        e >>= 1;
+    }
+    *rh = h;
+    *rl = l;
+}
+
+void uvmac_segment_init(uvmac_segment_t *seg)
+{
+    memset(seg, 0, sizeof(*seg));
+}
+
+void uvmac_segment_update(const unsigned char m[], unsigned int mbytes,
+                          const uvmax_ctx_t *ctx, uvmac_segment_t *seg)
+{
+    unsigned int i, remaining;
+
+    assert(seg->bytes % UVMAC_NHBYTES == 0);  /* No partial block yet */
+    remaining = mbytes % UVMAC_NHBYTES;
+    i = mbytes - remaining;
+    if (i)
+        kernel->blocks((const uint64_t *)m, i / UVMAC_NHBYTES, ctx,
+                       seg->acc, 0);
+    if (remaining)
+        partial_block((const uint64_t *)(m+i), remaining, ctx, seg->acc, 0);
+    seg->blocks += (mbytes + UVMAC_NHBYTES - 1) / UVMAC_NHBYTES;
+    seg->bytes += mbytes;
+#if UVMAC_STATS
+    stats_hashed(mbytes);
+#endif
+}
+
+void uvmac_segment_combine(uvmac_segment_t *a, const uvmac_segment_t *b,
+                           const uvmax_ctx_t *ctx)
+{
+    uint64_t kh, kl, bh, bl;
+    unsigned int lane;
+
+    assert(a->bytes % UVMAC_NHBYTES == 0);
+    for (lane = 0; lane < UVMAC_LANES; lane++) {
+        powmod127(&kh, &kl, ctx->polykey[2*lane], ctx->polykey[2*lane+1],
+                  b->blocks);
+        reduce127(&a->acc[2*lane], &a->acc[2*lane+1]);
+        mulmod127(&a->acc[2*lane], &a->acc[2*lane+1],
+                  a->acc[2*lane], a->acc[2*lane+1], kh, kl);
+        bh = b->acc[2*lane];
+        bl = b->acc[2*lane+1];
+        reduce127(&bh, &bl);
+        addmod127(&a->acc[2*lane], &a->acc[2*lane+1], bh, bl);
+    }
+    a->blocks += b->blocks;
+    a->bytes += b->bytes;
+}
+
+uint64_t uvmac_segment_vhash(const uvmac_segment_t *seg, uint64_t *tagl,
+                             const uvmax_ctx_t *ctx)
+{
+    uint64_t h[2*UVMAC_LANES], ah, al;
+    uint64_t remaining = (seg->bytes % UVMAC_NHBYTES) * 8;
+    unsigned int lane;
+
+    for (lane = 0; lane < UVMAC_LANES; lane++) {
+        h[2*lane] = ctx->polykey[2*lane];
+        h[2*lane+1] = ctx->polykey[2*lane+1];
+        if (seg->blocks) {   /* The empty message hashes the poly key */
+            powmod127(&h[2*lane], &h[2*lane+1],
+                      h[2*lane], h[2*lane+1], seg->blocks);
+            ah = seg->acc[2*lane];
+            al = seg->acc[2*lane+1];
+            reduce127(&ah, &al);
+            addmod127(&h[2*lane], &h[2*lane+1], ah, al);
+        }
+    }
+#if UVMAC_STATS
+    stats_finished(seg->bytes);
+#endif
+    for (lane = 1; lane < UVMAC_LANES; lane++)
+        tagl[lane-1] = l3hash(h[2*lane], h[2*lane+1], ctx->l3key[2*lane],
+                              ctx->l3key[2*lane+1], remaining);
+    return l3hash(h[0], h[1], ctx->l3key[0], ctx->l3key[1], remaining);
+}
+
+uint64_t uvmac_segment_tag(const uvmac_segment_t *seg, uint64_t *tagl,
+                           const uvmax_ctx_t *ctx,
+                           uint64_t* consumable_key,
+                           const uint64_t consumable_key_length,
+                           uint64_t* consumable_key_position)
+{
+    uint64_t *out_p;
+    uint64_t th;
+#if (UVMAC_TAG_LEN != 64)
+    uint64_t tl[UVMAC_LANES-1];
+    unsigned int lane;
+#endif
+
+#if UVMAC_STATS
+    stats_count(1, 0);
+#endif
     out_p = get64bitsOfKey(consumable_key, consumable_key_length, consumable_key_position);
-    *tagl = tl + get64BE(out_p);
+#if (UVMAC_TAG_LEN == 64)
+    th = uvmac_segment_vhash(seg, tagl, ctx);
+    return th + get64BE(out_p);
+#else
+    th = uvmac_segment_vhash(seg, tl, ctx);
+    th += get64BE(out_p);
+    for (lane = 1; lane < UVMAC_LANES; lane++) {
+        out_p = get64bitsOfKey(consumable_key, consumable_key_length, consumable_key_position);
+        tagl[lane-1] = tl[lane-1] + get64BE(out_p);
+    }
     return th;
 #endif
 }
 
+/* Block j of n adds NH(m_j) k^(n-1-j) to the segment, so replacing its
+   content adds (NH(new) - NH(old)) k^(n-1-j), the power for the previous
+   block being k times the power for the next one */
+void uvmac_segment_replace(uvmac_segment_t *seg, uint64_t offset,
+                           const unsigned char old_m[],
+                           const unsigned char new_m[], unsigned int mbytes,
+                           const uvmax_ctx_t *ctx)
+{
+    uint64_t oh[UVMAC_LANES], ol[UVMAC_LANES], nh[UVMAC_LANES], nl[UVMAC_LANES];
+    uint64_t kn[2*UVMAC_LANES], dh, dl;
+    uint64_t first = offset / UVMAC_NHBYTES;
+    uint64_t nblocks = (mbytes + UVMAC_NHBYTES - 1) / UVMAC_NHBYTES, b;
+    unsigned int lane, len;
+
+    assert(offset % UVMAC_NHBYTES == 0 && offset + mbytes <= seg->bytes);
+    assert(mbytes % UVMAC_NHBYTES == 0 || offset + mbytes == seg->bytes);
+    for (lane = 0; lane < UVMAC_LANES; lane++) {
+        powmod127(&kn[2*lane], &kn[2*lane+1], ctx->polykey[2*lane],
+                  ctx->polykey[2*lane+1], seg->blocks - first - nblocks);
+        reduce127(&seg->acc[2*lane], &seg->acc[2*lane+1]);
+    }
+    for (b = nblocks; b-- > 0; ) {
+        len = mbytes - (unsigned int)b * UVMAC_NHBYTES;
+        if (len >= UVMAC_NHBYTES) {
+            uvmac_nh_block(old_m + b * UVMAC_NHBYTES, ctx, oh, ol);
+            uvmac_nh_block(new_m + b * UVMAC_NHBYTES, ctx, nh, nl);
+        } else {
+            uvmac_nh_partial(old_m + b * UVMAC_NHBYTES, len, ctx, oh, ol);
+            uvmac_nh_partial(new_m + b * UVMAC_NHBYTES, len, ctx, nh, nl);
+        }
+        for (lane = 0; lane < UVMAC_LANES; lane++) {
+            /* new + (p127 - old), both NH outputs below 2^126 */
+            dh = m63 - (oh[lane] & m62);
+            dl = m64 - ol[lane];
+            addmod127(&dh, &dl, nh[lane] & m62, nl[lane]);
+            mulmod127(&dh, &dl, dh, dl, kn[2*lane], kn[2*lane+1]);
+            addmod127(&seg->acc[2*lane], &seg->acc[2*lane+1], dh, dl);
+            if (b)
+                mulmod127(&kn[2*lane], &kn[2*lane+1], kn[2*lane],
+                          kn[2*lane+1], ctx->polykey[2*lane],
+                          ctx->polykey[2*lane+1]);
+        }
+    }
+}
+
+/* ----------------------------------------------------------------------- */
+
+/* Key words taken by uvmac_set_key are not counted as pad slices */
+static uint64_t* take64bitsOfKey(uint64_t* consumable_key, const uint64_t key_length, uint64_t* key_position)
+{
+    if ((*key_position) + 1 > key_length)
+    {
+        printf("Error: All available key has been used already, no fresh key available anymore.\n");
+        assert(0);
+    }
+    // We return a pointer to the next two 64-bit registers of the key
+    uint64_t *out = consumable_key + (*key_position);
+    // ... and increment the position
+    (*key_position) = (*key_position) + 1;
+//    printf("At position %lu out of %lu\n", (*key_position), key_length);
+    return out;
+}
+
 /* ----------------------------------------------------------------------- */
 
 void uvmac_set_key(unsigned char user_key[], const uint32_t key_length, uvmax_ctx_t *ctx)
@@ -1047,43 +2512,201 @@ void uvmac_set_key(unsigned char user_key[], const uint32_t key_length, uvmax_ct
 
     /* Fill nh key */
     for (i = 0; i < sizeof(ctx->nhkey)/8; i++) {
-        out = get64bitsOfKey((uint64_t*) user_key, key_length, &key_position);
+        out = take64bitsOfKey((uint64_t*) user_key, key_length, &key_position);
         ctx->nhkey[i  ] = get64BE(out);
     }
 
     /* Fill poly key */
     for (i = 0; i < sizeof(ctx->polykey)/8; i++) {
-        out = get64bitsOfKey((uint64_t*) user_key, key_length, &key_position);
+        out = take64bitsOfKey((uint64_t*) user_key, key_length, &key_position);
         ctx->polytmp[i  ] = ctx->polykey[i  ] = get64BE(out) & mpoly;
     }
 
     /* Fill ip key */
     for (i = 0; i < sizeof(ctx->l3key)/8; i++) {
         do {
-            out = get64bitsOfKey((uint64_t*) user_key, key_length, &key_position);
+            out = take64bitsOfKey((uint64_t*) user_key, key_length, &key_position);
             ctx->l3key[i  ] = get64BE(out);
         } while (ctx->l3key[i] >= p64);
     }
 
     /* Reset other elements */
     ctx->first_block_processed = 0;
+    ctx->big_endian = UVMAC_PREFER_BIG_ENDIAN;
+#if UVMAC_STATS
+    ctx->message_bytes = 0;
+#endif
+}
+
+/* ----------------------------------------------------------------------- */
+
+void uvmac_set_byte_order(uvmax_ctx_t *ctx, int big_endian)
+{
+    ctx->big_endian = (big_endian != 0);
 }
 
 /* ----------------------------------------------------------------------- */
 
 uint64_t* get64bitsOfKey(uint64_t* consumable_key, const uint64_t key_length, uint64_t* key_position)
 {
-    if ((*key_position) + 1 > key_length)
-    {
-        printf("Error: All available key has been used already, no fresh key available anymore.\n");
-        assert(0);
+#if UVMAC_STATS
+    stats_count(0, 1);
+#endif
+    return take64bitsOfKey(consumable_key, key_length, key_position);
+}
+
+/* ----------------------------------------------------------------------- */
+/* Stage entry points for tests and benchmarks, see uvmaclib_internal.h    */
+
+void uvmac_nh_block(const unsigned char m[], const uvmax_ctx_t *ctx,
+                    uint64_t rh[], uint64_t rl[])
+{
+    const uint64_t *mptr = (const uint64_t *)m;
+    const uint64_t *kptr = ctx->nhkey;
+    const int msg_be = ctx->big_endian;
+#if (UVMAC_TAG_LEN == 256)
+    nh_vhash_nhbytes_4(mptr,kptr,UVMAC_NHBYTES/8,rh,rl);
+#else
+    uint64_t h, l;
+#if (UVMAC_TAG_LEN == 64)
+    nh_vhash_nhbytes(mptr,kptr,UVMAC_NHBYTES/8,h,l);
+#else
+    uint64_t h2, l2;
+    nh_vhash_nhbytes_2(mptr,kptr,UVMAC_NHBYTES/8,h,l,h2,l2);
+    rh[1] = h2; rl[1] = l2;
+#endif
+    rh[0] = h; rl[0] = l;
+#endif
+#if UVMAC_USE_SSE2
+    _mm_empty();
+#endif
+}
+
+void uvmac_nh_partial(const unsigned char m[], unsigned int mbytes,
+                      const uvmax_ctx_t *ctx, uint64_t rh[], uint64_t rl[])
+{
+    const uint64_t *mptr = (const uint64_t *)m;
+    const uint64_t *kptr = ctx->nhkey;
+    const int msg_be = ctx->big_endian;
+#if (UVMAC_TAG_LEN == 256)
+    nh_16_4(mptr,kptr,(int)(2*((mbytes+15)/16)),rh,rl);
+#else
+    uint64_t h, l;
+#if (UVMAC_TAG_LEN == 64)
+    nh_16(mptr,kptr,(int)(2*((mbytes+15)/16)),h,l);
+#else
+    uint64_t h2, l2;
+    nh_16_2(mptr,kptr,(int)(2*((mbytes+15)/16)),h,l,h2,l2);
+    rh[1] = h2; rl[1] = l2;
+#endif
+    rh[0] = h; rl[0] = l;
+#endif
+#if UVMAC_USE_SSE2
+    _mm_empty();
+#endif
+}
+
+void uvmac_poly_step(uint64_t *ah, uint64_t *al, uint64_t kh, uint64_t kl,
+                     uint64_t mh, uint64_t ml)
+{
+    uint64_t ch = *ah, cl = *al;
+    poly_step(ch,cl,kh,kl,mh,ml);
+    *ah = ch; *al = cl;
+#if UVMAC_USE_SSE2
+    _mm_empty();
+#endif
+}
+
+uint64_t uvmac_l3hash(uint64_t p1, uint64_t p2, uint64_t k1, uint64_t k2,
+                      uint64_t len)
+{
+    return l3hash(p1, p2, k1, k2, len);
+}
+
+/* Read once per loop so that the compiler cannot drop the dependency     */
+static volatile uint64_t stage_zero = 0;
+
+uint64_t uvmac_stage_nh(const unsigned char m[], unsigned int count,
+                        const uvmax_ctx_t *ctx, int dependent)
+{
+    const uint64_t *mptr = (const uint64_t *)m;
+    const uint64_t *kptr = ctx->nhkey;
+    const int msg_be = ctx->big_endian;
+    uint64_t rh, rl, sum = 0, zero = stage_zero;
+#if (UVMAC_TAG_LEN == 128)
+    uint64_t rh2, rl2;
+#elif (UVMAC_TAG_LEN == 256)
+    uint64_t r4h[4], r4l[4];
+#endif
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        /* In dependent mode, the address of each block waits for the
+           previous NH output */
+        const uint64_t *bp = mptr + (size_t)i*(UVMAC_NHBYTES/8) +
+                             (dependent ? (sum & zero) : 0);
+#if (UVMAC_TAG_LEN == 64)
+        nh_vhash_nhbytes(bp,kptr,UVMAC_NHBYTES/8,rh,rl);
+#elif (UVMAC_TAG_LEN == 128)
+        nh_vhash_nhbytes_2(bp,kptr,UVMAC_NHBYTES/8,rh,rl,rh2,rl2);
+        rl ^= rl2 + rh2;
+#else
+        nh_vhash_nhbytes_4(bp,kptr,UVMAC_NHBYTES/8,r4h,r4l);
+        rh = r4h[0] ^ r4h[2];
+        rl = r4l[0] ^ r4l[2] ^ (r4l[1] + r4h[1]) ^ (r4l[3] + r4h[3]);
+#endif
+        sum += rh ^ rl;
     }
-    // We return a pointer to the next two 64-bit registers of the key
-    uint64_t *out = consumable_key + (*key_position);
-    // ... and increment the position
-    (*key_position) = (*key_position) + 1;
-//    printf("At position %lu out of %lu\n", (*key_position), key_length);
-    return out;
+#if UVMAC_USE_SSE2
+    _mm_empty();
+#endif
+    return sum;
+}
+
+uint64_t uvmac_stage_poly(unsigned int count, const uvmax_ctx_t *ctx,
+                          int dependent)
+{
+    uint64_t pkh = ctx->polykey[0];
+    uint64_t pkl = ctx->polykey[1];
+    uint64_t ch = ctx->nhkey[0] & m62, cl = ctx->nhkey[1];
+    uint64_t ch2 = ch ^ 1, cl2 = cl, ch3 = ch ^ 2, cl3 = cl, ch4 = ch ^ 3, cl4 = cl;
+    uint64_t mh = ctx->nhkey[2] & m62, ml = ctx->nhkey[3];
+    unsigned int i;
+
+    if (dependent) {
+        for (i = 0; i < count; i++) {
+            poly_step(ch,cl,pkh,pkl,mh,ml);
+            ml += i;
+        }
+    } else {
+        /* Four independent accumulators */
+        for (i = 0; i < count; i += 4) {
+            poly_step(ch,cl,pkh,pkl,mh,ml);
+            poly_step(ch2,cl2,pkh,pkl,mh,ml);
+            poly_step(ch3,cl3,pkh,pkl,mh,ml);
+            poly_step(ch4,cl4,pkh,pkl,mh,ml);
+            ml += i;
+        }
+    }
+#if UVMAC_USE_SSE2
+    _mm_empty();
+#endif
+    return ch ^ cl ^ ch2 ^ cl2 ^ ch3 ^ cl3 ^ ch4 ^ cl4;
+}
+
+uint64_t uvmac_stage_l3(unsigned int count, const uvmax_ctx_t *ctx,
+                        int dependent)
+{
+    uint64_t p1 = ctx->nhkey[0] & m63, p2 = ctx->nhkey[1], sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        uint64_t r = l3hash(p1, p2 + i, ctx->l3key[0], ctx->l3key[1], 8*(i & 127));
+        if (dependent)
+            p1 = r & m63;
+        sum += r;
+    }
+    return sum;
 }
 
 /* ----------------------------------------------------------------------- */
@@ -1092,72 +2715,56 @@ uint64_t* get64bitsOfKey(uint64_t* consumable_key, const uint64_t key_length, ui
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <time.h>
 #include <string.h>
 
-unsigned prime(void)  /* Wake variable speed cpu, get rough speed estimate */
-{
-    volatile uint64_t i;
-    volatile uint64_t j=1;
-    unsigned cnt=0;
-    volatile clock_t ticks = clock();
-    do {
-        for (i = 0; i < 500000; i++) {
-            uint64_t x = get64PE(&j);
-            j = x * x + (uint64_t)ticks;
-        }
-        cnt++;
-    } while (clock() - ticks < (CLOCKS_PER_SEC/2));
-    return cnt;  /* cnt is millions of iterations per second */
-}
-
 int main(void)
 {
     ALIGN(16) uvmax_ctx_t ctx;
-    uint64_t res, tagl;
-    void *p;
-    unsigned char *m;
-#if (UVMAC_TAG_LEN == 64)
-    ALIGN(4) unsigned char key[] = "abcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefgh";
-    uint64_t key_length = 20;
-#else
-    ALIGN(4) unsigned char key[] = "abcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefgh";
-    uint64_t key_length = 26;
-#endif
+    uint64_t res, tagl[UVMAC_TAG_LEN/64];
+    static ALIGN(16) unsigned char m[3 * (1 << 20) + 16];  /* No heap */
+    ALIGN(8) unsigned char key[UVMAC_KEY_LEN*8];   /* "abcdefgh" repeated */
+    uint64_t key_length = UVMAC_KEY_LEN;
     unsigned int  vector_lengths[] = {0,3,48,300,3000000};
 #if (UVMAC_TAG_LEN == 64)
     ALIGN(4) char *should_be[] = {"8124D03C89C8B774","1E59621DEA8080AA",
                                   "C92F7FC29A334AF6","FC48C8853C7E9CAB",
                                   "70CC2C64273263C4"};
-#else
+#elif (UVMAC_TAG_LEN == 128)
+    /* The key repeats every 8 bytes, so both lanes get the same nh, poly and
+       l3 keys and the two halves of each tag coincide. Lane separation is
+       covered by the uvmac_check program. */
     ALIGN(4) char *should_be[] = {"8124D03C89C8B7748124D03C89C8B774",
                          "1E59621DEA8080AA1E59621DEA8080AA",
                          "C92F7FC29A334AF6C92F7FC29A334AF6",
                          "FC48C8853C7E9CABFC48C8853C7E9CAB",
                          "70CC2C64273263C470CC2C64273263C4"};
+#else
+    /* Likewise the four quarters of each 256-bit tag */
+    ALIGN(4) char *should_be[] = {
+        "8124D03C89C8B7748124D03C89C8B7748124D03C89C8B7748124D03C89C8B774",
+        "1E59621DEA8080AA1E59621DEA8080AA1E59621DEA8080AA1E59621DEA8080AA",
+        "C92F7FC29A334AF6C92F7FC29A334AF6C92F7FC29A334AF6C92F7FC29A334AF6",
+        "FC48C8853C7E9CABFC48C8853C7E9CABFC48C8853C7E9CABFC48C8853C7E9CAB",
+        "70CC2C64273263C470CC2C64273263C470CC2C64273263C470CC2C64273263C4"};
 #endif
-    unsigned speed_lengths[] = {16, 32, 64, 128, 256, 512, 1024, 2048, 4096};
-    unsigned i, j, *speed_iters;
-    clock_t ticks;
-    double cpb;
-    const unsigned int buf_len = 3 * (1 << 20);
-
-    j = prime();
-    i = sizeof(speed_lengths)/sizeof(speed_lengths[0]);
-    speed_iters = (unsigned *)malloc(i*sizeof(speed_iters[0]));
-    speed_iters[i-1] = j * (1 << 12);
-    while (--i) speed_iters[i-1] = (unsigned)(1.3 * speed_iters[i]);
+    unsigned i, j, failures = 0;
+#if (UVMAC_TAG_LEN != 64)
+    unsigned lane;
+#endif
+    char got[UVMAC_TAG_LEN/4+1];
 
     /* Initialize context and message buffer, all 16-byte aligned */
-    p = malloc(buf_len + 32);
-    m = (unsigned char *)(((size_t)p + 16) & ~((size_t)15));
-    memset(m, 0, buf_len + 16);
+    memset(m, 0, sizeof(m));
+    for (i = 0; i < sizeof(key); i++)
+        key[i] = (unsigned char)('a' + i%8);
     uvmac_set_key(key, key_length, &ctx);
 
     /* Initialize running key used for one-time-pad */
-    ALIGN(4) unsigned char running_key_data[] = "abcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefghabcdefgh";
+    ALIGN(8) unsigned char running_key_data[40*8];
+    for (i = 0; i < sizeof(running_key_data); i++)
+        running_key_data[i] = (unsigned char)('a' + i%8);
     uint64_t *running_key = (uint64_t*) &running_key_data;
-    uint64_t running_key_length = 20; // Enough for 20 64-bits tags or 10 128-bits ones, but for test purposes we repeatedly use the same key
+    uint64_t running_key_length = 40; // Enough for 40 64-bits tags, 20 128-bits or 10 256-bits ones, but for test purposes we repeatedly use the same key
     uint64_t running_key_position = 0;
 
 
@@ -1165,47 +2772,41 @@ int main(void)
     for (i = 0; i < sizeof(vector_lengths)/sizeof(unsigned int); i++) {
         for (j = 0; j < vector_lengths[i]; j++)
             m[j] = (unsigned char)('a'+j%3);
-        res = uvmac(m, vector_lengths[i], &tagl, &ctx, running_key, running_key_length, &running_key_position);
+        res = uvmac(m, vector_lengths[i], tagl, &ctx, running_key, running_key_length, &running_key_position);
 #if (UVMAC_TAG_LEN == 64)
-        printf("\'abc\' * %7u: %016lX Should be: %s\n",
-               vector_lengths[i]/3,res,should_be[i]);
+        sprintf(got, "%016llX", (unsigned long long)res);
+        printf("\'abc\' * %7u: %s Should be: %s\n",
+               vector_lengths[i]/3,got,should_be[i]);
 #else
-        printf("\'abc\' * %7u: %016lX%016lX\nShould be      : %s\n",
-              vector_lengths[i]/3,res,tagl,should_be[i]);
+        sprintf(got, "%016llX", (unsigned long long)res);
+        for (lane = 1; lane < UVMAC_TAG_LEN/64; lane++)
+            sprintf(got + 16*lane, "%016llX", (unsigned long long)tagl[lane-1]);
+        printf("\'abc\' * %7u: %s\nShould be      : %s\n",
+              vector_lengths[i]/3,got,should_be[i]);
 #endif
+        failures += (strcmp(got, should_be[i]) != 0);
 
         // Do it again, but with vhash_update
         if (vector_lengths[i] > UVMAC_NHBYTES) {
             long unsigned int firstPart = (vector_lengths[i]/UVMAC_NHBYTES)*UVMAC_NHBYTES;
             vhash_update(m, firstPart, &ctx);
-            res = uvmac(m+firstPart, vector_lengths[i]-firstPart, &tagl, &ctx, running_key, running_key_length, &running_key_position);
+            res = uvmac(m+firstPart, vector_lengths[i]-firstPart, tagl, &ctx, running_key, running_key_length, &running_key_position);
 #if (UVMAC_TAG_LEN == 64)
-            printf("\'abc\' * %7u: %016lX Should be: %s - computed in two parts: %lu+%lu\n",
-                   vector_lengths[i] / 3, res, should_be[i], firstPart, vector_lengths[i]-firstPart);
+            sprintf(got, "%016llX", (unsigned long long)res);
+            printf("\'abc\' * %7u: %s Should be: %s - computed in two parts: %lu+%lu\n",
+                   vector_lengths[i] / 3, got, should_be[i], firstPart, vector_lengths[i]-firstPart);
 #else
-            printf("\'abc\' * %7u: %016lX%016lX\nShould be      : %s - computed in two parts: %lu+%lu\n",
-                  vector_lengths[i]/3,res,tagl,should_be[i],firstPart,vector_lengths[i]-firstPart);
+            sprintf(got, "%016llX", (unsigned long long)res);
+            for (lane = 1; lane < UVMAC_TAG_LEN/64; lane++)
+                sprintf(got + 16*lane, "%016llX", (unsigned long long)tagl[lane-1]);
+            printf("\'abc\' * %7u: %s\nShould be      : %s - computed in two parts: %lu+%lu\n",
+                  vector_lengths[i]/3,got,should_be[i],firstPart,vector_lengths[i]-firstPart);
 #endif
+            failures += (strcmp(got, should_be[i]) != 0);
         }
     }
 
-    /* Speed test */
-    for (i = 0; i < sizeof(speed_lengths)/sizeof(unsigned int); i++) {
-        ticks = clock();
-        for (j = 0; j < speed_iters[i]; j++) {
-#if HASH_ONLY
-            res = vhash(m, speed_lengths[i], &tagl, &ctx);
-#else
-            res = uvmac(m, speed_lengths[i], &tagl, &ctx, running_key, running_key_length, &running_key_position);
-            running_key_position = 0;
-#endif
-        }
-        ticks = clock() - ticks;
-        cpb = ((ticks*UVMAC_HZ)/
-               ((double)CLOCKS_PER_SEC*speed_lengths[i]*speed_iters[i]));
-        printf("%4u bytes, %2.2f cpb\n", speed_lengths[i], cpb);
-    }
-    return 1;
+    return (failures != 0);
 }
 
 #endif
@@ -21,23 +21,24 @@
 /* --------------------------------------------------------------------------
  * User definable settings.
  * ----------------------------------------------------------------------- */
-#define UVMAC_TAG_LEN   64 /* Must be 64 or 128 - 64 sufficient for most    */
+#ifndef UVMAC_TAG_LEN
+#define UVMAC_TAG_LEN   64 /* Must be 64, 128 or 256 - 64 sufficient for most */
+#endif
+#ifndef UVMAC_NHBYTES
 #define UVMAC_NHBYTES  128 /* Must 2^i for any 3 < i < 13. Standard = 128   */
+#endif
+#ifndef UVMAC_PREFER_BIG_ENDIAN
 #define UVMAC_PREFER_BIG_ENDIAN  0  /* Prefer non-x86 */
+#endif
+
+#ifndef UVMAC_STATS
+#define UVMAC_STATS 0      /* Set to non-zero to count bytes, tags and pads */
+#endif
 
-#define UVMAC_RUN_TESTS 0  /* Set to non-zero to check vectors and speed    */
-#define UVMAC_HZ (448e6)  /* Set to hz of host machine to get speed        */
-#define UVMAC_HASH_ONLY 0  /* Set to non-zero to time hash only (not-mac)   */
-/* Speeds of cpus I have access to
-#define hz (2400e6)  glyme Core 2 "Conroe"
-#define hz (2000e6)  jupiter G5
-#define hz (1592e6)  titan
-#define hz (2793e6)  athena/gaia
-#define hz (1250e6)  isis G4
-#define hz (2160e6)  imac Core 2 "Merom"
-#define hz (266e6)   ppc/arm
-#define hz (400e6)   mips
-*/
+#ifndef UVMAC_RUN_TESTS
+#define UVMAC_RUN_TESTS 0  /* Set to non-zero to check vectors              */
+#endif
+/* Speed is measured by the separate uvmac_bench program (uvmacbench.cc) */
 
 /* --------------------------------------------------------------------------
  * The following parameter defines the key length required for universal
@@ -47,10 +48,11 @@
  *   Essentially, the requirements are:
  *     1280 bits for 64-bits tags
  *     1664 for 128-bits tags
+ *     2432 for 256-bits tags
  * Concretely, a bit less randomness is needed (c.f. ip key section of
  * function uvmac_set_key).
  * ----------------------------------------------------------------------- */
-#define UVMAC_KEY_LEN  (UVMAC_NHBYTES/8)+2*(UVMAC_TAG_LEN/64-1)+4*UVMAC_TAG_LEN/64 /* in units of 64 bits */
+#define UVMAC_KEY_LEN  ((UVMAC_NHBYTES/8)+2*(UVMAC_TAG_LEN/64-1)+4*UVMAC_TAG_LEN/64) /* in units of 64 bits */
 
 
 /* --------------------------------------------------------------------------
@@ -76,7 +78,15 @@ typedef unsigned long long uint64_t;
 #define UINT64_C(v) v ## ULL
 #endif
 
-/* --------------------------------------------------------------------- */
+/* --------------------------------------------------------------------------
+ * Memory. The library allocates nothing: a stream needs its context, a
+ * fixed-size uvmax_ctx_t (and a uvmac_segment_t when hashed as segments)
+ * that can live on the stack, and a message buffer of the caller's choice.
+ * That buffer can be as small as UVMAC_NHBYTES bytes, passed to
+ * vhash_update one block at a time, plus the 16 bytes of zero padding read
+ * after the last part by vhash. Small buffers cost one call per part; see
+ * README.md for throughput by buffer size.
+ * ----------------------------------------------------------------------- */
 
 typedef struct {
     uint64_t nhkey  [(UVMAC_NHBYTES/8)+2*(UVMAC_TAG_LEN/64-1)];
@@ -84,6 +94,10 @@ typedef struct {
     uint64_t l3key  [2*UVMAC_TAG_LEN/64];
     uint64_t polytmp[2*UVMAC_TAG_LEN/64];
     int first_block_processed;
+    int big_endian;          /* Message words read as big-endian       */
+#if UVMAC_STATS
+    uint64_t message_bytes;  /* Bytes passed to vhash_update so far    */
+#endif
 } uvmax_ctx_t;
 
 /* --------------------------------------------------------------------------
@@ -103,7 +117,10 @@ extern "C" {
  * this function returns a tag as its output. The tag is returned as
  * a number. When UVMAC_TAG_LEN == 64, the 'return'ed integer is the tag,
  * and *tagl is meaningless. When UVMAC_TAG_LEN == 128 the tag is the
- * number y * 2^64 + *tagl where y is the function's return value.
+ * number y * 2^64 + *tagl where y is the function's return value. When
+ * UVMAC_TAG_LEN == 256, tagl points to three words and the tag is
+ * y * 2^192 + tagl[0] * 2^128 + tagl[1] * 2^64 + tagl[2]. Each 64-bit
+ * word is an independent hash lane.
  * If you want to consider tags to be strings, then you must do so with
  * an agreed upon endian orientation for interoperability, and convert
  * the results appropriately. VHASH hashes m without creating any tag.
@@ -155,12 +172,176 @@ uint64_t vhash(unsigned char m[],
 
 void uvmac_set_key(unsigned char user_key[], const uint32_t key_length, uvmax_ctx_t *ctx);
 
+/* --------------------------------------------------------------------------
+ * Byte order in which the message is read as 64-bit words: little-endian
+ * (big_endian zero, the x86 convention) or big-endian. Both peers must use
+ * the same order, as the tags differ. uvmac_set_key sets the order given by
+ * UVMAC_PREFER_BIG_ENDIAN; it may be changed between messages, not in the
+ * middle of one. Both orders hash at the same speed with the SIMD kernels,
+ * which byte-swap whole vectors as they load them.
+ * ----------------------------------------------------------------------- */
+
+void uvmac_set_byte_order(uvmax_ctx_t *ctx, int big_endian);
+
 /* --------------------------------------------------------------------------
  * This function aborts current hash and resets ctx, ready for a new message.
  * ----------------------------------------------------------------------- */
 
 void vhash_abort(uvmax_ctx_t *ctx);
 
+/* --------------------------------------------------------------------------
+ * Checkpoints of a stream still being hashed. After any number of
+ * vhash_update calls, vhash_checkpoint and uvmac_checkpoint return what
+ * vhash and uvmac would return for the bytes passed so far (tagl as in
+ * vhash), but leave ctx unchanged, so that the stream goes on with more
+ * vhash_update calls and a final vhash or uvmac. A checkpoint costs one
+ * l3hash per lane, and uvmac_checkpoint takes one part of the consumable
+ * key, like any tag. Segments need no such call: uvmac_segment_vhash and
+ * uvmac_segment_tag leave the segment unchanged.
+ * ----------------------------------------------------------------------- */
+
+uint64_t vhash_checkpoint(const uvmax_ctx_t *ctx, uint64_t *tagl);
+
+uint64_t uvmac_checkpoint(const uvmax_ctx_t *ctx,
+                          uint64_t *tagl,
+                          uint64_t* consumable_key,
+                          const uint64_t consumable_key_length,
+                          uint64_t* consumable_key_position);
+
+/* --------------------------------------------------------------------------
+ * Shared prefixes. vhash_snapshot saves in prefix the state of ctx after
+ * the vhash_update calls of a block-aligned prefix (a few words, not the
+ * keys), and vhash_fork puts ctx back in that state, so that messages
+ * starting with the same prefix hash it once: fork, then hash the rest of
+ * each message with vhash_update and vhash or uvmac, at a cost that only
+ * depends on the length of that rest. A snapshot can be forked any number
+ * of times, into any context set up with the same key and byte order.
+ * ----------------------------------------------------------------------- */
+
+typedef struct {
+    uint64_t polytmp[2*UVMAC_TAG_LEN/64];
+    int first_block_processed;
+#if UVMAC_STATS
+    uint64_t message_bytes;
+#endif
+} uvmac_prefix_t;
+
+void vhash_snapshot(const uvmax_ctx_t *ctx, uvmac_prefix_t *prefix);
+
+void vhash_fork(uvmax_ctx_t *ctx, const uvmac_prefix_t *prefix);
+
+/* --------------------------------------------------------------------------
+ * Segments, to hash one message on several threads. The message is cut
+ * into consecutive segments whose lengths, except for the last one, are
+ * multiples of UVMAC_NHBYTES. Each segment is hashed on its own: after
+ * uvmac_segment_init, any number of uvmac_segment_update calls, all but
+ * the last call of the last segment with multiples of UVMAC_NHBYTES.
+ * uvmac_segment_combine appends segment b to segment a; once all segments
+ * are combined in message order, uvmac_segment_vhash and uvmac_segment_tag
+ * return what vhash and uvmac return for the whole message (tagl as in
+ * vhash). Segments only read ctx, which threads can share. Segment lengths
+ * may exceed 4 GB through several updates.
+ * ----------------------------------------------------------------------- */
+
+typedef struct {
+    uint64_t acc[2*UVMAC_TAG_LEN/64];  /* Poly hash of the blocks          */
+    uint64_t blocks;                   /* Blocks, including a partial one  */
+    uint64_t bytes;
+} uvmac_segment_t;
+
+void uvmac_segment_init(uvmac_segment_t *seg);
+
+void uvmac_segment_update(const unsigned char m[], unsigned int mbytes,
+                          const uvmax_ctx_t *ctx, uvmac_segment_t *seg);
+
+void uvmac_segment_combine(uvmac_segment_t *a, const uvmac_segment_t *b,
+                           const uvmax_ctx_t *ctx);
+
+uint64_t uvmac_segment_vhash(const uvmac_segment_t *seg, uint64_t *tagl,
+                             const uvmax_ctx_t *ctx);
+
+uint64_t uvmac_segment_tag(const uvmac_segment_t *seg, uint64_t *tagl,
+                           const uvmax_ctx_t *ctx,
+                           uint64_t* consumable_key,
+                           const uint64_t consumable_key_length,
+                           uint64_t* consumable_key_position);
+
+/* --------------------------------------------------------------------------
+ * In-place updates. When mbytes bytes at offset of the message hashed in a
+ * segment change from old_m to new_m (both zero padded to 16 bytes),
+ * uvmac_segment_replace updates the segment as if the new message had been
+ * hashed, with two NH hashes per block changed and one exponentiation by
+ * the number of blocks after the range, instead of a rehash. offset must
+ * be a multiple of UVMAC_NHBYTES, and so must mbytes unless the range ends
+ * the message; the length of the message does not change. The new hash is
+ * then uvmac_segment_vhash, and the new tag uvmac_segment_tag with a fresh
+ * part of the consumable key, the old tag's part being used up. offset
+ * counts from the start of the segment, which may be combined afterwards.
+ * ----------------------------------------------------------------------- */
+
+void uvmac_segment_replace(uvmac_segment_t *seg, uint64_t offset,
+                           const unsigned char old_m[],
+                           const unsigned char new_m[], unsigned int mbytes,
+                           const uvmax_ctx_t *ctx);
+
+/* --------------------------------------------------------------------------
+ * Host profiles, written by "uvmac tune". A profile is a text file of
+ * "name value" lines ('#' starts a comment) holding the block kernel (and
+ * the prefetch distance of the pipelined one), the read buffer size and
+ * the number of hashing threads found fastest on the host, together with
+ * the UVMAC_TAG_LEN and UVMAC_NHBYTES it was measured with. Only settings
+ * that leave the tags unchanged are tuned: UVMAC_TAG_LEN and UVMAC_NHBYTES
+ * change the tag and stay fixed at compile time, and a profile made for
+ * other values is rejected.
+ * uvmac_profile_load reads the profile at path (uvmac_profile_path() when
+ * path is null), selects its kernel when the cpu supports it and sets its
+ * prefetch distance; it returns 1 if the profile was applied, 0 if there
+ * is no such file and -1 if it is invalid or was made for another tag
+ * length or block size, in which case nothing is changed.
+ * uvmac_profile_save returns 0 on failure.
+ * uvmac_profile_path is $UVMAC_PROFILE if set, else $HOME/.uvmac_profile.
+ * ----------------------------------------------------------------------- */
+
+typedef struct {
+    char kernel[32];        /* Block kernel, empty for the default          */
+    uint64_t buffer_bytes;  /* Read buffer of the uvmac program, 0 if unset */
+    unsigned int threads;   /* Hashing threads, 0 if unset                  */
+    unsigned int prefetch_bytes; /* Prefetch distance, 0 if unset           */
+} uvmac_profile_t;
+
+int uvmac_profile_load(const char *path, uvmac_profile_t *profile);
+
+int uvmac_profile_save(const char *path, const uvmac_profile_t *profile);
+
+const char *uvmac_profile_path(void);
+
+/* --------------------------------------------------------------------------
+ * Usage counters, compiled in when UVMAC_STATS is non-zero (the library and
+ * its users must agree on UVMAC_STATS, which changes uvmax_ctx_t).
+ * Each thread counts in its own slot, without locks; uvmac_stats_snapshot
+ * adds up the slots of all threads that ever used the library, including
+ * the threads that have exited. The snapshot is not atomic as a whole,
+ * but every counter in it is. It returns 0, and zero counters, when the
+ * library was built without UVMAC_STATS.
+ * Message sizes are counted when a message is finished by vhash or uvmac,
+ * in size_histogram[0] for empty messages and in size_histogram[i] for
+ * sizes in [2^(i-1), 2^i) bytes.
+ * ----------------------------------------------------------------------- */
+
+#define UVMAC_STATS_BUCKETS 64
+
+typedef struct {
+    uint64_t bytes;       /* Bytes hashed by vhash_update, vhash and uvmac */
+    uint64_t blocks;      /* Full UVMAC_NHBYTES blocks among them         */
+    uint64_t hashes;      /* Messages finished by vhash or uvmac          */
+    uint64_t tags;        /* Messages finished by uvmac                   */
+    uint64_t pad_slices;  /* 64-bit pad words taken by get64bitsOfKey     */
+    uint64_t size_histogram[UVMAC_STATS_BUCKETS];
+    uint64_t threads;     /* Threads that used the library                */
+} uvmac_stats_t;
+
+int uvmac_stats_snapshot(uvmac_stats_t *stats);
+
 /* --------------------------------------------------------------------- */
 
 #ifdef  __cplusplus
@@ -0,0 +1,99 @@
+#ifndef HEADER_UVMAC_INTERNAL_H
+#define HEADER_UVMAC_INTERNAL_H
+
+/* --------------------------------------------------------------------------
+ * Internal entry points of uvmaclib.c, for tests and benchmarks only.
+ *
+ * The three stages of VHASH are macros and static functions inside
+ * vhash(): the NH hash of each UVMAC_NHBYTES block (L1), the polynomial
+ * step mod 2^127-1 accumulating the NH outputs (L2) and the final l3hash
+ * (L3). The functions below run them in isolation, with the same macros as
+ * the library itself, so that their output can be checked against a
+ * reference implementation and their speed measured separately.
+ * They are not part of the public interface and may change at any time.
+ * ----------------------------------------------------------------------- */
+
+#include "uvmaclib.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define UVMAC_LANES (UVMAC_TAG_LEN/64)   /* Independent hash lanes        */
+
+/* --------------------------------------------------------------------------
+ * Block kernels. Each compiled kernel hashes nblocks full UVMAC_NHBYTES
+ * blocks into polytmp (two words per lane) exactly as vhash_update
+ * specifies, adding the first block to polytmp instead of multiplying
+ * polytmp by the poly key when first is non-zero; supported, when not
+ * null, tells whether the running cpu can execute it. The selected kernel
+ * is used by vhash_update, vhash and the segments in the whole process.
+ * uvmac_kernel_select returns 0, and keeps the current kernel, when the
+ * index is out of range or the kernel is not supported.
+ * ----------------------------------------------------------------------- */
+
+typedef struct {
+    const char *name;
+    void (*blocks)(const uint64_t *mptr, unsigned int nblocks,
+                   const uvmax_ctx_t *ctx, uint64_t polytmp[], int first);
+    int (*supported)(void);
+} uvmac_kernel_t;
+
+unsigned int uvmac_kernel_count(void);
+const uvmac_kernel_t *uvmac_kernel_info(unsigned int i);
+int uvmac_kernel_select(unsigned int i);
+unsigned int uvmac_kernel_current(void);
+
+/* --------------------------------------------------------------------------
+ * Prefetch distance of the "pipelined" kernel: the bytes ahead of the
+ * block being hashed that it asks the cpu to load, rounded down to whole
+ * 64-byte lines. 0 disables prefetching; the default is
+ * UVMAC_PREFETCH_BYTES. Process-wide, like the kernel selection.
+ * ----------------------------------------------------------------------- */
+
+void uvmac_prefetch_set(unsigned int bytes);
+unsigned int uvmac_prefetch_get(void);
+
+/* --------------------------------------------------------------------------
+ * Single stage calls. rh and rl receive one NH output per lane, before the
+ * m62 masking done by vhash. uvmac_nh_partial hashes the last, incomplete
+ * block of mbytes < UVMAC_NHBYTES bytes (zero padded to 16 bytes).
+ * uvmac_poly_step computes (ah,al) = (ah,al)*(kh,kl) + (mh,ml) mod 2^127-1
+ * without full reduction.
+ * ----------------------------------------------------------------------- */
+
+void uvmac_nh_block(const unsigned char m[], const uvmax_ctx_t *ctx,
+                    uint64_t rh[], uint64_t rl[]);
+
+void uvmac_nh_partial(const unsigned char m[], unsigned int mbytes,
+                      const uvmax_ctx_t *ctx, uint64_t rh[], uint64_t rl[]);
+
+void uvmac_poly_step(uint64_t *ah, uint64_t *al, uint64_t kh, uint64_t kl,
+                     uint64_t mh, uint64_t ml);
+
+uint64_t uvmac_l3hash(uint64_t p1, uint64_t p2, uint64_t k1, uint64_t k2,
+                      uint64_t len);
+
+/* --------------------------------------------------------------------------
+ * Stage loops for microbenchmarks. Each runs 'count' instances of a stage
+ * (NH over 'count' consecutive blocks of m, or 'count' poly steps or l3
+ * hashes). When dependent is non-zero every instance waits for the result
+ * of the previous one, which measures latency; otherwise the instances are
+ * independent, which measures throughput. The return value depends on all
+ * results so that the work cannot be optimised away.
+ * ----------------------------------------------------------------------- */
+
+uint64_t uvmac_stage_nh(const unsigned char m[], unsigned int count,
+                        const uvmax_ctx_t *ctx, int dependent);
+
+uint64_t uvmac_stage_poly(unsigned int count, const uvmax_ctx_t *ctx,
+                          int dependent);
+
+uint64_t uvmac_stage_l3(unsigned int count, const uvmax_ctx_t *ctx,
+                        int dependent);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif /* HEADER_UVMAC_INTERNAL_H */
@@ -0,0 +1,427 @@
+/*  This program generates load for the tagging service ("uvmac serve")
+
+    usage: uvmac_load [options]
+
+    options:
+
+      --port P: port of the service on 127.0.0.1 (default 7070)
+      --connections N: number of concurrent connections, each with its own
+        thread sending one message at a time (default 4)
+      --duration s: length of the measurement in seconds (default 10)
+      --warmup s: time before the measurement starts, whose requests are
+        not counted (default 1)
+      --rate R: total requests per second, spread evenly over the
+        connections (default 0: each connection sends its next message as
+        soon as it has the tag of the previous one)
+      --sizes spec: message sizes in bytes, drawn at random (default
+        64-65536):
+          N            all messages of N bytes
+          A-B          log-uniform between A and B
+          N:w,M:v,...  N bytes with weight w, M bytes with weight v...
+      --seed S: seed of the message sizes (default 1)
+      --json file: also write the results in JSON format to this file ("-"
+        for the standard output)
+
+    output format:
+
+      The number of requests and errors, the throughput in requests and
+      bytes per second, the latency percentiles (p50, p90, p99, p99.9 and
+      maximum, in microseconds) and the pad consumption, in slices
+      (message numbers) and bytes per second. With --rate the latency of a
+      request is counted from the time it should have been sent, so that
+      a slow service is not hidden by the client waiting for it.
+      Latencies are kept in a log-linear histogram (as HdrHistogram does)
+      with a relative error below 1%.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "uvmacserve.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+/* ----------------------------------------------------------------------- */
+/* Latency histogram                                                       */
+
+/* Values below 2^SUB_BITS are counted exactly; above, each power of two
+   is split into 2^(SUB_BITS-1) buckets of equal width */
+class Histogram
+{
+public:
+    enum { SUB_BITS = 8, HALF = 1 << (SUB_BITS - 1) };
+
+    Histogram() : counts((64 - SUB_BITS + 2) * HALF, 0), total(0), max_value(0) {}
+
+    void record(uint64_t v)
+    {
+        counts[index(v)]++;
+        total++;
+        max_value = max(max_value, v);
+    }
+
+    void merge(const Histogram &h)
+    {
+        for (size_t i = 0; i < counts.size(); ++i)
+            counts[i] += h.counts[i];
+        total += h.total;
+        max_value = max(max_value, h.max_value);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return max_value; }
+
+    /* Smallest value v such that a fraction q of the values are <= v,
+       within the width of its bucket */
+    uint64_t quantile(double q) const
+    {
+        uint64_t rank = (uint64_t)ceil(q * total), seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen)
+                return min(highest(i), max_value);
+        }
+        return max_value;
+    }
+
+private:
+    static size_t index(uint64_t v)
+    {
+        if (v < (1u << SUB_BITS))
+            return (size_t)v;
+        int shift = (63 - __builtin_clzll(v)) - (SUB_BITS - 1);
+        return (size_t)shift * HALF + (size_t)(v >> shift);
+    }
+
+    static uint64_t highest(size_t i)
+    {
+        if (i < (1u << SUB_BITS))
+            return i;
+        int shift = (int)(i / HALF) - 1;
+        return ((uint64_t)(i - shift * HALF + 1) << shift) - 1;
+    }
+
+    vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+};
+
+/* ----------------------------------------------------------------------- */
+/* Message sizes                                                           */
+
+class Sizes
+{
+public:
+    bool parse(const string &spec)
+    {
+        size_t dash = spec.find('-');
+        if (spec.find(':') != string::npos) {
+            stringstream ss(spec);
+            string item;
+            while (getline(ss, item, ',')) {
+                size_t colon = item.find(':');
+                if (colon == string::npos)
+                    return false;
+                values.push_back(strtoull(item.c_str(), NULL, 0));
+                weights.push_back(atof(item.c_str() + colon + 1));
+            }
+        } else if (dash != string::npos) {
+            low = strtoull(spec.c_str(), NULL, 0);
+            high = strtoull(spec.c_str() + dash + 1, NULL, 0);
+            return low >= 1 && low <= high;
+        } else {
+            values.push_back(strtoull(spec.c_str(), NULL, 0));
+            weights.push_back(1);
+        }
+        double sum = 0;
+        for (size_t i = 0; i < weights.size(); ++i)
+            sum += weights[i];
+        return sum > 0;
+    }
+
+    uint64_t largest() const
+    {
+        return values.empty() ? high : *max_element(values.begin(), values.end());
+    }
+
+    uint64_t draw(uint64_t &state) const
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        double u = (state >> 11) * (1.0 / 9007199254740992.0);
+        if (values.empty())
+            return (uint64_t)(low * pow((double)high / low, u));
+        double sum = 0, target;
+        for (size_t i = 0; i < weights.size(); ++i)
+            sum += weights[i];
+        target = u * sum;
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (target < weights[i])
+                return values[i];
+            target -= weights[i];
+        }
+        return values.back();
+    }
+
+private:
+    vector<uint64_t> values;
+    vector<double> weights;
+    uint64_t low = 0, high = 0;
+};
+
+/* ----------------------------------------------------------------------- */
+/* Connections                                                             */
+
+struct Connection
+{
+    Histogram latency;       // in nanoseconds
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t tag_words = 0;  // pad words per message, from the server
+    bool failed = false;
+};
+
+static void put_le64(unsigned char *p, uint64_t x)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = (unsigned char)(x >> (8 * i));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; --i)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+static bool read_all(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+    while (n) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char *)buf;
+    while (n) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static void run_connection(Connection *c, int port, const Sizes *sizes, uint64_t seed,
+                           const unsigned char *payload, double interval_s,
+                           Clock::time_point start, Clock::time_point end)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    unsigned char word[8], answer[8 * 5];
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        !read_all(fd, word, 8)) {
+        c->failed = true;
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->tag_words = get_le64(word) / 64;
+    size_t answer_len = 8 * (1 + c->tag_words);
+    if (answer_len > sizeof(answer)) {
+        c->failed = true;
+        close(fd);
+        return;
+    }
+
+    Clock::duration interval = chrono::duration_cast<Clock::duration>(
+        chrono::duration<double>(interval_s));
+    Clock::time_point planned = Clock::now();
+    for (;;) {
+        Clock::time_point sent = Clock::now();
+        if (interval_s > 0) {
+            planned += interval;
+            if (planned > sent)
+                this_thread::sleep_until(planned);
+            sent = planned;
+        }
+        if (sent >= end)
+            break;
+        uint64_t mbytes = sizes->draw(seed);
+        put_le64(word, mbytes);
+        if (!write_all(fd, word, 8) || !write_all(fd, payload, mbytes) ||
+            !read_all(fd, answer, answer_len)) {
+            c->failed = true;
+            break;
+        }
+        Clock::time_point done = Clock::now();
+        if (sent < start)
+            continue;
+        c->requests++;
+        if (get_le64(answer) == UVMAC_SERVE_ERROR)
+            c->errors++;
+        else
+            c->bytes += mbytes;
+        c->latency.record(chrono::duration_cast<chrono::nanoseconds>(done - sent).count());
+    }
+    close(fd);
+}
+
+/* ----------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+    int port = 7070;
+    unsigned int connections = 4;
+    double duration = 10, warmup = 1, rate = 0;
+    uint64_t seed = 1;
+    string sizes_spec = "64-65536", json_file;
+
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (i + 1 >= argc) {
+            cerr << "Missing value for option " << a << endl;
+            return 1;
+        }
+        string v = argv[++i];
+        if (a == "--port")
+            port = atoi(v.c_str());
+        else if (a == "--connections")
+            connections = max(1, atoi(v.c_str()));
+        else if (a == "--duration")
+            duration = atof(v.c_str());
+        else if (a == "--warmup")
+            warmup = atof(v.c_str());
+        else if (a == "--rate")
+            rate = atof(v.c_str());
+        else if (a == "--sizes")
+            sizes_spec = v;
+        else if (a == "--seed")
+            seed = strtoull(v.c_str(), NULL, 0);
+        else if (a == "--json")
+            json_file = v;
+        else {
+            cerr << "Unknown option " << a << endl;
+            return 1;
+        }
+    }
+    Sizes sizes;
+    if (!sizes.parse(sizes_spec)) {
+        cerr << "Invalid message sizes " << sizes_spec << endl;
+        return 1;
+    }
+
+    vector<unsigned char> payload(sizes.largest() + 1);
+    uint64_t x = UINT64_C(0x9e3779b97f4a7c15);
+    for (size_t i = 0; i < payload.size(); ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        payload[i] = (unsigned char)x;
+    }
+
+    // 1. Connections, each with its own size sequence
+    Clock::time_point start = Clock::now() + chrono::duration_cast<Clock::duration>(
+        chrono::duration<double>(warmup));
+    Clock::time_point end = start + chrono::duration_cast<Clock::duration>(
+        chrono::duration<double>(duration));
+    vector<Connection> results(connections);
+    vector<thread> threads;
+    for (unsigned int i = 0; i < connections; ++i)
+        threads.push_back(thread(run_connection, &results[i], port, &sizes,
+                                 seed * 0x2545f4914f6cdd1dULL + i + 1, payload.data(),
+                                 rate > 0 ? connections / rate : 0.0, start, end));
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    // 2. Results
+    Histogram latency;
+    uint64_t requests = 0, errors = 0, bytes = 0, failed = 0, tag_words = 0;
+    for (size_t i = 0; i < results.size(); ++i) {
+        latency.merge(results[i].latency);
+        requests += results[i].requests;
+        errors += results[i].errors;
+        bytes += results[i].bytes;
+        failed += results[i].failed;
+        tag_words = max(tag_words, results[i].tag_words);
+    }
+    if (failed)
+        cerr << "Warning: " << failed << " connections to 127.0.0.1:" << port << " failed" << endl;
+    uint64_t tags = requests - errors;
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    const char *names[] = {"p50", "p90", "p99", "p999"};
+
+    cout << "requests: " << requests << endl;
+    cout << "errors: " << errors << endl;
+    cout << "requests_per_s: " << requests / duration << endl;
+    cout << "gb_per_s: " << bytes / duration / 1e9 << endl;
+    for (int q = 0; q < 4; ++q)
+        cout << names[q] << "_us: " << latency.quantile(quantiles[q]) / 1e3 << endl;
+    cout << "max_us: " << latency.maximum() / 1e3 << endl;
+    cout << "pad_slices_per_s: " << tags / duration << endl;
+    cout << "pad_bytes_per_s: " << tags * 8.0 * tag_words / duration << endl;
+
+    if (!json_file.empty()) {
+        ofstream file;
+        if (json_file != "-") {
+            file.open(json_file, ios::out);
+            if (!file) {
+                cerr << "Opening output file " << json_file << " failed" << endl;
+                return 1;
+            }
+        }
+        ostream &out = (json_file == "-") ? cout : file;
+        out << "{" << endl;
+        out << "  \"connections\": " << connections << "," << endl;
+        out << "  \"rate\": " << rate << "," << endl;
+        out << "  \"sizes\": \"" << sizes_spec << "\"," << endl;
+        out << "  \"duration_s\": " << duration << "," << endl;
+        out << "  \"requests\": " << requests << "," << endl;
+        out << "  \"errors\": " << errors << "," << endl;
+        out << "  \"failed_connections\": " << failed << "," << endl;
+        out << "  \"requests_per_s\": " << requests / duration << "," << endl;
+        out << "  \"gb_per_s\": " << bytes / duration / 1e9 << "," << endl;
+        out << "  \"latency_us\": {";
+        for (int q = 0; q < 4; ++q)
+            out << "\"" << names[q] << "\": " << latency.quantile(quantiles[q]) / 1e3 << ", ";
+        out << "\"max\": " << latency.maximum() / 1e3 << "}," << endl;
+        out << "  \"pad_slices_per_s\": " << tags / duration << "," << endl;
+        out << "  \"pad_bytes_per_s\": " << tags * 8.0 * tag_words / duration << endl;
+        out << "}" << endl;
+    }
+    return failed == connections ? 1 : 0;
+}
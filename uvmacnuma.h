@@ -0,0 +1,114 @@
+#ifndef HEADER_UVMAC_NUMA_H
+#define HEADER_UVMAC_NUMA_H
+
+/* --------------------------------------------------------------------------
+ * NUMA topology of the host, for uvmacparallel.h.
+ *
+ * The nodes and their cpus are read from /sys/devices/system/node, so no
+ * libnuma is needed; elsewhere, or when that directory is missing, the
+ * host is one node holding every cpu. nodes_of() tells on which node
+ * pages of memory are (the move_pages system call without moving), -1
+ * for pages not faulted in yet or when it cannot be known.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+class NumaTopology
+{
+public:
+    struct Node
+    {
+        int id;                         // as in /sys, nodeN
+        std::vector<unsigned int> cpus;
+    };
+
+    static const NumaTopology &host()
+    {
+        static const NumaTopology topology;
+        return topology;
+    }
+
+    unsigned int nodes() const { return (unsigned int)list.size(); }
+    const Node &node(unsigned int i) const { return list[i]; }
+
+    /* Index (not id) of the node holding each of the n addresses, or -1 */
+    void nodes_of(const void *const addresses[], size_t n, int out[]) const
+    {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = -1;
+#if defined(__linux__) && defined(SYS_move_pages)
+        if (list.size() < 2)
+            return;
+        std::vector<void *> pages(n);
+        std::vector<int> status(n);
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0; i < n; ++i)
+            pages[i] = (void *)((uintptr_t)addresses[i] & ~(uintptr_t)(page - 1));
+        if (syscall(SYS_move_pages, 0, (unsigned long)n, pages.data(), NULL, status.data(), 0) != 0)
+            return;
+        for (size_t i = 0; i < n; ++i)
+            for (size_t k = 0; k < list.size(); ++k)
+                if (status[i] == list[k].id)
+                    out[i] = (int)k;
+#endif
+    }
+
+private:
+    NumaTopology()
+    {
+#ifdef __linux__
+        std::vector<unsigned int> ids = read_list("/sys/devices/system/node/online");
+        for (size_t i = 0; i < ids.size(); ++i) {
+            Node n;
+            n.id = (int)ids[i];
+            n.cpus = read_list("/sys/devices/system/node/node" + std::to_string(ids[i]) + "/cpulist");
+            if (!n.cpus.empty())        // memory-only nodes run no threads
+                list.push_back(n);
+        }
+#endif
+        if (list.empty()) {
+            Node n;
+            n.id = 0;
+            unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned int c = 0; c < cpus; ++c)
+                n.cpus.push_back(c);
+            list.push_back(n);
+        }
+    }
+
+    /* Reads a list such as "0-3,8-11" */
+    static std::vector<unsigned int> read_list(const std::string &path)
+    {
+        std::vector<unsigned int> values;
+        std::ifstream file(path);
+        std::string text, range;
+        std::getline(file, text);
+        std::stringstream ss(text);
+        while (std::getline(ss, range, ',')) {
+            unsigned int first, last;
+            char dash;
+            std::stringstream rs(range);
+            if (!(rs >> first))
+                continue;
+            last = (rs >> dash >> last) ? last : first;
+            for (unsigned int v = first; v <= last; ++v)
+                values.push_back(v);
+        }
+        return values;
+    }
+
+    std::vector<Node> list;
+};
+
+#endif /* HEADER_UVMAC_NUMA_H */
@@ -0,0 +1,432 @@
+#ifndef HEADER_UVMAC_PARALLEL_H
+#define HEADER_UVMAC_PARALLEL_H
+
+/* --------------------------------------------------------------------------
+ * Multi-threaded hashing on top of the segments of uvmaclib.
+ *
+ * A ParallelHasher owns threads-1 worker threads, the calling thread being
+ * the last one. vhash() and uvmac() cut one message into segments of whole
+ * UVMAC_NHBYTES blocks, hash them on all threads and combine them in order
+ * on the calling thread. update() does the same for one part of a message
+ * that is read piecewise, appending it to a segment (all parts but the
+ * last one being multiples of UVMAC_NHBYTES, as for uvmac_segment_update).
+ * vhash_batch() hashes many independent messages, each on a single thread.
+ * The results are those of vhash() and uvmac() in the library, whatever
+ * the number of threads. As for vhash(), the bytes after each message up
+ * to the next 16-byte boundary must be readable and zero.
+ *
+ * The hasher sums, over all calls, the time spent combining segments on
+ * the calling thread and the time threads spent waiting for the others:
+ * from the start of a call until they woke up, and from the end of their
+ * share until the end of the slowest one. A hasher must only be used by
+ * one thread at a time.
+ *
+ * With numa, the threads are spread evenly over the NUMA nodes of the host
+ * (uvmacnuma.h) and kept on the cpus of their node, each with its own copy
+ * of the key made there. Each segment or batch of messages is queued on
+ * the node holding its memory, and the threads of a node take the tasks of
+ * other nodes only when their own queue is empty. first_touch() faults in
+ * a fresh buffer from the threads that will hash each part of it, so that
+ * this memory is local to them (with transparent huge pages, 2 MB at a
+ * time). node_stats() tells how many bytes the threads of each node hashed
+ * and how many of them were on another node. With pin or numa, the calling
+ * thread is placed as the last thread only while it works in a call, and
+ * gets its own cpus back after it, so that the threads it starts later are
+ * not confined to those of one node.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "uvmaclib.h"
+#include "uvmacnuma.h"
+#include "uvmactrace.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+class ParallelHasher
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct NodeStats
+    {
+        int id;                 // as in /sys, nodeN
+        unsigned int threads;
+        uint64_t bytes;         // hashed by the threads of the node
+        uint64_t remote_bytes;  // of which in the memory of another node
+    };
+
+    /* With pin, thread i runs on cpu i only (Linux); with numa as well, on
+       one cpu of its node */
+    ParallelHasher(const uvmax_ctx_t *ctx, unsigned int threads, bool pin = false,
+                   bool numa = false)
+        : ctx(ctx), nthreads(std::max(1u, threads)), pin(pin), numa(numa),
+          nnodes(numa ? std::min(NumaTopology::host().nodes(), nthreads) : 1),
+          segment_bytes(0), combine_s(0), wait_s(0), run_s(0), generation(0),
+          finished(0), quit(false), ntasks(0), home(NULL), steal(true),
+          node_tasks(nnodes), node_next(new std::atomic<size_t>[nnodes]),
+          starts(nthreads), ends(nthreads), ctxs(nthreads, ctx),
+          thread_bytes(nthreads), thread_remote(nthreads)
+    {
+        // The key copied on the node of the calling thread, which is then
+        // placed there only while it works in run()
+        Affinity own;
+        start_thread(nthreads - 1);
+        caller = Affinity();
+        own.restore();
+        for (unsigned int i = 0; i + 1 < nthreads; ++i)
+            workers.push_back(std::thread(&ParallelHasher::worker, this, i));
+    }
+
+    ~ParallelHasher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        start_cv.notify_all();
+        for (size_t i = 0; i < workers.size(); ++i)
+            workers[i].join();
+        for (unsigned int i = 0; i < nthreads; ++i)
+            if (ctxs[i] != ctx)
+                free((void *)ctxs[i]);
+    }
+
+    unsigned int threads() const { return nthreads; }
+    bool numa_aware() const { return numa; }
+
+    /* Length of the segments of a message, a multiple of UVMAC_NHBYTES;
+       0 (the default) gives each thread about four segments, of 64 kB at
+       least, so that faster threads can take over from slower ones */
+    void set_segment_bytes(uint64_t n) { segment_bytes = n - n % UVMAC_NHBYTES; }
+
+    double combine_seconds() const { return combine_s; }
+    double wait_seconds() const { return wait_s; }
+    /* Time spent in update() and vhash_batch(), combining excepted */
+    double run_seconds() const { return run_s; }
+    void reset_times()
+    {
+        combine_s = wait_s = run_s = 0;
+        std::fill(thread_bytes.begin(), thread_bytes.end(), 0);
+        std::fill(thread_remote.begin(), thread_remote.end(), 0);
+    }
+
+    /* Nodes the threads run on: 1 without numa */
+    unsigned int nodes() const { return nnodes; }
+    NodeStats node_stats(unsigned int node) const
+    {
+        NodeStats stats = {numa ? NumaTopology::host().node(node).id : -1, 0, 0, 0};
+        for (unsigned int i = 0; i < nthreads; ++i)
+            if (i % nnodes == node) {
+                stats.threads++;
+                stats.bytes += thread_bytes[i];
+                stats.remote_bytes += thread_remote[i];
+            }
+        return stats;
+    }
+
+    uint64_t vhash(const unsigned char *m, uint64_t mbytes, uint64_t *tagl)
+    {
+        uvmac_segment_t seg;
+        uvmac_segment_init(&seg);
+        update(seg, m, mbytes);
+        return uvmac_segment_vhash(&seg, tagl, ctx);
+    }
+
+    uint64_t uvmac(const unsigned char *m, uint64_t mbytes, uint64_t *tagl,
+                   uint64_t *consumable_key, uint64_t consumable_key_length,
+                   uint64_t *consumable_key_position)
+    {
+        uvmac_segment_t seg;
+        uvmac_segment_init(&seg);
+        update(seg, m, mbytes);
+        TraceSpan span(TRACE_PAD, UVMAC_TAG_LEN/8);
+        return uvmac_segment_tag(&seg, tagl, ctx, consumable_key,
+                                 consumable_key_length, consumable_key_position);
+    }
+
+    /* Appends m[0..mbytes) to seg, hashed on all threads */
+    void update(uvmac_segment_t &seg, const unsigned char *m, uint64_t mbytes)
+    {
+        uint64_t len = length(mbytes);
+        size_t n = (size_t)std::max((uint64_t)1, (mbytes + len - 1) / len);
+        segments.resize(n);
+        std::vector<int> nodes;
+        if (nnodes > 1) {
+            std::vector<const void *> addresses(n);
+            for (size_t i = 0; i < n; ++i)
+                addresses[i] = m + i * len;
+            nodes.resize(n);
+            NumaTopology::host().nodes_of(addresses.data(), n, nodes.data());
+        }
+        run(n, [&](size_t i, unsigned int id) {
+            uint64_t begin = i * len;
+            uint64_t bytes = (i + 1 == n) ? mbytes - begin : len;
+            TraceSpan span(TRACE_HASH, bytes);
+            hash(m + begin, bytes, segments[i], ctxs[id]);
+            return bytes;
+        }, nodes.empty() ? NULL : nodes.data());
+
+        Clock::time_point t0 = Clock::now();
+        {
+            TraceSpan span(TRACE_COMBINE, n);
+            for (size_t i = 0; i < n; ++i)
+                uvmac_segment_combine(&seg, &segments[i], ctx);
+        }
+        combine_s += std::chrono::duration<double>(Clock::now() - t0).count();
+    }
+
+    /* Hashes the n messages m[i] of mbytes[i] bytes; out receives
+       UVMAC_TAG_LEN/64 words per message, as vhash returns them */
+    void vhash_batch(const unsigned char *const m[], const uint64_t mbytes[],
+                     size_t n, uint64_t out[])
+    {
+        const size_t per_task = std::max((size_t)1, n / (16 * nthreads));
+        const size_t tasks = (n + per_task - 1) / per_task;
+        std::vector<int> nodes;
+        if (nnodes > 1) {
+            std::vector<const void *> addresses(tasks);
+            for (size_t task = 0; task < tasks; ++task)
+                addresses[task] = m[task * per_task];
+            nodes.resize(tasks);
+            NumaTopology::host().nodes_of(addresses.data(), tasks, nodes.data());
+        }
+        run(tasks, [&](size_t task, unsigned int id) {
+            size_t end = std::min(n, (task + 1) * per_task);
+            uint64_t bytes = 0;
+            for (size_t i = task * per_task; i < end; ++i) {
+                uvmac_segment_t seg;
+                TraceSpan span(TRACE_HASH, mbytes[i]);
+                hash(m[i], mbytes[i], seg, ctxs[id]);
+                uint64_t *o = out + i * (UVMAC_TAG_LEN/64);
+                o[0] = uvmac_segment_vhash(&seg, o + 1, ctxs[id]);
+                bytes += mbytes[i];
+            }
+            return bytes;
+        }, nodes.empty() ? NULL : nodes.data());
+    }
+
+    /* Faults in m[0..mbytes), a buffer not used yet or whose content can
+       be lost, writing zeros from the threads that update() gives each
+       segment of mbytes bytes to when the buffer is on no node yet */
+    void first_touch(unsigned char *m, uint64_t mbytes)
+    {
+        uint64_t len = length(mbytes);
+        size_t n = (size_t)std::max((uint64_t)1, (mbytes + len - 1) / len);
+        const uint64_t page = 4096;
+        run(n, [&](size_t i, unsigned int) {
+            uint64_t end = std::min(mbytes, (i + 1) * len);
+            for (uint64_t b = i * len; b < end; b += page)
+                ((volatile unsigned char *)m)[b] = 0;
+            return (uint64_t)0;
+        }, NULL, false);
+    }
+
+private:
+    typedef std::function<uint64_t(size_t, unsigned int)> Task;
+
+    ParallelHasher(const ParallelHasher &);
+    ParallelHasher &operator=(const ParallelHasher &);
+
+    uint64_t length(uint64_t mbytes) const
+    {
+        uint64_t len = segment_bytes;
+        if (!len) {
+            len = mbytes / (4 * nthreads);
+            len = std::max(len - len % UVMAC_NHBYTES, (uint64_t)1 << 16);
+        }
+        return len;
+    }
+
+    // The cpus the calling thread may run on, set back by restore()
+    struct Affinity
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        bool saved;
+        Affinity() : saved(sched_getaffinity(0, sizeof(set), &set) == 0) {}
+        void restore() const
+        {
+            if (saved)
+                sched_setaffinity(0, sizeof(set), &set);
+        }
+#else
+        void restore() const {}
+#endif
+    };
+
+    static void pin_cpu(unsigned int i)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(i % std::max(1u, std::thread::hardware_concurrency()), &set);
+        sched_setaffinity(0, sizeof(set), &set);
+#else
+        (void)i;
+#endif
+    }
+
+    /* Places thread id (the calling thread being the last one) and, with
+       numa, copies the key in the memory of its node */
+    void start_thread(unsigned int id)
+    {
+        if (!numa) {
+            if (pin)
+                pin_cpu(id);
+            return;
+        }
+        const NumaTopology::Node &node = NumaTopology::host().node(id % nnodes);
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t c = 0; c < node.cpus.size(); ++c)
+            if (!pin || c == (id / nnodes) % node.cpus.size())
+                CPU_SET(node.cpus[c], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+#else
+        (void)node;
+#endif
+        size_t bytes = (sizeof(uvmax_ctx_t) + 63) & ~(size_t)63;
+        uvmax_ctx_t *copy = (uvmax_ctx_t *)aligned_alloc(64, bytes);
+        if (copy) {
+            memcpy(copy, ctx, sizeof(uvmax_ctx_t));
+            ctxs[id] = copy;
+        }
+    }
+
+    void hash(const unsigned char *m, uint64_t mbytes, uvmac_segment_t &seg,
+              const uvmax_ctx_t *c)
+    {
+        const uint64_t max_call = UINT64_C(1) << 30;
+        uvmac_segment_init(&seg);
+        do {
+            unsigned int n = (unsigned int)std::min(mbytes, max_call);
+            uvmac_segment_update(m, n, c, &seg);
+            m += n;
+            mbytes -= n;
+        } while (mbytes);
+    }
+
+    /* Runs task(0..n-1) on all threads and waits for the end. Task i goes
+       to the queue of node nodes[i] if known, else the tasks are shared
+       out in order between the nodes; without steal, threads only take
+       the tasks of their own node */
+    void run(size_t n, Task task, const int *nodes = NULL, bool may_steal = true)
+    {
+        Clock::time_point t0 = Clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = task;
+            ntasks = n;
+            home = nodes;
+            steal = may_steal;
+            for (unsigned int d = 0; d < nnodes; ++d) {
+                node_tasks[d].clear();
+                node_next[d].store(0);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                int d = (nodes && nodes[i] >= 0 && nodes[i] < (int)nnodes)
+                        ? nodes[i] : (int)(i * nnodes / n);
+                node_tasks[d].push_back(i);
+            }
+            finished = 0;
+            ++generation;
+        }
+        start_cv.notify_all();
+        if (pin || numa) {
+            Affinity own;
+            caller.restore();
+            work(nthreads - 1);
+            own.restore();
+        } else
+            work(nthreads - 1);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done_cv.wait(lock, [this] { return finished == nthreads - 1; });
+        }
+
+        Clock::time_point last = *std::max_element(ends.begin(), ends.end());
+        for (unsigned int i = 0; i < nthreads; ++i)
+            wait_s += std::chrono::duration<double>((starts[i] - t0) + (last - ends[i])).count();
+        run_s += std::chrono::duration<double>(last - t0).count();
+    }
+
+    void work(unsigned int id)
+    {
+        starts[id] = Clock::now();
+        const unsigned int own = id % nnodes;
+        for (unsigned int k = 0; k < nnodes && (k == 0 || steal); ++k) {
+            const unsigned int d = (own + k) % nnodes;
+            const std::vector<size_t> &queue = node_tasks[d];
+            for (size_t j = node_next[d].fetch_add(1); j < queue.size(); j = node_next[d].fetch_add(1)) {
+                size_t i = queue[j];
+                uint64_t bytes = job(i, id);
+                thread_bytes[id] += bytes;
+                if (home && home[i] >= 0 && home[i] != (int)own)
+                    thread_remote[id] += bytes;
+            }
+        }
+        ends[id] = Clock::now();
+    }
+
+    void worker(unsigned int id)
+    {
+        start_thread(id);
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                start_cv.wait(lock, [&] { return quit || generation != seen; });
+                if (quit)
+                    return;
+                seen = generation;
+            }
+            work(id);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (++finished == nthreads - 1)
+                    done_cv.notify_one();
+            }
+        }
+    }
+
+    const uvmax_ctx_t *ctx;
+    unsigned int nthreads;
+    bool pin, numa;
+    Affinity caller;                // the calling thread as thread nthreads - 1
+    unsigned int nnodes;            // thread i runs on node i % nnodes
+    uint64_t segment_bytes;
+    double combine_s, wait_s, run_s;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;               // guards the fields down to node_tasks
+    std::condition_variable start_cv, done_cv;
+    uint64_t generation;            // bumped for each call
+    unsigned int finished;          // workers done with the current call
+    bool quit;
+    Task job;
+    size_t ntasks;
+    const int *home;                // node of each task, if known
+    bool steal;
+    std::vector<std::vector<size_t> > node_tasks;
+    std::unique_ptr<std::atomic<size_t>[]> node_next;   // next task of each node to take
+    std::vector<Clock::time_point> starts, ends;   // per thread, last call
+    std::vector<const uvmax_ctx_t *> ctxs;          // per thread, copies with numa
+    std::vector<uint64_t> thread_bytes, thread_remote;
+    std::vector<uvmac_segment_t> segments;
+};
+
+#endif /* HEADER_UVMAC_PARALLEL_H */
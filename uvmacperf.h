@@ -0,0 +1,134 @@
+#ifndef HEADER_UVMAC_PERF_H
+#define HEADER_UVMAC_PERF_H
+
+/* --------------------------------------------------------------------------
+ * Hardware performance counters for the uvmac benchmarks.
+ *
+ * PerfCounters opens one perf_event_open(2) group on the calling thread with
+ * the counters below, counting user space only. Counters the host does not
+ * provide (virtual machines, non-Linux systems, perf_event_paranoid too
+ * high) are reported as unavailable and the others keep working. Values
+ * accumulate over successive start()/stop() pairs until reset(), and are
+ * scaled when the kernel had to multiplex the group.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class PerfCounters
+{
+public:
+    enum { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, NUM_COUNTERS };
+
+    static const char *name(int i)
+    {
+        static const char *names[NUM_COUNTERS] =
+            {"cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+        return names[i];
+    }
+
+    PerfCounters() : leader(-1), nopen(0)
+    {
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            fd[i] = -1;
+            slot[i] = -1;
+            total[i] = 0;
+        }
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int i = 0; i < NUM_COUNTERS; ++i)
+            if (fd[i] >= 0)
+                close(fd[i]);
+#endif
+    }
+
+    /* Returns true if at least one counter could be opened */
+    bool open()
+    {
+#ifdef __linux__
+        const uint64_t l1d = PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        const uint32_t types[NUM_COUNTERS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+            PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+        const uint64_t configs[NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS, l1d, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES};
+
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = (leader < 0);
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+            if (fd[i] < 0)
+                continue;
+            if (leader < 0)
+                leader = fd[i];
+            slot[i] = nopen++;
+        }
+#endif
+        return nopen > 0;
+    }
+
+    bool available(int i) const { return slot[i] >= 0; }
+
+    void reset()
+    {
+        for (int i = 0; i < NUM_COUNTERS; ++i)
+            total[i] = 0;
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        if (leader < 0)
+            return;
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    void stop()
+    {
+#ifdef __linux__
+        if (leader < 0)
+            return;
+        ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        /* nr, time_enabled, time_running, then one value per counter */
+        uint64_t buf[3 + NUM_COUNTERS];
+        if (read(leader, buf, sizeof(buf)) < (ssize_t)(3 + nopen) * 8)
+            return;
+        double scale = (buf[2] && buf[2] < buf[1]) ? (double)buf[1] / buf[2] : 1.0;
+        for (int i = 0; i < NUM_COUNTERS; ++i)
+            if (slot[i] >= 0)
+                total[i] += buf[3 + slot[i]] * scale;
+#endif
+    }
+
+    double value(int i) const { return total[i]; }
+
+private:
+    int fd[NUM_COUNTERS];
+    int slot[NUM_COUNTERS];    // position of the counter in the group read
+    double total[NUM_COUNTERS];
+    int leader;
+    int nopen;
+};
+
+#endif /* HEADER_UVMAC_PERF_H */
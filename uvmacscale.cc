@@ -0,0 +1,317 @@
+/*  This program measures how hashing scales with the number of threads
+
+    usage: uvmac_scale [options]
+
+    options:
+
+      --threads N: largest number of threads (default: the number of
+        cpus). Thread counts go from 1 to N in powers of two, and N.
+      --thread-list list: comma separated thread counts instead
+      --size N: bytes hashed per call, all in memory (default 256 MB)
+      --mixes list: comma separated message size mixes (default all)
+      --samples N: number of timed samples per case, the best one is
+        reported (default 5)
+      --pin: run thread i on cpu i only
+      --numa: spread the threads and the input over the NUMA nodes (see
+        uvmacparallel.h)
+      --json file: also write the results in JSON format to this file ("-"
+        for the standard output)
+
+    mixes:
+
+      large: one message of --size bytes, cut into segments hashed on all
+             threads and combined (ParallelHasher::vhash)
+      4k, 64k, 1m: messages of 4 kB, 64 kB or 1 MB, each hashed on one
+             thread (ParallelHasher::vhash_batch)
+      mixed: messages of 64 B to 1 MB, log-uniformly distributed, each
+             hashed on one thread
+
+    output format:
+
+      One CSV line per mix and thread count on the standard output, with
+      the throughput, the speedup and the efficiency (speedup divided by
+      the number of threads) relative to the first thread count, the time
+      per call spent combining segments on the calling thread, and the
+      time per call each thread spent waiting for the others on average
+      (see uvmacparallel.h), and the fraction of the bytes hashed by a
+      thread of another node than the one holding them (0 without --numa).
+      The input is in memory so that no disk is involved; --size should be
+      well above the size of the last level cache to measure memory
+      bandwidth limits too.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <ctime>
+#include <memory>
+#include "uvmaclib.h"
+#include "uvmacparallel.h"
+
+using namespace std;
+
+struct Mix
+{
+    string name;
+    bool single;                        // one message cut into segments
+    vector<const unsigned char *> m;    // messages
+    vector<uint64_t> mbytes;
+};
+
+struct Result
+{
+    string mix;
+    unsigned int threads;
+    uint64_t messages;
+    uint64_t bytes;          // per call
+    double seconds;          // per call, best sample
+    double combine_s;        // per call, same sample
+    double wait_s;           // per call and thread, same sample
+    double speedup;
+    double efficiency;
+    double remote;           // fraction of the bytes, same sample
+};
+
+static uint64_t rng_state = 1;
+
+static uint64_t rnd()
+{
+    rng_state ^= rng_state << 13; rng_state ^= rng_state >> 7; rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Lays out the messages back to back in buf, each followed by the zeros
+   vhash needs up to a 16-byte boundary */
+static void layout(Mix &mix, unsigned char *buf, const vector<uint64_t> &sizes)
+{
+    uint64_t pos = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        mix.m.push_back(buf + pos);
+        mix.mbytes.push_back(sizes[i]);
+        pos += (sizes[i] + 31) & ~(uint64_t)15;
+    }
+}
+
+static double seconds_since(chrono::steady_clock::time_point t0)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+/* ----------------------------------------------------------------------- */
+
+int main(int argc, char* argv[])
+{
+    unsigned int max_threads = max(1u, thread::hardware_concurrency());
+    vector<unsigned int> thread_list;
+    uint64_t size = UINT64_C(256) << 20;
+    int samples = 5;
+    bool pin = false, numa = false;
+    string json_file;
+    vector<string> mixes = {"large", "4k", "64k", "1m", "mixed"};
+
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == "--pin" || a == "--numa") {
+            (a == "--pin" ? pin : numa) = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            cerr << "Missing value for option " << a << endl;
+            return 1;
+        }
+        string v = argv[++i];
+        if (a == "--threads")
+            max_threads = max(1, atoi(v.c_str()));
+        else if (a == "--size")
+            size = strtoull(v.c_str(), NULL, 0);
+        else if (a == "--samples")
+            samples = max(1, atoi(v.c_str()));
+        else if (a == "--json")
+            json_file = v;
+        else if (a == "--thread-list" || a == "--mixes") {
+            stringstream ss(v);
+            string item;
+            if (a == "--mixes")
+                mixes.clear();
+            while (getline(ss, item, ',')) {
+                if (a == "--mixes")
+                    mixes.push_back(item);
+                else if (atoi(item.c_str()) > 0)
+                    thread_list.push_back(atoi(item.c_str()));
+            }
+        } else {
+            cerr << "Unknown option " << a << endl;
+            return 1;
+        }
+    }
+    if (thread_list.empty()) {
+        for (unsigned int t = 1; t < max_threads; t *= 2)
+            thread_list.push_back(t);
+        thread_list.push_back(max_threads);
+    }
+    if (size == 0) {
+        cerr << "The size must be positive" << endl;
+        return 1;
+    }
+
+    // 1. Key and input, all messages of a mix in one buffer
+    unsigned char key[8*(UVMAC_KEY_LEN)];
+    for (size_t i = 0; i < sizeof(key); ++i)
+        key[i] = (unsigned char)rnd();
+    for (unsigned int i = 0; i < 2*UVMAC_TAG_LEN/64; ++i)   // l3 keys below p64
+        key[sizeof(key) - 8*i - 8] = 0;
+    alignas(16) uvmax_ctx_t ctx;
+    uvmac_set_key(key, sizeof(key)/8, &ctx);
+
+    // With --numa, each part of the input is first written from the node
+    // whose threads will hash it
+    unique_ptr<ParallelHasher> toucher;
+    if (numa)
+        toucher.reset(new ParallelHasher(&ctx, *max_element(thread_list.begin(), thread_list.end()), pin, true));
+
+    vector<Mix> cases;
+    vector<unsigned char *> buffers;
+    for (size_t k = 0; k < mixes.size(); ++k) {
+        Mix mix;
+        mix.name = mixes[k];
+        mix.single = (mix.name == "large");
+        vector<uint64_t> sizes;
+        uint64_t fixed = mix.name == "4k" ? 4096 : mix.name == "64k" ? 65536 :
+                         mix.name == "1m" ? 1 << 20 : 0;
+        if (mix.single)
+            sizes.push_back(size);
+        else if (fixed)
+            sizes.assign(max((uint64_t)1, size / fixed), fixed);
+        else if (mix.name == "mixed") {
+            for (uint64_t total = 0; total < size; total += sizes.back())
+                sizes.push_back((uint64_t)(64 * pow(2.0, 14.0 * (rnd() % 10000) / 10000.0)));
+        } else {
+            cerr << "Unknown mix " << mix.name << endl;
+            return 1;
+        }
+        uint64_t len = 0;
+        for (size_t i = 0; i < sizes.size(); ++i)
+            len += (sizes[i] + 31) & ~(uint64_t)15;
+        unsigned char *buf = (unsigned char *)aligned_alloc(64, (len + 63) & ~(uint64_t)63);
+        if (!buf) {
+            cerr << "Could not allocate " << len << " bytes" << endl;
+            return 1;
+        }
+        if (toucher)
+            toucher->first_touch(buf, len);
+        for (uint64_t i = 0; i < len; i += 8) {
+            uint64_t x = rnd();
+            memcpy(buf + i, &x, 8);
+        }
+        layout(mix, buf, sizes);
+        for (size_t i = 0; i < sizes.size(); ++i)
+            memset((unsigned char *)mix.m[i] + sizes[i], 0, 16);
+        buffers.push_back(buf);
+        cases.push_back(mix);
+    }
+
+    // 2. Measurements
+    vector<Result> results;
+    cout << "mix,threads,messages,bytes,seconds,gb_per_s,speedup,efficiency,combine_s,wait_s,remote" << endl;
+    for (size_t k = 0; k < cases.size(); ++k) {
+        const Mix &mix = cases[k];
+        size_t n = mix.m.size();
+        vector<uint64_t> reference(n * (UVMAC_TAG_LEN/64)), out(n * (UVMAC_TAG_LEN/64));
+        double base = 0;
+        for (size_t t = 0; t < thread_list.size(); ++t) {
+            ParallelHasher hasher(&ctx, thread_list[t], pin, numa);
+            Result r;
+            r.mix = mix.name;
+            r.threads = thread_list[t];
+            r.messages = n;
+            r.bytes = 0;
+            for (size_t i = 0; i < n; ++i)
+                r.bytes += mix.mbytes[i];
+            r.seconds = 0;
+            for (int s = 0; s <= samples; ++s) {   // the first run warms up
+                hasher.reset_times();
+                chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+                if (mix.single)
+                    out[0] = hasher.vhash(mix.m[0], mix.mbytes[0], &out[0] + 1);
+                else
+                    hasher.vhash_batch(&mix.m[0], &mix.mbytes[0], n, &out[0]);
+                double dt = seconds_since(t0);
+                if (s && (r.seconds == 0 || dt < r.seconds)) {
+                    r.seconds = dt;
+                    r.combine_s = hasher.combine_seconds();
+                    r.wait_s = hasher.wait_seconds() / r.threads;
+                    uint64_t remote = 0;
+                    for (unsigned int d = 0; d < hasher.nodes(); ++d)
+                        remote += hasher.node_stats(d).remote_bytes;
+                    r.remote = (double)remote / r.bytes;
+                }
+            }
+            // All thread counts must agree with the first one
+            if (t == 0)
+                reference = out;
+            else if (out != reference) {
+                cerr << "Results differ between " << thread_list[0] << " and "
+                     << thread_list[t] << " threads for mix " << mix.name << endl;
+                return 1;
+            }
+            if (t == 0)
+                base = r.seconds;
+            r.speedup = base / r.seconds;
+            r.efficiency = r.speedup * thread_list[0] / r.threads;
+            results.push_back(r);
+            cout << r.mix << "," << r.threads << "," << r.messages << "," << r.bytes
+                 << "," << r.seconds << "," << r.bytes / r.seconds / 1e9
+                 << "," << r.speedup << "," << r.efficiency << "," << r.combine_s
+                 << "," << r.wait_s << "," << r.remote << endl;
+        }
+    }
+
+    // 3. JSON output
+    if (!json_file.empty()) {
+        ofstream file;
+        if (json_file != "-") {
+            file.open(json_file, ios::out);
+            if (!file) {
+                cerr << "Opening output file " << json_file << " failed" << endl;
+                return 1;
+            }
+        }
+        ostream &out = (json_file == "-") ? cout : file;
+        time_t t = time(NULL);
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+        out << "{" << endl;
+        out << "  \"date\": \"" << date << "\"," << endl;
+        out << "  \"cpus\": " << thread::hardware_concurrency() << "," << endl;
+        out << "  \"pinned\": " << (pin ? "true" : "false") << "," << endl;
+        out << "  \"numa_nodes\": " << (numa ? NumaTopology::host().nodes() : 1) << "," << endl;
+        out << "  \"tag_len\": " << UVMAC_TAG_LEN << "," << endl;
+        out << "  \"nhbytes\": " << UVMAC_NHBYTES << "," << endl;
+        out << "  \"results\": [" << endl;
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            out << "    {\"mix\": \"" << r.mix << "\", \"threads\": " << r.threads
+                << ", \"messages\": " << r.messages << ", \"bytes\": " << r.bytes
+                << ", \"seconds\": " << r.seconds
+                << ", \"gb_per_s\": " << r.bytes / r.seconds / 1e9
+                << ", \"speedup\": " << r.speedup << ", \"efficiency\": " << r.efficiency
+                << ", \"combine_s\": " << r.combine_s << ", \"wait_s\": " << r.wait_s
+                << ", \"remote\": " << r.remote << "}"
+                << (i + 1 < results.size() ? "," : "") << endl;
+        }
+        out << "  ]" << endl;
+        out << "}" << endl;
+    }
+
+    for (size_t i = 0; i < buffers.size(); ++i)
+        free(buffers[i]);
+    return 0;
+}
@@ -0,0 +1,295 @@
+/*  Sealed containers of the uvmac program, see uvmacseal.h
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include "uvmaclib.h"
+#include "uvmacbuffer.h"
+#include "uvmacseal.h"
+
+using namespace std;
+
+static const unsigned int lanes = UVMAC_TAG_LEN / 64;
+static const char seal_magic[8] = {'U', 'V', 'M', 'A', 'C', 'S', 'E', 'L'};
+
+static void put_le64(unsigned char *p, uint64_t x)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = (unsigned char)(x >> (8 * i));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; --i)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+// The hash context and the pad of a run
+struct SealKeys
+{
+    alignas(16) uvmax_ctx_t ctx;
+    ifstream pad;
+};
+
+static bool load_keys(const char *hash_key_file, const char *pad_key_file,
+                      int big_endian, SealKeys &keys)
+{
+    unsigned char hash_key_data[8*(UVMAC_KEY_LEN)];
+    ifstream file1(hash_key_file, ios::in | ios::binary);
+    file1.read((char *)hash_key_data, sizeof(hash_key_data));
+    if (!file1) {
+        cerr << "Reading the hash key file " << hash_key_file << " failed" << endl;
+        return false;
+    }
+    uvmac_set_key(hash_key_data, UVMAC_KEY_LEN, &keys.ctx);
+    uvmac_set_byte_order(&keys.ctx, big_endian);
+    keys.pad.open(pad_key_file, ios::in | ios::binary);
+    if (!keys.pad) {
+        cerr << "Opening pad key file " << pad_key_file << " failed" << endl;
+        return false;
+    }
+    return true;
+}
+
+/* The tag of the data hashed in seg with part message of the pad, as the
+   little-endian words of the container */
+static bool seal_tag(SealKeys &keys, const uvmac_segment_t &seg, uint64_t message,
+                     unsigned char out[8 * lanes])
+{
+    uint64_t running_key[lanes], position = 0, tag[lanes];
+    keys.pad.seekg(message * lanes * 8, ios::beg);
+    keys.pad.read((char *)running_key, sizeof(running_key));
+    if (!keys.pad) {
+        cerr << "The pad key file has no part " << message << endl;
+        return false;
+    }
+    tag[0] = uvmac_segment_tag(&seg, tag + 1, &keys.ctx, running_key, lanes, &position);
+    for (unsigned int lane = 0; lane < lanes; ++lane)
+        put_le64(out + 8 * lane, tag[lane]);
+    return true;
+}
+
+// The tag of the header, with part message of the pad
+static bool header_tag(SealKeys &keys, const unsigned char header[48], uint64_t message,
+                       unsigned char out[8 * lanes])
+{
+    alignas(16) unsigned char m[48 + 16] = {0};
+    memcpy(m, header, 48);
+    uvmac_segment_t seg;
+    uvmac_segment_init(&seg);
+    uvmac_segment_update(m, 48, &keys.ctx, &seg);
+    return seal_tag(keys, seg, message, out);
+}
+
+static FILE *open_file(const char *path, bool write)
+{
+    if (strcmp(path, "-") == 0)
+        return write ? stdout : stdin;
+    FILE *f = fopen(path, write ? "wb" : "rb");
+    if (!f)
+        cerr << "Opening " << path << " failed" << endl;
+    return f;
+}
+
+static bool close_file(FILE *f)
+{
+    if (f == stdin)
+        return true;
+    if (f == stdout)
+        return fflush(f) == 0;
+    return fclose(f) == 0;
+}
+
+int uvmac_seal(const char *hash_key_file, const char *pad_key_file,
+               uint64_t first_message, const char *input, const char *output,
+               unsigned int chunk_bytes)
+{
+    SealKeys keys;
+    if (!load_keys(hash_key_file, pad_key_file, UVMAC_PREFER_BIG_ENDIAN, keys))
+        return 1;
+    FILE *in = open_file(input, false), *out = in ? open_file(output, true) : NULL;
+    if (!in || !out)
+        return 1;
+
+    unsigned char header[48], word[8], tag[8 * lanes];
+    memcpy(header, seal_magic, 8);
+    put_le64(header + 8, UVMAC_TAG_LEN);
+    put_le64(header + 16, UVMAC_NHBYTES);
+    put_le64(header + 24, chunk_bytes);
+    put_le64(header + 32, first_message);
+    put_le64(header + 40, UVMAC_PREFER_BIG_ENDIAN);
+    uint64_t message = first_message, total = 0;
+    bool ok = header_tag(keys, header, message++, tag) &&
+              fwrite(header, sizeof(header), 1, out) == 1 && fwrite(tag, sizeof(tag), 1, out) == 1;
+
+    // One chunk in memory, hashed once as a segment for both tags
+    BufferPool pool(BufferPool::HUGE_TRANSPARENT);
+    unsigned char *m = pool.acquire(chunk_bytes);
+    uvmac_segment_t whole, seg;
+    uvmac_segment_init(&whole);
+    while (ok && m) {
+        size_t n = fread(m, 1, chunk_bytes, in);
+        if (n == 0)
+            break;
+        memset(m + n, 0, 16);
+        uvmac_segment_init(&seg);
+        uvmac_segment_update(m, (unsigned int)n, &keys.ctx, &seg);
+        put_le64(word, n);
+        ok = seal_tag(keys, seg, message++, tag) && fwrite(word, 8, 1, out) == 1 &&
+             fwrite(m, 1, n, out) == n && fwrite(tag, sizeof(tag), 1, out) == 1;
+        uvmac_segment_combine(&whole, &seg, &keys.ctx);
+        total += n;
+        if (n < chunk_bytes)
+            break;
+    }
+    if (!m) {
+        cerr << "Could not allocate a buffer of " << chunk_bytes << " bytes" << endl;
+        ok = false;
+    }
+    if (ferror(in)) {
+        cerr << "Reading " << input << " failed" << endl;
+        ok = false;
+    }
+    if (ok) {
+        put_le64(word, UVMAC_SEAL_END);
+        ok = seal_tag(keys, whole, message++, tag) && fwrite(word, 8, 1, out) == 1;
+        put_le64(word, total);
+        ok = ok && fwrite(word, 8, 1, out) == 1 && fwrite(tag, sizeof(tag), 1, out) == 1;
+    }
+    if (m)
+        pool.release(m);
+    close_file(in);
+    if (!close_file(out) || !ok) {
+        cerr << "Sealing " << input << " failed" << endl;
+        return 1;
+    }
+    cerr << "sealed: " << total << " bytes" << endl;
+    cerr << "next message number: " << message << endl;
+    return 0;
+}
+
+int uvmac_unseal(const char *hash_key_file, const char *pad_key_file,
+                 uint64_t first_message, const char *input, const char *output)
+{
+    FILE *in = open_file(input, false);
+    if (!in)
+        return 1;
+
+    // The header must match this build and the expected message number
+    unsigned char header[48], tag[8 * lanes], expected[8 * lanes];
+    if (fread(header, sizeof(header), 1, in) != 1 || fread(tag, sizeof(tag), 1, in) != 1 ||
+        memcmp(header, seal_magic, 8) != 0) {
+        cerr << input << " is not a sealed container" << endl;
+        close_file(in);
+        return 1;
+    }
+    uint64_t chunk_bytes = get_le64(header + 24), big_endian = get_le64(header + 40);
+    if (get_le64(header + 8) != UVMAC_TAG_LEN || get_le64(header + 16) != UVMAC_NHBYTES) {
+        cerr << input << " was sealed with " << get_le64(header + 8) << "-bit tags and "
+             << get_le64(header + 16) << "-byte blocks" << endl;
+        close_file(in);
+        return 1;
+    }
+    if (chunk_bytes < UVMAC_NHBYTES || chunk_bytes > UVMAC_SEAL_MAX_CHUNK ||
+        chunk_bytes % UVMAC_NHBYTES || big_endian > 1) {
+        cerr << input << " has an invalid header" << endl;
+        close_file(in);
+        return 1;
+    }
+    if (get_le64(header + 32) != first_message) {
+        cerr << input << " was sealed from message number " << get_le64(header + 32)
+             << ", not " << first_message << endl;
+        close_file(in);
+        return 1;
+    }
+    SealKeys keys;
+    if (!load_keys(hash_key_file, pad_key_file, (int)big_endian, keys)) {
+        close_file(in);
+        return 1;
+    }
+    // The chunk size among the rest, before it sizes the buffer
+    uint64_t message = first_message;
+    if (!header_tag(keys, header, message++, expected) || memcmp(tag, expected, sizeof(tag)) != 0) {
+        cerr << "The header tag of " << input << " differs" << endl;
+        close_file(in);
+        return 1;
+    }
+    FILE *out = open_file(output, true);
+    if (!out) {
+        close_file(in);
+        return 1;
+    }
+
+    // Each chunk is written out only once its tag is checked
+    BufferPool pool(BufferPool::HUGE_TRANSPARENT);
+    unsigned char *m = pool.acquire(chunk_bytes);
+    unsigned char word[8];
+    uvmac_segment_t whole, seg;
+    uvmac_segment_init(&whole);
+    uint64_t total = 0, chunks = 0, n = chunk_bytes;
+    const char *error = m ? NULL : "Could not allocate the chunk buffer";
+    while (!error) {
+        if (fread(word, 8, 1, in) != 1) {
+            error = "The container is cut short";
+            break;
+        }
+        uint64_t length = get_le64(word);
+        if (length == UVMAC_SEAL_END) {
+            if (fread(word, 8, 1, in) != 1 || fread(tag, sizeof(tag), 1, in) != 1)
+                error = "The container is cut short";
+            else if (get_le64(word) != total)
+                error = "The total length differs from the data";
+            else if (!seal_tag(keys, whole, message++, expected))
+                error = "No pad left for the whole tag";
+            else if (memcmp(tag, expected, sizeof(tag)) != 0)
+                error = "The whole tag differs: chunks were removed, added or moved";
+            else if (fgetc(in) != EOF)
+                error = "There is data after the end of the container";
+            break;
+        }
+        // Only the last chunk may be short
+        if (length == 0 || length > chunk_bytes || n < chunk_bytes) {
+            error = "Invalid chunk length";
+            break;
+        }
+        n = length;
+        if (fread(m, 1, n, in) != n || fread(tag, sizeof(tag), 1, in) != 1) {
+            error = "The container is cut short";
+            break;
+        }
+        memset(m + n, 0, 16);
+        uvmac_segment_init(&seg);
+        uvmac_segment_update(m, (unsigned int)n, &keys.ctx, &seg);
+        if (!seal_tag(keys, seg, message++, expected)) {
+            error = "No pad left for the chunk tag";
+            break;
+        }
+        if (memcmp(tag, expected, sizeof(tag)) != 0) {
+            error = "The chunk tag differs";
+            break;
+        }
+        if (fwrite(m, 1, n, out) != n) {
+            error = "Writing the data failed";
+            break;
+        }
+        uvmac_segment_combine(&whole, &seg, &keys.ctx);
+        total += n;
+        ++chunks;
+    }
+    if (m)
+        pool.release(m);
+    close_file(in);
+    if (!close_file(out) && !error)
+        error = "Writing the data failed";
+    if (error) {
+        cerr << error << " (chunk " << chunks << ", after " << total << " checked bytes)" << endl;
+        return 1;
+    }
+    cerr << "verified: " << chunks << " chunks, " << total << " bytes" << endl;
+    cerr << "next message number: " << message << endl;
+    return 0;
+}
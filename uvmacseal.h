@@ -0,0 +1,49 @@
+#ifndef HEADER_UVMAC_SEAL_H
+#define HEADER_UVMAC_SEAL_H
+
+/* --------------------------------------------------------------------------
+ * "uvmac seal" and "uvmac unseal": sealed containers, in which the data is
+ * cut into chunks that are each tagged, so that the receiver checks every
+ * chunk as it arrives instead of waiting for a whole file and its .tag.
+ *
+ * Format, all integers 64-bit little-endian:
+ *   header: "UVMACSEL", UVMAC_TAG_LEN, UVMAC_NHBYTES, the chunk size (a
+ *   multiple of UVMAC_NHBYTES, at most UVMAC_SEAL_MAX_CHUNK), the first
+ *   message number and the byte order of the words hashed (1 for
+ *   big-endian), then the tag of these 48 bytes;
+ *   chunks: the length of the chunk, its bytes and its tag (the
+ *   UVMAC_TAG_LEN/64 words as returned by uvmac, the high word first); all
+ *   chunks but the last one are full;
+ *   end: UVMAC_SEAL_END, the total length and the tag of the whole data.
+ * The header is tagged with the part first message number of the pad, as
+ * if it were chunk -1, chunk i with the part first message number + 1 + i,
+ * which binds it to its place, and the whole data with the next part, which
+ * binds the number of chunks: a container of n chunks uses n + 2 parts.
+ * The data is hashed once, each chunk as a segment; the whole tag comes
+ * from combining the segments.
+ *
+ * uvmac_seal reads input ("-" for the standard input) and writes the
+ * container to output ("-" for the standard output) in one pass, holding
+ * one chunk in memory. uvmac_unseal reads a container, checks its header
+ * before allocating the chunk buffer, so that a forged chunk size cannot
+ * make it take more memory, then checks each chunk before writing its
+ * bytes to output, and stops at the first chunk that fails, so that only
+ * checked data is passed on; it fails too when the container was sealed
+ * from another message number, is cut short or its whole tag differs.
+ * Both print the next unused message number on the standard error and
+ * return 0 on success.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+
+#define UVMAC_SEAL_END UINT64_C(0xffffffffffffffff)
+#define UVMAC_SEAL_MAX_CHUNK (UINT64_C(1) << 26)    /* 64 MB */
+
+int uvmac_seal(const char *hash_key_file, const char *pad_key_file,
+               uint64_t first_message, const char *input, const char *output,
+               unsigned int chunk_bytes);
+
+int uvmac_unseal(const char *hash_key_file, const char *pad_key_file,
+                 uint64_t first_message, const char *input, const char *output);
+
+#endif /* HEADER_UVMAC_SEAL_H */
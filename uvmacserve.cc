@@ -0,0 +1,234 @@
+/*  Loopback tagging service of the uvmac program, see uvmacserve.h
+*/
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "uvmaclib.h"
+#include "uvmacserve.h"
+
+using namespace std;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+    stop_requested = 1;
+}
+
+static void put_le64(unsigned char *p, uint64_t x)
+{
+    for (int i = 0; i < 8; ++i)
+        p[i] = (unsigned char)(x >> (8 * i));
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t x = 0;
+    for (int i = 7; i >= 0; --i)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+static bool read_all(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+    while (n) {
+        ssize_t r = recv(fd, p, n, 0);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char *)buf;
+    while (n) {
+        ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+// Reads and drops n bytes, 64 kB at a time
+static bool skip_all(int fd, uint64_t n)
+{
+    char scratch[65536];
+    while (n) {
+        size_t piece = n < sizeof(scratch) ? (size_t)n : sizeof(scratch);
+        if (!read_all(fd, scratch, piece))
+            return false;
+        n -= piece;
+    }
+    return true;
+}
+
+struct Service
+{
+    uvmax_ctx_t ctx;                  // copied by each connection
+    uint64_t *pad;
+    uint64_t pad_words;
+    uint64_t max_bytes;
+    atomic<uint64_t> next_message;    // next pad slice to hand out
+    atomic<uint64_t> tagged;
+};
+
+static void serve_connection(Service *service, int fd)
+{
+    const unsigned int lanes = UVMAC_TAG_LEN / 64;
+    alignas(16) uvmax_ctx_t ctx = service->ctx;
+    vector<unsigned char> buf;
+    unsigned char word[8], answer[8 * (1 + lanes)];
+    int one = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    put_le64(word, UVMAC_TAG_LEN);
+    if (!write_all(fd, word, 8)) {
+        close(fd);
+        return;
+    }
+    while (read_all(fd, word, 8)) {
+        uint64_t mbytes = get_le64(word);
+        memset(answer, 0, sizeof(answer));
+        if (mbytes > service->max_bytes || mbytes >= (UINT64_C(1) << 32)) {
+            // Refused without a message number, the connection kept in step
+            if (!skip_all(fd, mbytes))
+                break;
+            put_le64(answer, UVMAC_SERVE_ERROR);
+            if (!write_all(fd, answer, sizeof(answer)))
+                break;
+            continue;
+        }
+        buf.resize(mbytes + 16);
+        if (!read_all(fd, buf.data(), mbytes))
+            break;
+        memset(buf.data() + mbytes, 0, 16);
+
+        uint64_t n = service->next_message.fetch_add(1);
+        if (n < service->pad_words / lanes) {
+            uint64_t position = n * lanes, th, tl[lanes] = {0};
+            th = uvmac(buf.data(), (unsigned int)mbytes, tl, &ctx, service->pad,
+                       service->pad_words, &position);
+            put_le64(answer, n);
+            put_le64(answer + 8, th);
+            for (unsigned int lane = 1; lane < lanes; ++lane)
+                put_le64(answer + 8 + 8 * lane, tl[lane - 1]);
+            service->tagged.fetch_add(1);
+        } else
+            put_le64(answer, UVMAC_SERVE_ERROR);
+        if (!write_all(fd, answer, sizeof(answer)))
+            break;
+    }
+    close(fd);
+}
+
+int uvmac_serve(const char *hash_key_file, const char *pad_key_file,
+                uint64_t first_message, int port, uint64_t max_bytes)
+{
+    Service *service = new Service;
+    service->max_bytes = max_bytes;
+    service->next_message = first_message;
+    service->tagged = 0;
+
+    // Keys: the hash key in the context, the pad mapped in memory
+    unsigned char hash_key_data[8*(UVMAC_KEY_LEN)];
+    ifstream file1(hash_key_file, ios::in | ios::binary);
+    file1.read((char *)hash_key_data, sizeof(hash_key_data));
+    if (!file1) {
+        cerr << "Reading the hash key file " << hash_key_file << " failed" << endl;
+        return 1;
+    }
+    uvmac_set_key(hash_key_data, UVMAC_KEY_LEN, &service->ctx);
+
+    int pad_fd = open(pad_key_file, O_RDONLY);
+    struct stat st;
+    if (pad_fd < 0 || fstat(pad_fd, &st) != 0 || st.st_size < 8) {
+        cerr << "Opening pad key file " << pad_key_file << " failed" << endl;
+        return 1;
+    }
+    service->pad_words = st.st_size / 8;
+    service->pad = (uint64_t *)mmap(NULL, service->pad_words * 8, PROT_READ, MAP_SHARED, pad_fd, 0);
+    close(pad_fd);
+    if (service->pad == MAP_FAILED) {
+        cerr << "Mapping pad key file " << pad_key_file << " failed" << endl;
+        return 1;
+    }
+
+    // Loopback only
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 128) != 0) {
+        cerr << "Listening on 127.0.0.1:" << port << " failed: " << strerror(errno) << endl;
+        return 1;
+    }
+
+    // Signals are blocked but while waiting for a connection, so that one
+    // arriving before the wait ends it rather than being missed; connection
+    // threads inherit the mask that leaves them to this one
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t signals, unblocked;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &unblocked);
+    sigdelset(&unblocked, SIGINT);
+    sigdelset(&unblocked, SIGTERM);
+    // Non-blocking, for a connection gone between ppoll and accept
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+    cout << "serving on 127.0.0.1:" << port << " from message number " << first_message << endl;
+    struct pollfd waiting;
+    waiting.fd = listener;
+    waiting.events = POLLIN;
+    while (!stop_requested) {
+        if (ppoll(&waiting, 1, NULL, &unblocked) <= 0)
+            continue;
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        thread(serve_connection, service, fd).detach();
+    }
+    close(listener);
+
+    // Connections still open are cut when the program exits
+    cout << "messages: " << service->tagged.load() << endl;
+    cout << "next message number: " << service->next_message.load() << endl;
+    return 0;
+}
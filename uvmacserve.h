@@ -0,0 +1,32 @@
+#ifndef HEADER_UVMAC_SERVE_H
+#define HEADER_UVMAC_SERVE_H
+
+/* --------------------------------------------------------------------------
+ * "uvmac serve": tags messages received over TCP on the loopback interface.
+ *
+ * Protocol, all integers 64-bit little-endian:
+ *   on connection, the server sends UVMAC_TAG_LEN;
+ *   the client sends a message as its length then its bytes;
+ *   the server answers with the message number used for the pad followed
+ *   by the UVMAC_TAG_LEN/64 words of the tag (as returned by uvmac, the
+ *   high word first), or with UVMAC_SERVE_ERROR and zero words when the
+ *   pad is exhausted or the message is longer than max_bytes (its bytes
+ *   are then read and dropped, no message number is used);
+ * and so on until the client closes the connection.
+ *
+ * Each connection is served by its own thread, with its own copy of the
+ * hash context. Message numbers are handed out in the order messages are
+ * received, from first_message on, so that every pad slice of padKeyFile
+ * is used at most once; the pad file is mapped in memory. When stopped by
+ * SIGINT or SIGTERM the server prints the number of messages tagged and
+ * the next unused message number, from which a later run must start.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+
+#define UVMAC_SERVE_ERROR UINT64_C(0xffffffffffffffff)
+
+int uvmac_serve(const char *hash_key_file, const char *pad_key_file,
+                uint64_t first_message, int port, uint64_t max_bytes);
+
+#endif /* HEADER_UVMAC_SERVE_H */
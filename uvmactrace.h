@@ -0,0 +1,168 @@
+#ifndef HEADER_UVMAC_TRACE_H
+#define HEADER_UVMAC_TRACE_H
+
+/* --------------------------------------------------------------------------
+ * Tracing spans for the uvmac programs.
+ *
+ * A TraceSpan covers one stage of tagging on the calling thread: reading the
+ * input, hashing it, combining partial hashes, binding a pad slice to a tag
+ * or writing the tag. Spans are recorded between Trace::start() and
+ * Trace::stop() into per-thread buffers, and Trace::write() saves them as a
+ * Chrome trace (JSON, for chrome://tracing or ui.perfetto.dev), one track
+ * per thread. write() must only be called once the traced threads are done.
+ *
+ * When built with UVMAC_USDT (which needs <sys/sdt.h>), every span also fires
+ * the USDT probes uvmac:span_begin(stage) and uvmac:span_end(stage, bytes),
+ * with stage the name of the stage, whether or not recording is on:
+ *
+ *   bpftrace -e 'usdt:./uvmac:uvmac:span_end { @[str(arg0)] = sum(arg1); }'
+ *
+ * When recording is off a span costs a relaxed load and a branch, plus a
+ * nop per probe.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if UVMAC_USDT
+#include <sys/sdt.h>
+#define UVMAC_PROBE_BEGIN(stage)        DTRACE_PROBE1(uvmac, span_begin, stage)
+#define UVMAC_PROBE_END(stage, bytes)   DTRACE_PROBE2(uvmac, span_end, stage, bytes)
+#else
+#define UVMAC_PROBE_BEGIN(stage)
+#define UVMAC_PROBE_END(stage, bytes)
+#endif
+
+enum TraceStage { TRACE_READ, TRACE_HASH, TRACE_COMBINE, TRACE_PAD, TRACE_WRITE,
+                  TRACE_NUM_STAGES };
+
+class Trace
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    static const char *name(int stage)
+    {
+        static const char *names[TRACE_NUM_STAGES] =
+            {"read", "hash", "combine", "pad-bind", "write"};
+        return names[stage];
+    }
+
+    static Trace &instance()
+    {
+        static Trace trace;
+        return trace;
+    }
+
+    static bool enabled() { return flag().load(std::memory_order_relaxed); }
+
+    void start()
+    {
+        origin = Clock::now();
+        flag().store(true, std::memory_order_relaxed);
+    }
+
+    void stop() { flag().store(false, std::memory_order_relaxed); }
+
+    void record(int stage, Clock::time_point begin, Clock::time_point end, uint64_t bytes)
+    {
+        thread_local Buffer *buffer = 0;
+        if (!buffer) {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.emplace_back(new Buffer);
+            buffer = buffers.back().get();
+        }
+        Event event = {stage, begin, end, bytes};
+        buffer->events.push_back(event);
+    }
+
+    /* Returns false if the file could not be written */
+    bool write(const char *path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ofstream out(path);
+        out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        const char *separator = "\n";
+        for (size_t t = 0; t < buffers.size(); ++t) {
+            out << separator << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+                << t + 1 << ",\"args\":{\"name\":\"thread " << t + 1 << "\"}}";
+            separator = ",\n";
+            for (size_t i = 0; i < buffers[t]->events.size(); ++i) {
+                const Event &e = buffers[t]->events[i];
+                out << separator << "{\"name\":\"" << name(e.stage)
+                    << "\",\"cat\":\"uvmac\",\"ph\":\"X\",\"pid\":1,\"tid\":" << t + 1
+                    << ",\"ts\":" << microseconds(e.begin - origin)
+                    << ",\"dur\":" << microseconds(e.end - e.begin)
+                    << ",\"args\":{\"bytes\":" << e.bytes << "}}";
+            }
+        }
+        out << "\n]}\n";
+        return (bool)out;
+    }
+
+private:
+    struct Event {
+        int stage;
+        Clock::time_point begin, end;
+        uint64_t bytes;
+    };
+
+    struct Buffer {
+        std::vector<Event> events;
+    };
+
+    static std::atomic<bool> &flag()
+    {
+        static std::atomic<bool> on(false);
+        return on;
+    }
+
+    static double microseconds(Clock::duration d)
+    {
+        return std::chrono::duration<double, std::micro>(d).count();
+    }
+
+    Trace() {}
+
+    std::mutex mutex;   // guards buffers, not their contents
+    std::vector<std::unique_ptr<Buffer> > buffers;   // in order of first span
+    Clock::time_point origin;
+};
+
+/* Records the lifetime of the object as one span of the given stage */
+class TraceSpan
+{
+public:
+    explicit TraceSpan(int stage, uint64_t bytes = 0)
+        : stage(stage), bytes(bytes), active(Trace::enabled())
+    {
+        UVMAC_PROBE_BEGIN(Trace::name(stage));
+        if (active)
+            begin = Trace::Clock::now();
+    }
+
+    ~TraceSpan()
+    {
+        UVMAC_PROBE_END(Trace::name(stage), bytes);
+        if (active)
+            Trace::instance().record(stage, begin, Trace::Clock::now(), bytes);
+    }
+
+    void set_bytes(uint64_t n) { bytes = n; }
+
+private:
+    TraceSpan(const TraceSpan &);
+    TraceSpan &operator=(const TraceSpan &);
+
+    int stage;
+    uint64_t bytes;
+    bool active;
+    Trace::Clock::time_point begin;
+};
+
+#endif /* HEADER_UVMAC_TRACE_H */
@@ -0,0 +1,209 @@
+/*  Host tuning for the uvmac program, see uvmactune.h
+
+    Each setting is measured with the best of a few runs, and the smallest
+    setting within 3% of the fastest one is kept: fewer threads leave cpus
+    to the rest of the host and smaller buffers use less memory for the
+    same speed.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include "uvmaclib.h"
+#include "uvmaclib_internal.h"
+#include "uvmacparallel.h"
+#include "uvmactune.h"
+
+using namespace std;
+
+static const int runs = 3;
+
+static double seconds_since(chrono::steady_clock::time_point t0)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+/* Best time of f() over a few runs, after one warm-up run */
+template <class F>
+static double best_time(F f)
+{
+    double best = 0;
+    for (int r = 0; r <= runs; ++r) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        f();
+        double dt = seconds_since(t0);
+        if (r && (best == 0 || dt < best))
+            best = dt;
+    }
+    return best;
+}
+
+/* Index of the smallest setting within 3% of the fastest one, settings
+   being in increasing order */
+static size_t pick(const vector<double> &gb_per_s)
+{
+    double best = *max_element(gb_per_s.begin(), gb_per_s.end());
+    size_t i = 0;
+    while (gb_per_s[i] < 0.97 * best)
+        ++i;
+    return i;
+}
+
+/* Reads and hashes the file as the uvmac program does */
+static uint64_t hash_file(const string &path, unsigned char *m, unsigned int buf_len,
+                          ParallelHasher &hasher, const uvmax_ctx_t *ctx)
+{
+    ifstream file(path, ios::in | ios::binary);
+    uvmac_segment_t seg;
+    uvmac_segment_init(&seg);
+    while (file) {
+        file.read((char *)m, buf_len);
+        streamsize n = file.gcount();
+        if (n <= 0)
+            break;
+        memset(m + n, 0, 16);
+        hasher.update(seg, m, n);
+    }
+    uint64_t tagl[UVMAC_TAG_LEN/64];
+    return uvmac_segment_vhash(&seg, tagl, ctx);
+}
+
+int uvmac_tune(const char *profile_path, const char *dir, uint64_t size)
+{
+    uvmac_profile_t profile;
+    memset(&profile, 0, sizeof(profile));
+    if (!profile_path)
+        profile_path = uvmac_profile_path();
+    size -= size % UVMAC_NHBYTES;
+    if (size < (1 << 16)) {
+        cerr << "The tuning size must be at least 64 kB" << endl;
+        return 1;
+    }
+
+    // Random key and input
+    unsigned char key[8*(UVMAC_KEY_LEN)];
+    uint64_t x = UINT64_C(0x9e3779b97f4a7c15);
+    for (size_t i = 0; i < sizeof(key); ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        key[i] = (unsigned char)x;
+    }
+    for (unsigned int i = 0; i < 2*UVMAC_TAG_LEN/64; ++i)   // l3 keys below p64
+        key[sizeof(key) - 8*i - 8] = 0;
+    alignas(16) uvmax_ctx_t ctx;
+    uvmac_set_key(key, sizeof(key)/8, &ctx);
+
+    unsigned char *m = (unsigned char *)aligned_alloc(64, (size + 127) & ~(uint64_t)63);
+    if (!m) {
+        cerr << "Could not allocate " << size << " bytes" << endl;
+        return 1;
+    }
+    for (uint64_t i = 0; i < size + 64; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        m[i] = (unsigned char)x;
+    }
+
+    cout << "UVMAC_TAG_LEN " << UVMAC_TAG_LEN << " and UVMAC_NHBYTES " << UVMAC_NHBYTES
+         << " are fixed at compile time since they change the tag" << endl;
+
+    // 1. Kernels, on one thread, the pipelined one at several prefetch
+    // distances since it is meant for data out of cache, as here
+    cout << "kernels:" << endl;
+    vector<double> speeds;
+    vector<unsigned int> kernels, distances;
+    unsigned int default_distance = uvmac_prefetch_get();
+    for (unsigned int k = 0; k < uvmac_kernel_count(); ++k) {
+        // The streaming kernel trades speed for the caches of other programs
+        if (strcmp(uvmac_kernel_info(k)->name, "streaming") == 0 || !uvmac_kernel_select(k))
+            continue;
+        bool pipelined = (strcmp(uvmac_kernel_info(k)->name, "pipelined") == 0);
+        vector<unsigned int> tried(1, default_distance);
+        if (pipelined)
+            tried = {0, 512, 1024, 2048, 4096, 8192};
+        for (size_t d = 0; d < tried.size(); ++d) {
+            uvmac_prefetch_set(tried[d]);
+            uint64_t tagl[UVMAC_TAG_LEN/64];
+            double t = best_time([&] { vhash(m, (unsigned int)min(size, (uint64_t)1 << 30), tagl, &ctx); });
+            kernels.push_back(k);
+            distances.push_back(tried[d]);
+            speeds.push_back(min(size, (uint64_t)1 << 30) / t / 1e9);
+            cout << "  " << uvmac_kernel_info(k)->name;
+            if (pipelined)
+                cout << " (prefetch " << tried[d] << ")";
+            cout << ": " << speeds.back() << " GB/s" << endl;
+        }
+    }
+    size_t best = max_element(speeds.begin(), speeds.end()) - speeds.begin();
+    uvmac_kernel_select(kernels[best]);
+    uvmac_prefetch_set(distances[best]);
+    snprintf(profile.kernel, sizeof(profile.kernel), "%s", uvmac_kernel_info(kernels[best])->name);
+    if (strcmp(profile.kernel, "pipelined") == 0)
+        profile.prefetch_bytes = distances[best];
+
+    // 2. Threads, hashing in memory
+    cout << "threads:" << endl;
+    vector<unsigned int> counts;
+    unsigned int cpus = max(1u, thread::hardware_concurrency());
+    for (unsigned int t = 1; t < cpus; t *= 2)
+        counts.push_back(t);
+    counts.push_back(cpus);
+    speeds.clear();
+    for (size_t i = 0; i < counts.size(); ++i) {
+        ParallelHasher hasher(&ctx, counts[i]);
+        uint64_t tagl[UVMAC_TAG_LEN/64];
+        double t = best_time([&] { hasher.vhash(m, size, tagl); });
+        speeds.push_back(size / t / 1e9);
+        cout << "  " << counts[i] << ": " << speeds.back() << " GB/s" << endl;
+    }
+    profile.threads = counts[pick(speeds)];
+
+    // 3. Read buffer sizes, reading and hashing a file
+    cout << "buffer sizes:" << endl;
+    string path = string(dir) + "/uvmac_tune.XXXXXX";
+    vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        cerr << "Creating a file in " << dir << " failed" << endl;
+        free(m);
+        return 1;
+    }
+    path = &name[0];
+    bool written = (write(fd, m, size) == (ssize_t)size);
+    close(fd);
+    vector<uint64_t> buffers;
+    for (uint64_t b = 1 << 16; b <= min(size, (uint64_t)1 << 26); b *= 4)
+        buffers.push_back(b);
+    unsigned char *buf = (unsigned char *)aligned_alloc(64, buffers.back() + 64);
+    speeds.clear();
+    ParallelHasher hasher(&ctx, profile.threads);
+    for (size_t i = 0; written && buf && i < buffers.size(); ++i) {
+        double t = best_time([&] { hash_file(path, buf, (unsigned int)buffers[i], hasher, &ctx); });
+        speeds.push_back(size / t / 1e9);
+        cout << "  " << buffers[i] << ": " << speeds.back() << " GB/s" << endl;
+    }
+    remove(path.c_str());
+    free(buf);
+    free(m);
+    if (speeds.empty()) {
+        cerr << "Writing " << size << " bytes to " << path << " failed" << endl;
+        return 1;
+    }
+    profile.buffer_bytes = buffers[pick(speeds)];
+
+    if (!uvmac_profile_save(profile_path, &profile)) {
+        cerr << "Writing the profile " << profile_path << " failed" << endl;
+        return 1;
+    }
+    cout << "profile " << profile_path << ": kernel " << profile.kernel << ", ";
+    if (profile.prefetch_bytes)
+        cout << profile.prefetch_bytes << "-byte prefetch, ";
+    cout << profile.threads << " threads, " << profile.buffer_bytes << "-byte buffer" << endl;
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef HEADER_UVMAC_TUNE_H
+#define HEADER_UVMAC_TUNE_H
+
+/* --------------------------------------------------------------------------
+ * "uvmac tune": measures the block kernels (the pipelined one at several
+ * prefetch distances), the number of hashing threads and the read buffer
+ * sizes on the local host and saves the fastest settings as a profile
+ * (see uvmac_profile_load in uvmaclib.h).
+ *
+ * The kernels and thread counts are measured on size bytes in memory, the
+ * buffer sizes by reading and hashing a file of size bytes created in dir,
+ * so dir should be on the disk the inputs will come from; size is at least
+ * 64 kB. Progress goes to the standard output. Returns the exit status of
+ * the program.
+ * ----------------------------------------------------------------------- */
+
+#include <stdint.h>
+
+int uvmac_tune(const char *profile_path, const char *dir, uint64_t size);
+
+#endif /* HEADER_UVMAC_TUNE_H */